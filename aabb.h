@@ -3,28 +3,47 @@
 
 #include<vec3.h>
 #include<ray.h>
+#include<algorithm>
 
-class aabb_t
+// Ray data every box test of one traversal shares, computed once per ray.
+struct ray_inv_t
+{
+    point3_t orig;
+    vec3_t   inv_dir;
+    int      sign[3];
+
+    ray_inv_t(const ray_t &r):orig(r.origin())
+    {
+        auto d=r.direction();
+        inv_dir=vec3_t(1/d.x,1/d.y,1/d.z);
+        sign[0]=inv_dir.x<0;
+        sign[1]=inv_dir.y<0;
+        sign[2]=inv_dir.z<0;
+    }
+};
+
+template<class T>
+class basic_aabb_t
 {
 public:
-    point3_t minimum;
-    point3_t maximum;
+    basic_vec3_t<T> minimum;
+    basic_vec3_t<T> maximum;
 
-    aabb_t()=default;
-    aabb_t(point3_t a,point3_t b):minimum{a},maximum{b}{}
+    basic_aabb_t()=default;
+    basic_aabb_t(basic_vec3_t<T> a,basic_vec3_t<T> b):minimum{a},maximum{b}{}
 
-    point3_t min()const{return minimum;}
-    point3_t max()const{return maximum;}
+    basic_vec3_t<T> min()const{return minimum;}
+    basic_vec3_t<T> max()const{return maximum;}
 
-    bool hit(const ray_t &r,double t_min, double t_max)const
+    bool hit(const basic_ray_t<T> &r,T t_min, T t_max)const
     {
-        double A[3]={r.origin().x,r.origin().y,r.origin().z};
-        double b[3]={r.direction().x,r.direction().y,r.direction().z};
-        double x0[3]={minimum.x,minimum.y,minimum.z};
-        double x1[3]={maximum.x,maximum.y,maximum.z};
+        T A[3]={r.origin().x,r.origin().y,r.origin().z};
+        T b[3]={r.direction().x,r.direction().y,r.direction().z};
+        T x0[3]={minimum.x,minimum.y,minimum.z};
+        T x1[3]={maximum.x,maximum.y,maximum.z};
         for(int i=0;i<3;i++)
         {
-            auto invD=1.0/b[i];
+            auto invD=1/b[i];
             auto t0=(x0[i]-A[i])*invD;
             auto t1=(x1[i]-A[i])*invD;
             if(t0>t1)
@@ -36,21 +55,42 @@ public:
         }
         return true;
     }
+
+    // slab test without divisions or swaps, the near/far planes are picked by sign
+    bool hit(const ray_inv_t &r,T t_min,T t_max)const
+    {
+        auto tx0=((r.sign[0]?maximum:minimum).x-r.orig.x)*r.inv_dir.x;
+        auto tx1=((r.sign[0]?minimum:maximum).x-r.orig.x)*r.inv_dir.x;
+        auto ty0=((r.sign[1]?maximum:minimum).y-r.orig.y)*r.inv_dir.y;
+        auto ty1=((r.sign[1]?minimum:maximum).y-r.orig.y)*r.inv_dir.y;
+        auto tz0=((r.sign[2]?maximum:minimum).z-r.orig.z)*r.inv_dir.z;
+        auto tz1=((r.sign[2]?minimum:maximum).z-r.orig.z)*r.inv_dir.z;
+        // 0*inf from an origin on a slab plane is NaN, keep it in the second slot so it is ignored
+        t_min=std::max(std::max(std::max(t_min,tx0),ty0),tz0);
+        t_max=std::min(std::min(std::min(t_max,tx1),ty1),tz1);
+        // the exit widened by the worst rounding of the slab distances, a
+        // flat box (an axis aligned triangle) is otherwise missed by an ulp
+        constexpr T far_scale=1+2*3*std::numeric_limits<T>::epsilon();
+        return t_min<=t_max*far_scale;
+    }
 };
 
-inline aabb_t surrounding_box(aabb_t box0,aabb_t box1)
+using aabb_t=basic_aabb_t<real_t>;
+
+template<class T>
+inline basic_aabb_t<T> surrounding_box(basic_aabb_t<T> box0,basic_aabb_t<T> box1)
 {
-    point3_t small(
-        fmin(box0.min().x,box1.min().x),
-        fmin(box0.min().y,box1.min().y),
-        fmin(box0.min().z,box1.min().z)
+    basic_vec3_t<T> small(
+        std::fmin(box0.min().x,box1.min().x),
+        std::fmin(box0.min().y,box1.min().y),
+        std::fmin(box0.min().z,box1.min().z)
     );
-    point3_t big(
-        fmax(box0.max().x,box1.max().x),
-        fmax(box0.max().y,box1.max().y),
-        fmax(box0.max().z,box1.max().z)
+    basic_vec3_t<T> big(
+        std::fmax(box0.max().x,box1.max().x),
+        std::fmax(box0.max().y,box1.max().y),
+        std::fmax(box0.max().z,box1.max().z)
     );
-    return aabb_t(small,big);
+    return basic_aabb_t<T>(small,big);
 }
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include<aabb.h>
 #include<hittable.h>
 #include<plane.h>
+#include<material.h>
 
 class rect_t:public hittable_t
 {
@@ -11,7 +12,7 @@ public:
     vec3_t n;
     point3_t min,max;
     std::shared_ptr<material_t> mat_ptr;
-    double d;
+    real_t d;
     rect_t()=default;
     rect_t(vec3_t normal,point3_t a,point3_t b,std::shared_ptr<material_t> mat):n(normal),mat_ptr(mat)
     {
@@ -21,38 +22,118 @@ public:
         min-=vec3_t(e,e,e);
         max=point3_t(fmax(a.x,b.x),fmax(a.y,b.y),fmax(a.z,b.z))+vec3_t(e,e,e);
     }
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t t;
+        point3_t p;
+        if(intersect(r,t_min,t_max,t,p)==false)
+            return {false,{}};
+        return {true,record(r,p,t)};
+    }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t t;
+        point3_t p;
+        return intersect(r,t_min,t_max,t,p);
+    }
+    bool intersect(const ray_t &r, real_t t_min, real_t t_max, real_t &t, point3_t &p) const
+    {
+        return intersect(n,d,min,max,r,t_min,t_max,t,p);
+    }
+    // the tests without an object, for copies of the fields kept elsewhere
+    static bool intersect(const vec3_t &n, real_t d, const point3_t &min, const point3_t &max, const ray_t &r, real_t t_min, real_t t_max, real_t &t, point3_t &p)
     {
         auto denominator=dot(n,r.direction());
         if(denominator==0)
-            return {false,{}};
-        auto t=(-d-dot(n,r.origin()))/denominator;
+            return false;
+        t=(-d-dot(n,r.origin()))/denominator;
         
         if(t<t_min || t> t_max)
-            return {false,{}};
-        auto p=r.at(t);
-        if(is_in_rect(p)==false)
-            return {false,{}};
-        hit_record_t rec{};
-        rec.p=p;
-        rec.t=t;
-        rec.mat_ptr=mat_ptr;
-        rec.set_face_normal(r,n);
-        rec.u=1;
-        rec.v=1;
-        return {true,rec};
+            return false;
+        p=r.at(t);
+        return is_in_rect(n,min,max,p);
+    }
+    virtual void hit_packet(ray_packet_t &packet,uint32_t mask,real_t t_min)const override
+    {
+        constexpr int lanes=ray_packet_t::max_size;
+        real_t ts[lanes];
+        bool   is_hit[lanes];
+        for(int i=0;i<lanes;i++)
+        {
+            auto denominator=n.x*packet.dx[i]+n.y*packet.dy[i]+n.z*packet.dz[i];
+            auto t=(-d-(n.x*packet.ox[i]+n.y*packet.oy[i]+n.z*packet.oz[i]))/denominator;
+            auto px=packet.ox[i]+t*packet.dx[i];
+            auto py=packet.oy[i]+t*packet.dy[i];
+            auto pz=packet.oz[i]+t*packet.dz[i];
+            auto in_rect=(n.x!=0 || (px>=min.x && px<=max.x)) && (n.y!=0 || (py>=min.y && py<=max.y)) && (n.z!=0 || (pz>=min.z && pz<=max.z));
+            ts[i]=t;
+            is_hit[i]=denominator!=0 && t>=t_min && t<=packet.t_max[i] && in_rect;
+        }
+        for(int i=0;i<packet.size;i++)
+        {
+            if((mask>>i&1) && is_hit[i])
+            {
+                auto r=packet.ray(i);
+                packet.update(i,record(r,r.at(ts[i]),ts[i]));
+            }
+        }
     }
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const
     {
-        auto offset=n.unit()*0.0001;
+        // pad the flat side, a normal with negative components must not invert the box
+        auto u=n.unit();
+        auto offset=vec3_t(fabs(u.x),fabs(u.y),fabs(u.z))*0.0001;
         return {true,aabb_t(min-offset,max+offset)};
     }
 
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        out.push_back(mat_ptr);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        if(mat_ptr->is_emissive())
+            out.push_back(this);
+    }
+    // uniform over the area, converted to solid angle by dist^2/cos
+    virtual double pdf_value(const point3_t &o,const vec3_t &v)const override
+    {
+        real_t t;
+        point3_t p;
+        if(intersect(ray_t(o,v,0),ray_t_min,infinity,t,p)==false)
+            return 0;
+        auto distance_squared=t*t*v.len_squared();
+        auto cosine=fabs(dot(v,n))/(v.len()*n.len());
+        return distance_squared/(cosine*area());
+    }
+    virtual vec3_t random(const point3_t &o)const override
+    {
+        // the flat axis spans only the padding, project back onto the plane
+        auto p=point3_t(rand_double(min.x,max.x),rand_double(min.y,max.y),rand_double(min.z,max.z));
+        p-=n*((dot(n,p)+d)/n.len_squared());
+        return p-o;
+    }
+    real_t area()const
+    {
+        auto size=max-min;
+        if(n.x!=0)
+            return size.y*size.z;
+        if(n.y!=0)
+            return size.x*size.z;
+        return size.x*size.y;
+    }
+
+    // p is on the plane already, the flat axis is not tested: its 1e-8
+    // padding is lost to rounding in float away from the origin
     bool is_in_rect(const point3_t &p) const
     {
-        auto x_in=p.x>=min.x && p.x<=max.x;
-        auto y_in=p.y>=min.y && p.y<=max.y;
-        auto z_in=p.z>=min.z && p.z<=max.z;
+        return is_in_rect(n,min,max,p);
+    }
+    static bool is_in_rect(const vec3_t &n, const point3_t &min, const point3_t &max, const point3_t &p)
+    {
+        auto x_in=n.x!=0 || (p.x>=min.x && p.x<=max.x);
+        auto y_in=n.y!=0 || (p.y>=min.y && p.y<=max.y);
+        auto z_in=n.z!=0 || (p.z>=min.z && p.z<=max.z);
         if( x_in && y_in && z_in )
             return true;
         else 
@@ -67,6 +148,23 @@ public:
         d=-dot(n,min+vec3_t(e,e,e));
     }
 
+    static hit_record_t record(const vec3_t &n, real_t d, const material_t *mat, const ray_t &r, const point3_t &p, real_t t)
+    {
+        hit_record_t rec{};
+        rec.p=p-n*((dot(n,p)+d)/n.len_squared());    // back onto the plane
+        rec.t=t;
+        rec.mat_ptr=mat;
+        rec.set_face_normal(r,n);
+        rec.u=1;
+        rec.v=1;
+        return rec;
+    }
+
+private:
+    hit_record_t record(const ray_t &r,const point3_t &p,real_t t)const
+    {
+        return record(n,d,mat_ptr.get(),r,p,t);
+    }
 };
 
 class xrect_t:public hittable_t
@@ -77,24 +175,75 @@ public:
     xrect_t(){};
     //xrect_t(const xrect_t &&)=default;
     xrect_t(point3_t center,vec3_t width,vec3_t height,std::shared_ptr<material_t> mat):rect(center,width,height,mat){}
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
     {
         auto [is_hit,rec]=rect.hit(r,t_min,t_max);
         if(is_hit==false)
             return {false,{}};
-        
-        auto v=rec.p-(rect.center-0.5*rect.width-0.5*rect.height);
-        auto width_dot=dot(v,rect.width.unit());
-        auto height_dot=dot(v,rect.height.unit());
-        auto in_width= width_dot>=0 && width_dot <= rect.width.len() ;
-        auto in_height= height_dot>=0 && height_dot <= rect.height.len();
-        if(in_width && in_height)
+        if(is_in_rect(rec.p))
             return {true,rec};
         return {false,{}};
     }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t t;
+        if(rect.intersect(r,t_min,t_max,t)==false)
+            return false;
+        return is_in_rect(r.at(t));
+    }
+    bool is_in_rect(const point3_t &p) const
+    {
+        return is_in_rect(rect.center,rect.width,rect.height,p);
+    }
+    static bool is_in_rect(const point3_t &center, const vec3_t &width, const vec3_t &height, const point3_t &p)
+    {
+        auto v=p-(center-0.5*width-0.5*height);
+        auto width_dot=dot(v,width.unit());
+        auto height_dot=dot(v,height.unit());
+        auto in_width= width_dot>=0 && width_dot <= width.len() ;
+        auto in_height= height_dot>=0 && height_dot <= height.len();
+        return in_width && in_height;
+    }
+    // the four corners, padded like rect_t where the quad lies in an axis plane
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const override
     {
-        return rect.bounding_box(time0,time1);
+        auto corner=rect.center-0.5*rect.width-0.5*rect.height;
+        point3_t corners[]={corner,corner+rect.width,corner+rect.height,corner+rect.width+rect.height};
+        auto lo=corner,hi=corner;
+        for(auto &c:corners)
+        {
+            lo=point3_t(std::fmin(lo.x,c.x),std::fmin(lo.y,c.y),std::fmin(lo.z,c.z));
+            hi=point3_t(std::fmax(hi.x,c.x),std::fmax(hi.y,c.y),std::fmax(hi.z,c.z));
+        }
+        auto pad=[](real_t &a,real_t &b){if(b-a<0.0001){a-=0.0001;b+=0.0001;}};
+        pad(lo.x,hi.x);
+        pad(lo.y,hi.y);
+        pad(lo.z,hi.z);
+        return {true,aabb_t(lo,hi)};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        rect.collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        if(rect.mat_ptr->is_emissive())
+            out.push_back(this);
+    }
+    virtual double pdf_value(const point3_t &o,const vec3_t &v)const override
+    {
+        real_t t;
+        ray_t r(o,v,0);
+        if(rect.intersect(r,ray_t_min,infinity,t)==false || is_in_rect(r.at(t))==false)
+            return 0;
+        auto distance_squared=t*t*v.len_squared();
+        auto cosine=fabs(dot(v,rect.n))/(v.len()*rect.n.len());
+        return distance_squared/(cosine*rect.width.len()*rect.height.len());
+    }
+    virtual vec3_t random(const point3_t &o)const override
+    {
+        auto p=rect.center+(rand_uniform()-0.5)*rect.width+(rand_uniform()-0.5)*rect.height;
+        return p-o;
     }
     void move(vec3_t direction)
     {
@@ -0,0 +1,148 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include<vec3.h>
+#include<scheduler.h>
+#include<vector>
+#include<algorithm>
+#include<cstdio>
+
+// Running mean and variance of one pixel (Welford), per channel, so noise
+// in colour shows up as well as noise in brightness.
+struct pixel_estimate_t
+{
+    colour_t sum{0,0,0};
+    int    n=0;
+    double mean[3]={0,0,0};
+    double m2[3]={0,0,0};
+
+    void add(const colour_t &c)
+    {
+        sum+=c;
+        n++;
+        double x[3]={double(c.x),double(c.y),double(c.z)};
+        for(int k=0;k<3;k++)
+        {
+            auto delta=x[k]-mean[k];
+            mean[k]+=delta/n;
+            m2[k]+=delta*(x[k]-mean[k]);
+        }
+    }
+    double variance(int k)const{return n>1?m2[k]/(n-1):0;}
+    // half width of the 95% confidence interval of the mean of channel k
+    double error(int k)const{return 1.96*std::sqrt(variance(k)/n);}
+    colour_t value()const{return n?sum*(1.0/n):colour_t(0,0,0);}
+};
+
+// Samples every pixel in batches until, in each channel, the confidence
+// interval of its mean is below threshold or the channel is certain to clamp
+// to white, or max_spp is reached.  The threshold applies after the
+// gamma 2 of write_clour, where an error e around mean m shows up as about
+// e/(2*sqrt(m)), so dark regions do not soak up samples they cannot show.
+class adaptive_sampler_t
+{
+public:
+    double threshold;
+    int min_spp;
+    int max_spp;
+    int batch;
+    std::vector<int> spp;      // samples taken per pixel
+
+    adaptive_sampler_t(size_t pixel_count,double threshold=0.005,int min_spp=16,int max_spp=1024,int batch=16)
+        :threshold(threshold),min_spp(std::max(min_spp,2)),max_spp(std::max(max_spp,min_spp)),batch(std::max(batch,1)),spp(pixel_count,0)
+    {
+    }
+
+    // Renders one tile into framebuffer, rows from the top.  sample(x,y,k)
+    // traces sample k of pixel (x,y) and returns its colour.  Every pixel
+    // takes min_spp, then rounds of batch samples go to each pixel that has
+    // not converged or has a neighbour that has not: a pixel whose first
+    // samples all missed a rare bright path (fog lit through a small light)
+    // is kept going by the neighbours that did see one.
+    template<class sample_fn_t>
+    void render(int image_width,const tile_t &tile,sample_fn_t &&sample,std::vector<colour_t> &framebuffer)
+    {
+        int w=tile.x1-tile.x0;
+        int h=tile.y1-tile.y0;
+        std::vector<pixel_estimate_t> estimates(size_t(w)*h);
+        std::vector<char> active(estimates.size(),1);
+        std::vector<char> done(estimates.size());
+        for(int target=min_spp;;target=std::min(target+batch,max_spp))
+        {
+            for(int y=0;y<h;y++)
+            {
+                for(int x=0;x<w;x++)
+                {
+                    auto &estimate=estimates[size_t(y)*w+x];
+                    if(active[size_t(y)*w+x]==false)
+                        continue;
+                    while(estimate.n<target)
+                        estimate.add(sample(tile.x0+x,tile.y0+y,estimate.n));
+                }
+            }
+            if(target>=max_spp)
+                break;
+            for(size_t i=0;i<estimates.size();i++)
+                done[i]=converged(estimates[i]);
+            bool any=false;
+            for(int y=0;y<h;y++)
+            {
+                for(int x=0;x<w;x++)
+                {
+                    bool is_active=false;
+                    for(int yy=std::max(y-1,0);yy<=std::min(y+1,h-1);yy++)
+                        for(int xx=std::max(x-1,0);xx<=std::min(x+1,w-1);xx++)
+                            is_active|=done[size_t(yy)*w+xx]==false;
+                    active[size_t(y)*w+x]=is_active;
+                    any|=is_active;
+                }
+            }
+            if(any==false)
+                break;
+        }
+        for(int y=0;y<h;y++)
+        {
+            for(int x=0;x<w;x++)
+            {
+                auto index=size_t(tile.y0+y)*image_width+tile.x0+x;
+                framebuffer[index]=estimates[size_t(y)*w+x].value();
+                spp[index]=estimates[size_t(y)*w+x].n;
+            }
+        }
+    }
+
+    bool converged(const pixel_estimate_t &estimate)const
+    {
+        for(int k=0;k<3;k++)
+        {
+            auto mean=estimate.mean[k],error=estimate.error(k);
+            // a channel already certain to clamp to white needs no more
+            if(mean-error<1 && error>threshold*2*std::sqrt(std::max(mean,0.0)))
+                return false;
+        }
+        return true;
+    }
+
+    size_t total()const
+    {
+        size_t sum=0;
+        for(auto n:spp)
+            sum+=n;
+        return sum;
+    }
+
+    // greyscale PGM, white is max_spp
+    bool write_spp_map(const char *path,int image_width,int image_height)const
+    {
+        auto file=std::fopen(path,"w");
+        if(file==nullptr)
+            return false;
+        std::fprintf(file,"P2 %d %d 255\n",image_width,image_height);
+        for(auto n:spp)
+            std::fprintf(file,"%d\n",int(255.0*n/max_spp));
+        std::fclose(file);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include<cstddef>
+#include<cstdint>
+#include<memory>
+#include<vector>
+#include<algorithm>
+
+// Memory handed out by bumping a pointer through large chunks and given
+// back all at once when the arena goes.  Objects made one after another sit
+// next to each other, and freeing them costs a call per chunk, not per
+// object.  Not thread safe.
+class arena_t
+{
+public:
+    explicit arena_t(size_t chunk_size=size_t(1)<<16):chunk_size(chunk_size){}
+    arena_t(const arena_t&)=delete;
+    arena_t &operator=(const arena_t&)=delete;
+
+    void *allocate(size_t bytes,size_t align)
+    {
+        auto p=(reinterpret_cast<uintptr_t>(next)+align-1)&~uintptr_t(align-1);
+        if(next==nullptr || p+bytes>reinterpret_cast<uintptr_t>(end))
+        {
+            // what does not fit in a fresh chunk gets one of its own
+            auto size=std::max(chunk_size,bytes+align);
+            chunks.emplace_back(new std::byte[size]);
+            reserved+=size;
+            next=chunks.back().get();
+            end=next+size;
+            p=(reinterpret_cast<uintptr_t>(next)+align-1)&~uintptr_t(align-1);
+        }
+        next=reinterpret_cast<std::byte*>(p+bytes);
+        used+=bytes;
+        return reinterpret_cast<void*>(p);
+    }
+
+    size_t bytes_used()const{return used;}
+    size_t bytes_reserved()const{return reserved;}
+    size_t chunk_count()const{return chunks.size();}
+
+private:
+    size_t chunk_size;
+    std::vector<std::unique_ptr<std::byte[]>> chunks;
+    std::byte *next=nullptr;
+    std::byte *end=nullptr;
+    size_t used=0;
+    size_t reserved=0;
+};
+
+// A standard allocator over an arena, for std::allocate_shared and
+// containers.  deallocate() does nothing, the memory comes back with the
+// arena, which must outlive everything made from it.  It holds a plain
+// pointer: a shared one would grow every control block by two words and
+// cost an atomic increment per object.
+template<class T>
+class arena_allocator_t
+{
+public:
+    using value_type=T;
+
+    arena_t *arena;
+
+    explicit arena_allocator_t(arena_t *arena):arena(arena){}
+    template<class U>
+    arena_allocator_t(const arena_allocator_t<U> &other):arena(other.arena){}
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T*>(arena->allocate(n*sizeof(T),alignof(T)));
+    }
+    void deallocate(T*,size_t){}
+
+    template<class U>
+    bool operator==(const arena_allocator_t<U> &other)const{return arena==other.arena;}
+    template<class U>
+    bool operator!=(const arena_allocator_t<U> &other)const{return arena!=other.arena;}
+};
+
+#endif
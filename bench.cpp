@@ -0,0 +1,264 @@
+#include<cstdio>
+#include<cmath>
+#include<vec3.h>
+#include<ray.h>
+#include<hittable.h>
+#include<material.h>
+#include<texture.h>
+#include<perlin.h>
+#include<sphere.h>
+#include<moving_sphere.h>
+#include<aarect.h>
+#include<box.h>
+#include<bvh.h>
+#include<linear_bvh.h>
+#include<wide_bvh.h>
+#include<string>
+#include<vector>
+#include<chrono>
+#include<functional>
+#include<limits>
+#include<algorithm>
+using namespace std;
+
+// Times the intersection and shading kernels one at a time on fixed sets of
+// random rays, points and hit records, so a change to one of them can be
+// measured without the noise of a whole render.  Every set is drawn from a
+// pcg32_t seeded with --seed and the kernels' own random draws restart from
+// the same seed on every run, so two builds see the same work.  A kernel is
+// run until min_time has passed, five times over, and the best run counts.
+
+uint64_t seed=1;
+double min_time=0.1;
+string filter;
+volatile double sink;               // results go here so no loop is optimised away
+
+const size_t ray_count=4096;        // small enough that the set stays in cache
+
+double uniform(pcg32_t &rng,double a,double b)
+{
+    return a+(b-a)*rng.next_double();
+}
+
+vec3_t random_unit(pcg32_t &rng)
+{
+    while(true)
+    {
+        vec3_t p(real_t(uniform(rng,-1,1)),real_t(uniform(rng,-1,1)),real_t(uniform(rng,-1,1)));
+        auto l=p.len();
+        if(l>1e-3 && l<=1)
+            return p/l;
+    }
+}
+
+// Rays from a sphere around box at targets in the box grown by half, so a
+// share of them misses, at times in [time0,time1].
+vector<ray_t> make_rays(const aabb_t &box,uint64_t stream,double time0=0,double time1=0)
+{
+    pcg32_t rng(seed,stream);
+    auto centre=(box.min()+box.max())*0.5;
+    auto size=box.max()-box.min();
+    auto radius=std::max(size.len(),real_t(1));
+    vector<ray_t> rays;
+    rays.reserve(ray_count);
+    for(size_t i=0;i<ray_count;i++)
+    {
+        auto origin=centre+random_unit(rng)*(2*radius);
+        point3_t target(real_t(centre.x+size.x*uniform(rng,-0.75,0.75)),real_t(centre.y+size.y*uniform(rng,-0.75,0.75)),real_t(centre.z+size.z*uniform(rng,-0.75,0.75)));
+        rays.emplace_back(origin,(target-origin).unit(),uniform(rng,time0,time1));
+    }
+    return rays;
+}
+
+// seconds per op of the best of five runs of f, which does ops ops a call
+double time_op(const function<void()> &f,size_t ops)
+{
+    using clock=chrono::steady_clock;
+    auto run=[&](size_t calls){
+        thread_rng().seed(seed);
+        auto t0=clock::now();
+        for(size_t i=0;i<calls;i++)
+            f();
+        return chrono::duration<double>(clock::now()-t0).count();
+    };
+    size_t calls=1;
+    while(run(calls)<min_time && calls<(size_t(1)<<30))
+        calls*=2;
+    auto best=numeric_limits<double>::infinity();
+    for(int k=0;k<5;k++)
+        best=std::min(best,run(calls));
+    return best/(double(calls)*double(ops));
+}
+
+bool selected(const string &name)
+{
+    return filter.empty() || name.find(filter)!=string::npos;
+}
+
+void report(const string &name,double seconds,double hit_share=-1)
+{
+    if(hit_share<0)
+        printf("%-32s %10.2f %12s %8s\n",name.c_str(),seconds*1e9,"-","-");
+    else
+        printf("%-32s %10.2f %12.2f %7.1f%%\n",name.c_str(),seconds*1e9,1e-6/seconds,hit_share*100);
+    fflush(stdout);
+}
+
+// object.hit() over the ray set, of the class the name gives, not virtually
+template<class object_t>
+void bench_hit(const string &name,const object_t &object,double time0=0,double time1=0)
+{
+    if(selected(name)==false)
+        return;
+    auto [exist,box]=object.bounding_box(time0,time1);
+    if(exist==false)
+        return;
+    auto rays=make_rays(box,1,time0,time1);
+    size_t hits=0;
+    for(auto &r:rays)
+        hits+=object.object_t::hit(r,ray_t_min,real_t(infinity)).first;
+    auto seconds=time_op([&]{
+        double sum=0;
+        for(auto &r:rays)
+        {
+            auto [is_hit,rec]=object.object_t::hit(r,ray_t_min,real_t(infinity));
+            sum+=is_hit?double(rec.t):0;
+        }
+        sink=sum;
+    },rays.size());
+    report(name,seconds,double(hits)/rays.size());
+}
+
+void bench_aabb()
+{
+    aabb_t box(point3_t(-1,-1,-1),point3_t(1,1,1));
+    auto rays=make_rays(box,2);
+    size_t hits=0;
+    for(auto &r:rays)
+        hits+=box.hit(r,ray_t_min,real_t(infinity));
+    if(selected("aabb_t::hit ray_t"))
+    {
+        auto seconds=time_op([&]{
+            int n=0;
+            for(auto &r:rays)
+                n+=box.hit(r,ray_t_min,real_t(infinity));
+            sink=n;
+        },rays.size());
+        report("aabb_t::hit ray_t",seconds,double(hits)/rays.size());
+    }
+    if(selected("aabb_t::hit ray_inv_t"))
+    {
+        // the inverse is made once per ray and reused down a tree
+        vector<ray_inv_t> inv(rays.begin(),rays.end());
+        auto seconds=time_op([&]{
+            int n=0;
+            for(auto &r:inv)
+                n+=box.hit(r,ray_t_min,real_t(infinity));
+            sink=n;
+        },inv.size());
+        report("aabb_t::hit ray_inv_t",seconds,double(hits)/rays.size());
+    }
+}
+
+// 1024 spheres of random size scattered through a cube
+void bench_bvh()
+{
+    pcg32_t rng(seed,3);
+    hittable_list_t list;
+    auto mat=make_shared<lambertian_t>(colour_t(0.5,0.5,0.5));
+    for(int i=0;i<1024;i++)
+    {
+        point3_t centre(real_t(uniform(rng,-10,10)),real_t(uniform(rng,-10,10)),real_t(uniform(rng,-10,10)));
+        list.add(make_shared<sphere_t>(centre,real_t(uniform(rng,0.2,0.6)),mat));
+    }
+    thread_rng().seed(seed);
+    bench_hit("bvh_node_t::hit 1024 spheres",bvh_node_t(list,0,1));
+    bench_hit("linear_bvh_t::hit 1024 spheres",linear_bvh_t(list,0,1));
+    bench_hit("bvh8_t::hit 1024 spheres",bvh8_t(list,0,1));
+}
+
+void bench_turb()
+{
+    if(selected("perlin_t::turb")==false)
+        return;
+    perlin_t noise;
+    pcg32_t rng(seed,4);
+    vector<point3_t> points;
+    for(size_t i=0;i<ray_count;i++)
+        points.emplace_back(real_t(uniform(rng,-10,10)),real_t(uniform(rng,-10,10)),real_t(uniform(rng,-10,10)));
+    auto seconds=time_op([&]{
+        double sum=0;
+        for(auto &p:points)
+            sum+=noise.turb(p);
+        sink=sum;
+    },points.size());
+    report("perlin_t::turb depth 7",seconds);
+}
+
+// scatter() at the points where the ray set meets a unit sphere
+void bench_scatter()
+{
+    sphere_t sphere(point3_t(0,0,0),1);
+    vector<pair<ray_t,hit_record_t>> hits;
+    for(auto &r:make_rays(aabb_t(point3_t(-1,-1,-1),point3_t(1,1,1)),5))
+    {
+        auto [is_hit,rec]=sphere.hit(r,ray_t_min,real_t(infinity));
+        if(is_hit)
+            hits.emplace_back(r,rec);
+    }
+    auto bench=[&](const string &name,const material_t &m){
+        if(selected(name)==false)
+            return;
+        auto seconds=time_op([&]{
+            double sum=0;
+            for(auto &[r,rec]:hits)
+            {
+                auto [is_scatter,attenuation,scattered]=m.scatter(r,rec);
+                sum+=is_scatter?double(scattered.direction().x)+attenuation.x:0;
+            }
+            sink=sum;
+        },hits.size());
+        report(name,seconds);
+    };
+    bench("lambertian_t::scatter solid",lambertian_t(colour_t(0.5,0.5,0.5)));
+    bench("lambertian_t::scatter checker",lambertian_t(make_shared<checker_texture_t>(colour_t(0.2,0.3,0.1),colour_t(0.9,0.9,0.9))));
+    bench("lambertian_t::scatter noise",lambertian_t(make_shared<noise_texture_t>(4)));
+    bench("metal_t::scatter mirror",metal_t(colour_t(0.7,0.6,0.5)));
+    bench("metal_t::scatter fuzz 0.3",metal_t(colour_t(0.7,0.6,0.5),0.3));
+    bench("dielectric_t::scatter",dielectric_t(1.5));
+    bench("dielectric_t::scatter fuzz 0.1",dielectric_t(1.5,colour_t(1,1,1),0.1));
+    bench("diffuse_light_t::scatter",diffuse_light_t(colour_t(4,4,4)));
+    bench("isotropic_t::scatter",isotropic_t(colour_t(0.5,0.5,0.5)));
+    bench("material_test_t::scatter",material_test_t());
+}
+
+int main(int argc,const char *argv[])
+{
+    for(int i=1;i<argc;i++)
+    {
+        string arg=argv[i];
+        if(arg=="--filter" && i+1<argc)
+            filter=argv[++i];
+        else if(arg=="--seed" && i+1<argc)
+            seed=strtoull(argv[++i],nullptr,10);
+        else if(arg=="--min-time" && i+1<argc)
+            min_time=std::max(atof(argv[++i]),0.001);
+        else
+        {
+            fprintf(stderr,"usage: %s [--filter name] [--seed n] [--min-time s]\n",argv[0]);
+            return 1;
+        }
+    }
+    printf("%-32s %10s %12s %8s\n","kernel","ns/op","Mrays/s","hits");
+    auto mat=make_shared<lambertian_t>(colour_t(0.5,0.5,0.5));
+    bench_hit("sphere_t::hit",sphere_t(point3_t(0,0,0),1,mat));
+    bench_hit("moving_sphere_t::hit",moving_sphere_t(point3_t(0,0,0),point3_t(0,0.5,0),0,1,1,mat),0,1);
+    bench_hit("rect_t::hit",rect_t(vec3_t(0,0,1),point3_t(-1,-1,0),point3_t(1,1,0),mat));
+    bench_hit("xrect_t::hit",xrect_t(point3_t(0,0,0),vec3_t(2,0,0.5),vec3_t(0,2,0),mat));
+    bench_hit("xbox_t::hit",xbox_t(point3_t(0,0,0),1,1.5,2,mat));
+    bench_aabb();
+    bench_bvh();
+    bench_turb();
+    bench_scatter();
+    return 0;
+}
@@ -12,31 +12,52 @@ public:
     hittable_list_t sides;
 
     box_t()=default;
-    box_t(const point3_t& a, const point3_t& b, std::shared_ptr<material_t> ptr):box_min(a),box_max(b)
+    box_t(const point3_t& a, const point3_t& b, std::shared_ptr<material_t> ptr):box_t(a,b,ptr,std::allocator<rect_t>()){}
+    // the sides are made with alloc, an arena_allocator_t keeps them by the box
+    template<class allocator_type>
+    box_t(const point3_t& a, const point3_t& b, std::shared_ptr<material_t> ptr, const allocator_type &alloc):box_min(a),box_max(b)
     {
         box_min=point3_t(fmin(a.x,b.x),fmin(a.y,b.y),fmin(a.z,b.z));
         box_max=point3_t(fmax(a.x,b.x),fmax(a.y,b.y),fmax(a.z,b.z));
         auto v=box_max-box_min;
 
-        sides.add(std::make_shared<rect_t>(vec3_t(0,-1,0),box_min,box_max-vec3_t(0,v.y,0),ptr)); //down
-        sides.add(std::make_shared<rect_t>(vec3_t(0,1,0),box_min+vec3_t(0,v.y,0),box_max,ptr));  //up
-        sides.add(std::make_shared<rect_t>(vec3_t(0,0,-1),box_min,box_max-vec3_t(0,0,v.z),ptr)); //back
-        sides.add(std::make_shared<rect_t>(vec3_t(0,0,1),box_min+vec3_t(0,0,v.z),box_max,ptr)); //front
-        sides.add(std::make_shared<rect_t>(vec3_t(-1,0,0),box_min,box_max-vec3_t(v.x,0,0),ptr)); //left
-        sides.add(std::make_shared<rect_t>(vec3_t(1,0,0),box_min+vec3_t(v.x,0,0),box_max,ptr)); //right
+        sides.add(std::allocate_shared<rect_t>(alloc,vec3_t(0,-1,0),box_min,box_max-vec3_t(0,v.y,0),ptr)); //down
+        sides.add(std::allocate_shared<rect_t>(alloc,vec3_t(0,1,0),box_min+vec3_t(0,v.y,0),box_max,ptr));  //up
+        sides.add(std::allocate_shared<rect_t>(alloc,vec3_t(0,0,-1),box_min,box_max-vec3_t(0,0,v.z),ptr)); //back
+        sides.add(std::allocate_shared<rect_t>(alloc,vec3_t(0,0,1),box_min+vec3_t(0,0,v.z),box_max,ptr)); //front
+        sides.add(std::allocate_shared<rect_t>(alloc,vec3_t(-1,0,0),box_min,box_max-vec3_t(v.x,0,0),ptr)); //left
+        sides.add(std::allocate_shared<rect_t>(alloc,vec3_t(1,0,0),box_min+vec3_t(v.x,0,0),box_max,ptr)); //right
     }
 
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
     {
         return sides.hit(r,t_min,t_max);
     }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        return sides.occluded(r,t_min,t_max);
+    }
+    virtual void hit_packet(ray_packet_t &packet,uint32_t mask,real_t t_min)const override
+    {
+        sides.hit_packet(packet,mask,t_min);
+    }
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const
     {
         return {true,aabb_t(box_min,box_max)};
     }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        sides.collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        sides.collect_lights(out);
+    }
 
     void move(vec3_t direction)
     {
+        box_min+=direction;
+        box_max+=direction;
         for(auto &rect:sides.objects)
         {
             auto r=std::dynamic_pointer_cast<rect_t>(rect);
@@ -51,7 +72,7 @@ class xbox_t:public hittable_t
 public:
     xrect_t sides[6];
     point3_t center;
-    xbox_t(point3_t center,double xlen,double ylen,double zlen,std::shared_ptr<material_t> ptr):center(center)
+    xbox_t(point3_t center,real_t xlen,real_t ylen,real_t zlen,std::shared_ptr<material_t> ptr):center(center)
     {
         sides[0]=xrect_t(center-vec3_t(0,ylen*0.5,0),{xlen,0,0},{0,0,zlen},ptr);//down
         sides[1]=xrect_t(center+vec3_t(0,ylen*0.5,0),{-xlen,0,0},{0,0,zlen},ptr);//up
@@ -61,7 +82,7 @@ public:
         sides[5]=xrect_t(center+vec3_t(xlen*0.5,0,0),{0,ylen,0},{0,0,zlen},ptr);//right
     }
 
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
     {
         hit_record_t temp_rec{};
         bool hit_anything = false;
@@ -79,9 +100,29 @@ public:
         }
         return {hit_anything, temp_rec};
     }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        for (const auto &object : sides)
+            if (object.occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const
     {
-        return {false,aabb_t()};
+        auto box=sides[0].bounding_box(time0,time1).second;
+        for(int i=1;i<6;i++)
+            box=surrounding_box(box,sides[i].bounding_box(time0,time1).second);
+        return {true,box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        for(auto &side:sides)
+            side.collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        for(auto &side:sides)
+            side.collect_lights(out);
     }
 
     void rotate_y(double theta)
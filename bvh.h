@@ -4,6 +4,319 @@
 #include<hittable.h>
 #include<aabb.h>
 #include<algorithm>
+#include<thread>
+#include<atomic>
+#include<cassert>
+
+// Knobs of the binned SAH builder.
+//
+// bin_count is the quality/build-time trade-off: every node evaluates
+// bin_count-1 candidate planes per axis, so build time grows linearly with it
+// while the tree quality saturates quickly.  8 bins is fine for previews, 16
+// is within a few percent of a full sweep, more only helps very dense scenes.
+struct bvh_build_options_t
+{
+    int    bin_count=16;
+    int    max_leaf_size=4;           // leaves never hold more primitives than this
+    double traversal_cost=1.0;        // cost of one node visit relative to one primitive test
+    int    thread_num=1;              // subtrees are built on up to this many threads
+    size_t parallel_min_size=1024;    // smaller subtrees are not worth a thread
+};
+
+// When an updated BVH is rebuilt rather than only refit.  A subtree's quality
+// is its SAH cost per unit area now over the same figure when it was built:
+// refit bounds grow looser as primitives move apart, so it only rises.
+struct bvh_refit_options_t
+{
+    double partial_ratio=1.3;         // subtrees below the root this much worse are rebuilt
+    double full_ratio=1.8;            // the whole tree is rebuilt once it is this much worse
+    double full_fraction=0.5;         // or once the degraded subtrees hold this share of the primitives
+};
+
+enum class bvh_update_t{refit,partial,full};
+
+inline const char *to_string(bvh_update_t update)
+{
+    return update==bvh_update_t::refit?"refit":update==bvh_update_t::partial?"partial":"full";
+}
+
+// Intermediate tree produced by the builder.  Leaves reference the range
+// [first,first+count) of bvh_builder_t::indices.
+struct bvh_build_node_t
+{
+    aabb_t box;
+    int    axis=0;
+    size_t first=0;
+    size_t count=0;
+    std::unique_ptr<bvh_build_node_t> left;
+    std::unique_ptr<bvh_build_node_t> right;
+
+    bool is_leaf()const{return !left;}
+};
+
+inline double surface_area(const aabb_t &box)
+{
+    auto d=box.max()-box.min();
+    return 2*(d.x*d.y+d.y*d.z+d.z*d.x);
+}
+
+inline double axis_of(const vec3_t &v,int axis)
+{
+    return axis==0?v.x:axis==1?v.y:v.z;
+}
+
+// Builds a binned SAH tree over a list of primitive boxes.  Only the boxes are
+// looked at, so any kind of primitive storage can sit behind the indices.
+//
+// No leaf lies deeper than max_depth, the traversal stacks are sized from
+// it.  SAH splits off a few primitives at a time where they spread out
+// geometrically, so a subtree that could grow past the limit is split at its
+// object median instead, which at least halves it every level.
+class bvh_builder_t
+{
+public:
+    static constexpr int max_depth=56;
+
+    std::vector<size_t> indices;
+    std::atomic<size_t> node_count{0};
+
+    bvh_builder_t(const std::vector<aabb_t> &boxes,const bvh_build_options_t &options={}):boxes(boxes),options(options)
+    {
+        indices.resize(boxes.size());
+        for(size_t i=0;i<indices.size();i++)
+            indices[i]=i;
+    }
+
+    // root_depth is the depth the root is hung at, for a subtree rebuilt in
+    // place of another
+    std::unique_ptr<bvh_build_node_t> build(int root_depth=0)
+    {
+        if(indices.empty())
+            return nullptr;
+        // the boxes are partitioned along with their indices, so a subtree
+        // reads a contiguous run of memory however the input is ordered
+        refs.resize(indices.size());
+        for(size_t i=0;i<refs.size();i++)
+            refs[i]={boxes[indices[i]],indices[i]};
+        scratch_t scratch;
+        auto root=build(0,refs.size(),std::max(options.thread_num,1),scratch,root_depth);
+        for(size_t i=0;i<refs.size();i++)
+            indices[i]=refs[i].index;
+        refs.clear();
+        refs.shrink_to_fit();
+        return root;
+    }
+
+private:
+    const std::vector<aabb_t> &boxes;
+    bvh_build_options_t options;
+
+    struct prim_ref_t
+    {
+        aabb_t box;
+        size_t index;
+
+        point3_t centroid()const{return (box.min()+box.max())*0.5;}
+    };
+    std::vector<prim_ref_t> refs;
+
+    struct bin_t
+    {
+        aabb_t box;
+        size_t count=0;
+    };
+    // bins of the three axes, reused by every node one thread builds
+    struct scratch_t
+    {
+        std::vector<bin_t> bins;
+        std::vector<double> right_cost;
+    };
+
+    std::unique_ptr<bvh_build_node_t> make_leaf(size_t start,size_t end,const aabb_t &box,int depth)
+    {
+        assert(depth<=max_depth);
+        auto node=std::make_unique<bvh_build_node_t>();
+        node->box=box;
+        node->first=start;
+        node->count=end-start;
+        node_count++;
+        return node;
+    }
+
+    std::unique_ptr<bvh_build_node_t> build(size_t start,size_t end,int threads,scratch_t &scratch,int depth)
+    {
+        point3_t box_lo=refs[start].box.min(),box_hi=refs[start].box.max();
+        point3_t centroid_lo=refs[start].centroid(),centroid_hi=centroid_lo;
+        for(auto i=start+1;i<end;i++)
+        {
+            auto centroid=refs[i].centroid();
+            grow(box_lo,box_hi,refs[i].box.min(),refs[i].box.max());
+            grow(centroid_lo,centroid_hi,centroid,centroid);
+        }
+        aabb_t box(box_lo,box_hi);
+        size_t count=end-start;
+        if(count==1)
+            return make_leaf(start,end,box,depth);
+        // the levels a median split needs from here on, ceil(log2(count))
+        int median_levels=0;
+        while((size_t(1)<<median_levels)<count)
+            median_levels++;
+        if(depth+median_levels>=max_depth)
+            return split_median(start,end,box,centroid_lo,centroid_hi,threads,scratch,depth);
+
+        // bin every primitive on all three axes in one pass over the boxes
+        const int bin_count=std::max(options.bin_count,2);
+        double lo[3],scale[3];
+        bool splittable[3];
+        for(int axis=0;axis<3;axis++)
+        {
+            lo[axis]=axis_of(centroid_lo,axis);
+            auto hi=axis_of(centroid_hi,axis);
+            splittable[axis]=hi>lo[axis];
+            scale[axis]=splittable[axis]?bin_count/(hi-lo[axis]):0;
+        }
+        auto &bins=scratch.bins;
+        auto &right_cost=scratch.right_cost;
+        bins.assign(3*bin_count,bin_t{});
+        right_cost.resize(bin_count);
+        for(auto i=start;i<end;i++)
+        {
+            auto &prim=refs[i].box;
+            auto centroid=refs[i].centroid();
+            for(int axis=0;axis<3;axis++)
+            {
+                if(splittable[axis]==false)
+                    continue;
+                auto &b=bins[axis*bin_count+bin_index(centroid,axis,lo[axis],scale[axis],bin_count)];
+                if(b.count)
+                    b.box=grown(b.box,prim);
+                else
+                    b.box=prim;
+                b.count++;
+            }
+        }
+
+        // pick the best plane over all axes
+        int    best_axis=-1;
+        int    best_split=0;
+        double best_cost=infinity;
+        for(int axis=0;axis<3;axis++)
+        {
+            if(splittable[axis]==false)
+                continue;
+            auto axis_bins=&bins[axis*bin_count];
+            // sweep from the right, then from the left evaluating each plane
+            aabb_t acc;
+            size_t n=0;
+            for(int i=bin_count-1;i>0;i--)
+            {
+                if(axis_bins[i].count)
+                {
+                    acc=n?grown(acc,axis_bins[i].box):axis_bins[i].box;
+                    n+=axis_bins[i].count;
+                }
+                right_cost[i]=n?surface_area(acc)*n:0;
+            }
+            n=0;
+            for(int i=0;i<bin_count-1;i++)
+            {
+                if(axis_bins[i].count)
+                {
+                    acc=n?grown(acc,axis_bins[i].box):axis_bins[i].box;
+                    n+=axis_bins[i].count;
+                }
+                if(n==0 || n==count)
+                    continue;
+                auto cost=surface_area(acc)*n+right_cost[i+1];
+                if(cost<best_cost)
+                {
+                    best_cost=cost;
+                    best_axis=axis;
+                    best_split=i;
+                }
+            }
+        }
+
+        size_t mid;
+        if(best_axis<0)
+        {
+            // every centroid coincides, no plane separates them
+            if(count<=size_t(options.max_leaf_size))
+                return make_leaf(start,end,box,depth);
+            mid=start+count/2;
+            best_axis=0;
+        }
+        else
+        {
+            auto area=surface_area(box);
+            best_cost=area>0?options.traversal_cost+best_cost/area:options.traversal_cost;
+            if(count<=size_t(options.max_leaf_size) && best_cost>=double(count))
+                return make_leaf(start,end,box,depth);
+            auto it=std::partition(begin(refs)+start,begin(refs)+end,[&](const prim_ref_t &ref){
+                return bin_index(ref.centroid(),best_axis,lo[best_axis],scale[best_axis],bin_count)<=best_split;
+            });
+            mid=it-begin(refs);
+        }
+
+        return make_inner(start,mid,end,box,best_axis,threads,scratch,depth);
+    }
+    // halves [start,end) about the median centroid on the widest axis
+    std::unique_ptr<bvh_build_node_t> split_median(size_t start,size_t end,const aabb_t &box,const point3_t &centroid_lo,const point3_t &centroid_hi,int threads,scratch_t &scratch,int depth)
+    {
+        if(end-start<=size_t(options.max_leaf_size))
+            return make_leaf(start,end,box,depth);
+        auto extent=centroid_hi-centroid_lo;
+        int axis=extent.x>=extent.y && extent.x>=extent.z?0:extent.y>=extent.z?1:2;
+        auto mid=start+(end-start)/2;
+        std::nth_element(begin(refs)+start,begin(refs)+mid,begin(refs)+end,[&](const prim_ref_t &a,const prim_ref_t &b){
+            return axis_of(a.centroid(),axis)<axis_of(b.centroid(),axis);
+        });
+        return make_inner(start,mid,end,box,axis,threads,scratch,depth);
+    }
+    std::unique_ptr<bvh_build_node_t> make_inner(size_t start,size_t mid,size_t end,const aabb_t &box,int axis,int threads,scratch_t &scratch,int depth)
+    {
+        auto node=std::make_unique<bvh_build_node_t>();
+        node->box=box;
+        node->axis=axis;
+        node_count++;
+        if(threads>1 && end-start>=options.parallel_min_size)
+        {
+            // the two halves touch disjoint index ranges
+            std::thread worker([&]{
+                scratch_t worker_scratch;
+                node->left=build(start,mid,threads/2,worker_scratch,depth+1);
+            });
+            node->right=build(mid,end,threads-threads/2,scratch,depth+1);
+            worker.join();
+        }
+        else
+        {
+            node->left=build(start,mid,1,scratch,depth+1);
+            node->right=build(mid,end,1,scratch,depth+1);
+        }
+        return node;
+    }
+
+    // plain min/max rather than surrounding_box's fmin/fmax, which are
+    // library calls; the boxes hold no NaN
+    static void grow(point3_t &lo,point3_t &hi,const point3_t &min,const point3_t &max)
+    {
+        lo=point3_t(std::min(lo.x,min.x),std::min(lo.y,min.y),std::min(lo.z,min.z));
+        hi=point3_t(std::max(hi.x,max.x),std::max(hi.y,max.y),std::max(hi.z,max.z));
+    }
+    static aabb_t grown(const aabb_t &box,const aabb_t &other)
+    {
+        auto lo=box.min(),hi=box.max();
+        grow(lo,hi,other.min(),other.max());
+        return aabb_t(lo,hi);
+    }
+
+    static int bin_index(const point3_t &centroid,int axis,double lo,double scale,int bin_count)
+    {
+        auto b=int((axis_of(centroid,axis)-lo)*scale);
+        return std::min(std::max(b,0),bin_count-1);
+    }
+};
 
 class bvh_node_t:public hittable_t
 {
@@ -13,7 +326,8 @@ public:
     std::shared_ptr<hittable_t> right;
 
     bvh_node_t()=default;
-    bvh_node_t(std::vector<std::shared_ptr<hittable_t>> objects,size_t start,size_t end,double time0,double time1)
+    // random axis median split, sorts objects[start,end) in place
+    bvh_node_t(std::vector<std::shared_ptr<hittable_t>> &objects,size_t start,size_t end,double time0,double time1)
     {
         int axis=rand_int(0,3);
         static decltype(box_x_compare) *tab[]={box_x_compare,box_y_compare,box_z_compare};
@@ -28,13 +342,13 @@ public:
                 left=objects[start];
                 right=objects[start+1];
             }
-            else 
+            else
             {
                 left=objects[start+1];
                 right=objects[start];
             }
         }
-        else 
+        else
         {
             std::sort(begin(objects)+start,begin(objects)+end,comparator);
             auto mid=start+object_span/2;
@@ -48,25 +362,64 @@ public:
         box=surrounding_box(box_left,box_right);
     }
 
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    // binned SAH build, every object must have a bounding box
+    bvh_node_t(const hittable_list_t &list,double time0,double time1,const bvh_build_options_t &options=bvh_build_options_t())
+    {
+        std::vector<aabb_t> boxes;
+        boxes.reserve(list.objects.size());
+        for(auto &object:list.objects)
+        {
+            auto [exist_box,box]=object->bounding_box(time0,time1);
+            if(exist_box==false)
+                std::fprintf(stderr,"error! bvh constructor\n");
+            boxes.push_back(box);
+        }
+        bvh_builder_t builder(boxes,options);
+        auto root=builder.build();
+        if(root)
+            assign(*root,list.objects,builder.indices);
+    }
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
     {
         if(box.hit(r,t_min,t_max)!=true)
             return {false,{}};
         auto [is_left_hit,left_rec]=left->hit(r,t_min,t_max);
         auto [is_right_hit,right_rec]=right->hit(r,t_min,is_left_hit?left_rec.t:t_max);
-        if(is_left_hit||is_right_hit)
-            return {true,left_rec.t<right_rec.t?left_rec:right_rec};
+        // right was clipped to left's distance, so a right hit is the closer one
+        if(is_right_hit)
+            return {true,right_rec};
         else if(is_left_hit)
             return {true,left_rec};
-        else if(is_right_hit)
-            return {true,right_rec};
-        else 
+        else
             return {false,{}};
     }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        if(box.hit(r,t_min,t_max)!=true)
+            return false;
+        return left->occluded(r,t_min,t_max) || (right!=left && right->occluded(r,t_min,t_max));
+    }
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1) const override
     {
         return {true,box};
     }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        left->collect_materials(out);
+        if(right!=left)
+            right->collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        left->collect_lights(out);
+        if(right!=left)
+            right->collect_lights(out);
+    }
+    virtual bool has_media()const override
+    {
+        return left->has_media() || right->has_media();
+    }
 
     static bool box_x_compare(const std::shared_ptr<hittable_t> a,const std::shared_ptr<hittable_t> b)
     {
@@ -92,6 +445,68 @@ public:
             std::fprintf(stderr,"error!");
         return box_a.min().z<box_b.min().z;
     }
+
+private:
+    void assign(const bvh_build_node_t &node,const std::vector<std::shared_ptr<hittable_t>> &objects,const std::vector<size_t> &indices)
+    {
+        box=node.box;
+        if(node.is_leaf()==false)
+        {
+            left=make_child(*node.left,objects,indices);
+            right=make_child(*node.right,objects,indices);
+        }
+        else if(node.count==1)
+            left=right=objects[indices[node.first]];
+        else if(node.count==2)
+        {
+            left=objects[indices[node.first]];
+            right=objects[indices[node.first+1]];
+        }
+        else
+        {
+            auto mid=node.first+node.count/2;
+            left=make_leaf(node.first,mid,objects,indices);
+            right=make_leaf(mid,node.first+node.count,objects,indices);
+        }
+    }
+
+    static std::shared_ptr<hittable_t> make_leaf(size_t start,size_t end,const std::vector<std::shared_ptr<hittable_t>> &objects,const std::vector<size_t> &indices)
+    {
+        if(end-start==1)
+            return objects[indices[start]];
+        auto leaf=std::make_shared<hittable_list_t>();
+        for(auto i=start;i<end;i++)
+            leaf->add(objects[indices[i]]);
+        return leaf;
+    }
+
+    static std::shared_ptr<hittable_t> make_child(const bvh_build_node_t &node,const std::vector<std::shared_ptr<hittable_t>> &objects,const std::vector<size_t> &indices)
+    {
+        if(node.is_leaf() && node.count==1)
+            return objects[indices[node.first]];
+        auto child=std::make_shared<bvh_node_t>();
+        child->assign(node,objects,indices);
+        return child;
+    }
 };
 
-#endif
\ No newline at end of file
+// Splits a scene into a BVH over everything with a bounding box followed by
+// the unbounded rest (infinite planes, xbox_t and media wrapped around them).
+template<class bvh_type=bvh_node_t>
+hittable_list_t make_bvh_world(const hittable_list_t &world,double time0,double time1,const bvh_build_options_t &options=bvh_build_options_t())
+{
+    hittable_list_t bounded;
+    hittable_list_t out;
+    for(auto &object:world.objects)
+    {
+        if(object->bounding_box(time0,time1).first)
+            bounded.add(object);
+        else
+            out.add(object);
+    }
+    if(bounded.objects.empty()==false)
+        out.objects.insert(begin(out.objects),std::make_shared<bvh_type>(bounded,time0,time1,options));
+    return out;
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef COMPILED_MATERIAL_H
+#define COMPILED_MATERIAL_H
+
+#include<material.h>
+#include<texture.h>
+#include<variant>
+#include<vector>
+#include<unordered_map>
+#include<cstdint>
+#include<typeinfo>
+
+// One texture of a flattened graph.  Checkers refer to their children by
+// index into the same array, noise keeps its texture for the shared tables,
+// any other kind is called through its virtual value().
+struct texture_node_t
+{
+    enum kind_t:uint8_t{solid,checker,noise,other};
+
+    kind_t   kind=other;
+    uint32_t even=0,odd=0;
+    colour_t colour;
+    const texture_t *texture=nullptr;
+};
+
+// Every texture reachable from a scene's materials in one array, each node
+// once however many materials share it.  value() walks checkers with a
+// switch rather than through two shared_ptrs and a virtual call per level.
+class texture_graph_t
+{
+public:
+    std::vector<texture_node_t> nodes;
+
+    uint32_t add(const texture_t *texture)
+    {
+        auto found=index.find(texture);
+        if(found!=index.end())
+            return found->second;
+        texture_node_t node;
+        node.texture=texture;
+        // exact types only, a subclass may change what value() does
+        auto &type=typeid(*texture);
+        if(type==typeid(solid_colour_t))
+        {
+            node.kind=texture_node_t::solid;
+            node.colour=static_cast<const solid_colour_t*>(texture)->solid_colour_t::value(0,0,{0,0,0});
+        }
+        else if(type==typeid(checker_texture_t))
+        {
+            auto checker=static_cast<const checker_texture_t*>(texture);
+            node.kind=texture_node_t::checker;
+            node.even=add(checker->even.get());
+            node.odd=add(checker->odd.get());
+        }
+        else if(type==typeid(noise_texture_t))
+            node.kind=texture_node_t::noise;
+        auto i=uint32_t(nodes.size());
+        nodes.push_back(node);
+        index[texture]=i;
+        return i;
+    }
+
+    colour_t value(uint32_t i,double u,double v,const point3_t &p)const
+    {
+        while(true)
+        {
+            auto &node=nodes[i];
+            switch(node.kind)
+            {
+            case texture_node_t::solid:
+                return node.colour;
+            case texture_node_t::checker:
+                i=checker_texture_t::is_odd(u,v)?node.odd:node.even;
+                continue;
+            case texture_node_t::noise:
+                return static_cast<const noise_texture_t*>(node.texture)->noise_texture_t::value(u,v,p);
+            default:
+                return node.texture->value(u,v,p);
+            }
+        }
+    }
+
+private:
+    std::unordered_map<const texture_t*,uint32_t> index;
+};
+
+// The materials as plain data, one struct per kind, dispatched by
+// std::visit over compiled_material_t.  Each calls the same sampling code as
+// its class, with textures read from the graph.  They hide the defaults of
+// compiled_base_t rather than override them, nothing here is virtual.
+struct compiled_base_t
+{
+    colour_t emitted(const texture_graph_t &textures,const hit_record_t &rec)const{ return {0,0,0}; }
+    bool is_emissive()const{ return false; }
+    bool samples_lights()const{ return false; }
+    double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const{ return 0; }
+    colour_t eval(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const{ return {0,0,0}; }
+};
+
+struct compiled_lambertian_t:compiled_base_t
+{
+    uint32_t albedo;
+
+    std::tuple<bool,colour_t,ray_t> scatter(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec)const
+    {
+        auto scattered=lambertian_t::sample(r_in,rec);
+        return {true,textures.value(albedo,rec.u,rec.v,rec.p),scattered};
+    }
+    bool samples_lights()const{ return true; }
+    double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return lambertian_t::pdf(rec,dir);
+    }
+    colour_t eval(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return textures.value(albedo,rec.u,rec.v,rec.p)*lambertian_t::pdf(rec,dir);
+    }
+};
+
+struct compiled_metal_t:compiled_base_t
+{
+    colour_t albedo;
+    double   fuzz;
+
+    std::tuple<bool,colour_t,ray_t> scatter(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec)const
+    {
+        auto [is_reflect,scattered]=metal_t::sample(r_in,rec,fuzz);
+        return {is_reflect,albedo,scattered};
+    }
+    bool samples_lights()const{ return fuzz>0; }
+    double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return metal_t::pdf(r_in,rec,dir,fuzz);
+    }
+    colour_t eval(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return albedo*metal_t::pdf(r_in,rec,dir,fuzz);
+    }
+};
+
+struct compiled_dielectric_t:compiled_base_t
+{
+    double   ir;
+    colour_t attenuation;
+    bool     is_fresnel_reflectance;
+    double   fuzz;
+
+    std::tuple<bool,colour_t,ray_t> scatter(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec)const
+    {
+        return {true,attenuation,dielectric_t::sample(r_in,rec,ir,is_fresnel_reflectance,fuzz)};
+    }
+};
+
+struct compiled_diffuse_light_t:compiled_base_t
+{
+    uint32_t emit;
+
+    std::tuple<bool,colour_t,ray_t> scatter(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec)const
+    {
+        return {false,{},{}};
+    }
+    colour_t emitted(const texture_graph_t &textures,const hit_record_t &rec)const
+    {
+        return textures.value(emit,rec.u,rec.v,rec.p);
+    }
+    bool is_emissive()const{ return true; }
+};
+
+struct compiled_isotropic_t:compiled_base_t
+{
+    uint32_t albedo;
+
+    std::tuple<bool,colour_t,ray_t> scatter(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec)const
+    {
+        auto scattered=isotropic_t::sample(r_in,rec);
+        return {true,textures.value(albedo,rec.u,rec.v,rec.p),scattered};
+    }
+};
+
+// materials of a kind not listed above keep their virtual calls
+struct compiled_other_t
+{
+    const material_t *material;
+
+    std::tuple<bool,colour_t,ray_t> scatter(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec)const
+    {
+        return material->scatter(r_in,rec);
+    }
+    colour_t emitted(const texture_graph_t &textures,const hit_record_t &rec)const
+    {
+        return material->emitted(rec.u,rec.v,rec.p);
+    }
+    bool is_emissive()const{ return material->is_emissive(); }
+    bool samples_lights()const{ return material->samples_lights(); }
+    double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return material->scatter_pdf(r_in,rec,dir);
+    }
+    colour_t eval(const texture_graph_t &textures,const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return material->eval(r_in,rec,dir);
+    }
+};
+
+using compiled_material_t=std::variant<compiled_lambertian_t,compiled_metal_t,compiled_dielectric_t,compiled_diffuse_light_t,compiled_isotropic_t,compiled_other_t>;
+
+// The materials of a frozen scene compiled from the class hierarchy, indexed
+// by material_t::id, with the textures they use.  The members take the hit
+// record and answer for its material as material_t's virtuals would.  A
+// material without an id in the table is called virtually.
+class compiled_materials_t
+{
+public:
+    std::vector<compiled_material_t> materials;
+    texture_graph_t textures;
+
+    compiled_materials_t()=default;
+    explicit compiled_materials_t(const std::vector<std::shared_ptr<material_t>> &table)
+    {
+        materials.reserve(table.size());
+        for(auto &m:table)
+            materials.push_back(compile(*m));
+    }
+
+    // defined before its callers, they deduce its return type
+    template<class F>
+    auto visit(const hit_record_t &rec,F &&f)const
+    {
+        auto id=rec.mat_ptr->id;
+        if(id<materials.size())
+            return std::visit(f,materials[id]);
+        return f(compiled_other_t{rec.mat_ptr});
+    }
+
+    std::tuple<bool,colour_t,ray_t> scatter(const ray_t &r_in,const hit_record_t &rec)const
+    {
+        return visit(rec,[&](const auto &m){return m.scatter(textures,r_in,rec);});
+    }
+    colour_t emitted(const hit_record_t &rec)const
+    {
+        return visit(rec,[&](const auto &m){return m.emitted(textures,rec);});
+    }
+    bool is_emissive(const hit_record_t &rec)const
+    {
+        return visit(rec,[&](const auto &m){return m.is_emissive();});
+    }
+    bool samples_lights(const hit_record_t &rec)const
+    {
+        return visit(rec,[&](const auto &m){return m.samples_lights();});
+    }
+    double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return visit(rec,[&](const auto &m){return m.scatter_pdf(r_in,rec,dir);});
+    }
+    colour_t eval(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const
+    {
+        return visit(rec,[&](const auto &m){return m.eval(textures,r_in,rec,dir);});
+    }
+
+private:
+    // exact types only, like texture_graph_t::add()
+    compiled_material_t compile(const material_t &m)
+    {
+        auto &type=typeid(m);
+        if(type==typeid(lambertian_t))
+            return compiled_lambertian_t{{},textures.add(static_cast<const lambertian_t&>(m).albedo.get())};
+        if(type==typeid(metal_t))
+        {
+            auto &metal=static_cast<const metal_t&>(m);
+            return compiled_metal_t{{},metal.albedo,metal.fuzz};
+        }
+        if(type==typeid(dielectric_t))
+        {
+            auto &dielectric=static_cast<const dielectric_t&>(m);
+            return compiled_dielectric_t{{},dielectric.ir,dielectric.attenuation,dielectric.is_fresnel_reflectance,dielectric.fuzz};
+        }
+        if(type==typeid(diffuse_light_t))
+            return compiled_diffuse_light_t{{},textures.add(static_cast<const diffuse_light_t&>(m).emit.get())};
+        if(type==typeid(isotropic_t))
+            return compiled_isotropic_t{{},textures.add(static_cast<const isotropic_t&>(m).albedo.get())};
+        return compiled_other_t{&m};
+    }
+};
+
+#endif
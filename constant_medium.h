@@ -17,20 +17,47 @@ public:
     constant_medium_t(std::shared_ptr<hittable_t> b, double d, colour_t c)
         : boundary(b),neg_inv_density(-1 / d),phase_function(std::make_shared<isotropic_t>(c)){}
 
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    // a phase function made elsewhere, usually an isotropic_t
+    constant_medium_t(std::shared_ptr<hittable_t> b, double d, std::shared_ptr<material_t> phase)
+        : boundary(b),neg_inv_density(-1 / d),phase_function(phase){}
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
     {
-        auto [is_hit1,rec1]=boundary->hit(r,-infinity,infinity);
-        if(is_hit1==false)
+        real_t t;
+        if(intersect(r,t_min,t_max,t)==false)
             return {false,{}};
-        auto [is_hit2,rec2]=boundary->hit(r,rec1.t+0.0001,infinity);
+        hit_record_t rec{};
+        rec.t = t;
+        rec.p = r.at(rec.t);
+        rec.mat_ptr = phase_function.get();
+        return {true,rec};
+    }
+    // the medium scatters the ray somewhere in [t_min,t_max] with the same odds as in hit()
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t t;
+        return intersect(r,t_min,t_max,t);
+    }
+
+    bool intersect(const ray_t &r, real_t t_min, real_t t_max, real_t &t) const
+    {
+        return intersect(*boundary,neg_inv_density,r,t_min,t_max,t);
+    }
+    // the test without an object, for copies of the fields kept elsewhere
+    static bool intersect(const hittable_t &boundary, double neg_inv_density, const ray_t &r, real_t t_min, real_t t_max, real_t &t)
+    {
+        auto [is_hit1,rec1]=boundary.hit(r,-infinity,infinity);
+        if(is_hit1==false)
+            return false;
+        auto [is_hit2,rec2]=boundary.hit(r,rec1.t+0.0001,infinity);
         if(is_hit2==false)
-            return {false,{}};
+            return false;
         if (rec1.t < t_min)
             rec1.t = t_min;
         if (rec2.t > t_max)
             rec2.t = t_max;
         if (rec1.t >= rec2.t)
-            return {false,{}};
+            return false;
 
         if (rec1.t < 0)
             rec1.t = 0;
@@ -40,18 +67,23 @@ public:
         const auto hit_distance = neg_inv_density * log(rand_uniform());
 
         if (hit_distance > distance_inside_boundary)
-            return {false,{}};
+            return false;
 
-        hit_record_t rec{};
-        rec.t = rec1.t + hit_distance / ray_length;
-        rec.p = r.at(rec.t);
-        rec.mat_ptr = phase_function;
-        return {true,rec};
+        t = rec1.t + hit_distance / ray_length;
+        return true;
     }
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const override
     {
         return boundary->bounding_box(time0, time1);
     }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        out.push_back(phase_function);
+    }
+    virtual bool has_media()const override
+    {
+        return true;
+    }
 };
 
 #endif
\ No newline at end of file
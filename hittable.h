@@ -6,6 +6,7 @@
 #include<vector>
 #include<memory>
 #include<aabb.h>
+#include<cstdint>
 
 class material_t;
 
@@ -13,9 +14,10 @@ struct hit_record_t
 {
     point3_t p;
     vec3_t   normal;
-    double   t;
+    real_t   t;
+    real_t   p_error=0;     // bound on the distance of p from the true surface
     bool front_face;
-    std::shared_ptr<material_t> mat_ptr;
+    const material_t *mat_ptr;      // owned by the primitive, no refcount traffic per hit
     double u;
     double v;
     void set_face_normal(const ray_t &r, const vec3_t &outward_normal)
@@ -23,13 +25,97 @@ struct hit_record_t
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+    // a ray leaving the surface at p, started on the side dir points to
+    // beyond p_error and a few ulps
+    ray_t spawn(const vec3_t &dir,double time)const
+    {
+        auto n=dot(dir,normal)<0?-normal:normal;
+        return ray_t(offset_ray_origin(p+n*p_error,n),dir,time);
+    }
+};
+
+// Up to max_size neighbouring rays traced together, one array per component
+// so primitives can test all lanes in one vectorized loop.  t_max holds the
+// closest hit found so far per lane.
+struct ray_packet_t
+{
+    static constexpr int max_size=16;
+    int size=0;
+    alignas(32) real_t ox[max_size]={};
+    alignas(32) real_t oy[max_size]={};
+    alignas(32) real_t oz[max_size]={};
+    alignas(32) real_t dx[max_size]={};
+    alignas(32) real_t dy[max_size]={};
+    alignas(32) real_t dz[max_size]={};
+    alignas(32) double tm[max_size]={};
+    alignas(32) real_t t_max[max_size]={};
+    bool is_hit[max_size]={};
+    hit_record_t rec[max_size]={};
+
+    void set(int i,const ray_t &r,real_t t)
+    {
+        ox[i]=r.orig.x;
+        oy[i]=r.orig.y;
+        oz[i]=r.orig.z;
+        dx[i]=r.dir.x;
+        dy[i]=r.dir.y;
+        dz[i]=r.dir.z;
+        tm[i]=r.tm;
+        t_max[i]=t;
+        is_hit[i]=false;
+    }
+    ray_t ray(int i)const
+    {
+        return ray_t(point3_t(ox[i],oy[i],oz[i]),vec3_t(dx[i],dy[i],dz[i]),tm[i]);
+    }
+    void update(int i,const hit_record_t &r)
+    {
+        is_hit[i]=true;
+        t_max[i]=r.t;
+        rec[i]=r;
+    }
 };
 
 class hittable_t
 {
 public:
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const = 0;
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const = 0;
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const=0;
+
+    // Any-hit query: true as soon as something lies in [t_min,t_max], no
+    // hit record is built.  Shadow and visibility rays only need this.
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const
+    {
+        return hit(r,t_min,t_max).first;
+    }
+
+    // Appends the materials this object refers to, used to build the scene's material table.
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const{}
+
+    // Light sampling.  Emissive primitives that can be sampled append
+    // themselves in collect_lights(); random(o) returns a vector from o to a
+    // point on the surface and pdf_value(o,v) the solid angle density of
+    // picking direction v that way (0 if v misses the surface).
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const{}
+    virtual double pdf_value(const point3_t &o,const vec3_t &v)const{ return 0; }
+    virtual vec3_t random(const point3_t &o)const{ return {1,0,0}; }
+
+    // Whether hit() may draw random numbers, as participating media do, here
+    // or in anything this object contains.
+    virtual bool has_media()const{ return false; }
+
+    // Intersects the packet lanes set in mask.  The default traces them one by one.
+    virtual void hit_packet(ray_packet_t &packet,uint32_t mask,real_t t_min)const
+    {
+        for(int i=0;i<packet.size;i++)
+        {
+            if((mask>>i&1)==0)
+                continue;
+            auto [is_hit,rec]=hit(packet.ray(i),t_min,packet.t_max[i]);
+            if(is_hit)
+                packet.update(i,rec);
+        }
+    }
 };
 
 class hittable_list_t:public hittable_t
@@ -46,7 +132,7 @@ public:
     void clear() { objects.clear(); }
     void add(std::shared_ptr<hittable_t> object) { objects.push_back(object); }
 
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
     {
         hit_record_t temp_rec{};
         bool hit_anything = false;
@@ -64,6 +150,35 @@ public:
         }
         return {hit_anything, temp_rec};
     }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        for (const auto &object : objects)
+            if (object->occluded(r, t_min, t_max))
+                return true;
+        return false;
+    }
+    virtual void hit_packet(ray_packet_t &packet,uint32_t mask,real_t t_min)const override
+    {
+        for(const auto &object:objects)
+            object->hit_packet(packet,mask,t_min);
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        for(const auto &object:objects)
+            object->collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        for(const auto &object:objects)
+            object->collect_lights(out);
+    }
+    virtual bool has_media()const override
+    {
+        for(const auto &object:objects)
+            if(object->has_media())
+                return true;
+        return false;
+    }
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const override
     {
         if (objects.empty()) 
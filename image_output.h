@@ -0,0 +1,602 @@
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include<vec3.h>
+#include<scheduler.h>
+#include<vector>
+#include<string>
+#include<memory>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<cstdio>
+#include<cstdint>
+#include<cstdlib>
+#include<cctype>
+#include<algorithm>
+
+// same tone curve as write_clour: gamma 2, clamped
+inline uint8_t to_byte(double v)
+{
+    return uint8_t(clamp(std::sqrt(v),0,0.999)*256);
+}
+
+// Encodes an image one row at a time, top to bottom, so rows can go out while
+// the rows below them are still rendering.
+class image_writer_t
+{
+public:
+    virtual ~image_writer_t()=default;
+    virtual bool begin(FILE *out,int width,int height)
+    {
+        this->out=out;
+        this->width=width;
+        this->height=height;
+        y=0;
+        return true;
+    }
+    virtual bool write_row(const colour_t *row)=0;
+    virtual bool end(){return std::fflush(out)==0;}
+
+protected:
+    FILE *out=nullptr;
+    int width=0;
+    int height=0;
+    int y=0;        // next row
+
+    bool put(const void *data,size_t size){return std::fwrite(data,1,size,out)==size;}
+};
+
+// ASCII, the format main.cpp used to print
+class p3_writer_t:public image_writer_t
+{
+public:
+    virtual bool begin(FILE *out,int width,int height)override
+    {
+        image_writer_t::begin(out,width,height);
+        return std::fprintf(out,"P3 %d %d 255\n",width,height)>0;
+    }
+    virtual bool write_row(const colour_t *row)override
+    {
+        for(int x=0;x<width;x++)
+            if(std::fprintf(out,"%d %d %d\n",to_byte(row[x].x),to_byte(row[x].y),to_byte(row[x].z))<0)
+                return false;
+        y++;
+        return true;
+    }
+};
+
+class p6_writer_t:public image_writer_t
+{
+    std::vector<uint8_t> bytes;
+public:
+    virtual bool begin(FILE *out,int width,int height)override
+    {
+        image_writer_t::begin(out,width,height);
+        bytes.resize(size_t(width)*3);
+        return std::fprintf(out,"P6\n%d %d\n255\n",width,height)>0;
+    }
+    virtual bool write_row(const colour_t *row)override
+    {
+        for(int x=0;x<width;x++)
+        {
+            bytes[3*x+0]=to_byte(row[x].x);
+            bytes[3*x+1]=to_byte(row[x].y);
+            bytes[3*x+2]=to_byte(row[x].z);
+        }
+        y++;
+        return put(bytes.data(),bytes.size());
+    }
+};
+
+// Linear float RGB, no tone curve.  PFM stores the bottom row first: rows
+// are placed with fseek when the output can seek, else kept until end().
+class pfm_writer_t:public image_writer_t
+{
+    long base=-1;
+    std::vector<float> rows;
+public:
+    virtual bool begin(FILE *out,int width,int height)override
+    {
+        image_writer_t::begin(out,width,height);
+        // a negative scale marks little endian data
+        uint16_t probe=1;
+        bool is_little=*reinterpret_cast<uint8_t*>(&probe)==1;
+        if(std::fprintf(out,"PF\n%d %d\n%s\n",width,height,is_little?"-1.0":"1.0")<0)
+            return false;
+        base=std::ftell(out);
+        rows.clear();
+        if(base<0 || std::fseek(out,base,SEEK_SET)!=0)
+        {
+            base=-1;
+            rows.resize(size_t(width)*height*3);
+        }
+        return true;
+    }
+    virtual bool write_row(const colour_t *row)override
+    {
+        auto row_index=size_t(height-1-y);
+        y++;
+        float line[3*256];
+        for(int x0=0;x0<width;x0+=256)
+        {
+            int n=std::min(256,width-x0);
+            float *dst=base<0?&rows[(row_index*width+x0)*3]:line;
+            for(int x=0;x<n;x++)
+            {
+                dst[3*x+0]=float(row[x0+x].x);
+                dst[3*x+1]=float(row[x0+x].y);
+                dst[3*x+2]=float(row[x0+x].z);
+            }
+            if(base<0)
+                continue;
+            if(std::fseek(out,base+long((row_index*width+x0)*3*sizeof(float)),SEEK_SET)!=0 || put(line,n*3*sizeof(float))==false)
+                return false;
+        }
+        return true;
+    }
+    virtual bool end()override
+    {
+        if(base<0 && put(rows.data(),rows.size()*sizeof(float))==false)
+            return false;
+        return image_writer_t::end();
+    }
+};
+
+// PNG, streamed a row at a time.  Each row takes the filter with the least
+// sum of absolute bytes, the libpng heuristic, and the zlib stream is one
+// deflate block of fixed Huffman codes with LZ77 matches found through hash
+// chains over the last 32K.  Rows go out as one IDAT chunk each, matches may
+// reach back into earlier rows.  Slower to write than QOI and larger than a
+// dynamic Huffman encoder would make it, but far from the raw size.
+class png_writer_t:public image_writer_t
+{
+    static constexpr size_t window_size=32768;
+    static constexpr int min_match=3,max_match=258,max_chain=32;
+
+    std::vector<uint8_t> chunk;
+    std::vector<uint8_t> raw,prior;                 // this row and the one above, unfiltered
+    std::vector<uint8_t> row_bytes,candidate;       // filter byte and filtered row
+    uint32_t adler_a=1,adler_b=0;
+    // deflate state: window holds the stream from window_base on, every
+    // byte before encoded is coded, head and chain index the 3-byte hashes
+    std::vector<uint8_t> window;
+    size_t window_base=0,encoded=0;
+    std::vector<int64_t> head,chain;
+    uint64_t bits=0;
+    int bit_count=0;
+
+    static uint32_t crc32(const uint8_t *data,size_t size,uint32_t crc=0)
+    {
+        static const auto table=[]{
+            std::vector<uint32_t> t(256);
+            for(uint32_t n=0;n<256;n++)
+            {
+                uint32_t c=n;
+                for(int k=0;k<8;k++)
+                    c=c&1?0xedb88320u^(c>>1):c>>1;
+                t[n]=c;
+            }
+            return t;
+        }();
+        crc=~crc;
+        for(size_t i=0;i<size;i++)
+            crc=table[(crc^data[i])&0xff]^(crc>>8);
+        return ~crc;
+    }
+    void adler32(const uint8_t *data,size_t size)
+    {
+        // 5552 bytes is the most that can be summed before the 32 bit b overflows
+        while(size)
+        {
+            auto n=std::min(size,size_t(5552));
+            for(size_t i=0;i<n;i++)
+            {
+                adler_a+=data[i];
+                adler_b+=adler_a;
+            }
+            adler_a%=65521;
+            adler_b%=65521;
+            data+=n;
+            size-=n;
+        }
+    }
+    static void put_u32(std::vector<uint8_t> &v,uint32_t x)
+    {
+        v.push_back(uint8_t(x>>24));
+        v.push_back(uint8_t(x>>16));
+        v.push_back(uint8_t(x>>8));
+        v.push_back(uint8_t(x));
+    }
+    // chunk holds the type followed by the data
+    bool put_chunk()
+    {
+        std::vector<uint8_t> head;
+        put_u32(head,uint32_t(chunk.size()-4));
+        std::vector<uint8_t> tail;
+        put_u32(tail,crc32(chunk.data(),chunk.size()));
+        return put(head.data(),4) && put(chunk.data(),chunk.size()) && put(tail.data(),4);
+    }
+    void start_chunk(const char *type)
+    {
+        chunk.assign(type,type+4);
+    }
+
+    static uint8_t paeth(int a,int b,int c)
+    {
+        int p=a+b-c,pa=std::abs(p-a),pb=std::abs(p-b),pc=std::abs(p-c);
+        return uint8_t(pa<=pb && pa<=pc?a:pb<=pc?b:c);
+    }
+    // row_bytes is raw under the filter that leaves the smallest bytes
+    void filter_row()
+    {
+        const int bpp=3;
+        auto n=raw.size();
+        row_bytes.resize(1+n);
+        candidate.resize(1+n);
+        uint64_t best_sum=~uint64_t(0);
+        for(uint8_t type=0;type<5;type++)
+        {
+            candidate[0]=type;
+            uint64_t sum=0;
+            for(size_t i=0;i<n;i++)
+            {
+                int a=i>=bpp?raw[i-bpp]:0,b=prior[i],c=i>=bpp?prior[i-bpp]:0;
+                int predict=type==1?a:type==2?b:type==3?(a+b)/2:type==4?paeth(a,b,c):0;
+                auto v=uint8_t(raw[i]-predict);
+                candidate[1+i]=v;
+                sum+=std::abs(int(int8_t(v)));
+            }
+            if(sum<best_sum)
+            {
+                best_sum=sum;
+                std::swap(row_bytes,candidate);
+            }
+        }
+    }
+
+    void put_bits(uint32_t value,int n)
+    {
+        bits|=uint64_t(value)<<bit_count;
+        bit_count+=n;
+        for(;bit_count>=8;bit_count-=8,bits>>=8)
+            chunk.push_back(uint8_t(bits));
+    }
+    // Huffman codes go out most significant bit first
+    void put_code(uint32_t code,int n)
+    {
+        uint32_t reversed=0;
+        for(int i=0;i<n;i++)
+            reversed|=(code>>i&1)<<(n-1-i);
+        put_bits(reversed,n);
+    }
+    // literal/length symbol in the fixed code of RFC 1951 3.2.6
+    void put_symbol(int s)
+    {
+        if(s<144)
+            put_code(0x30+s,8);
+        else if(s<256)
+            put_code(0x190+s-144,9);
+        else if(s<280)
+            put_code(s-256,7);
+        else
+            put_code(0xc0+s-280,8);
+    }
+    void put_match(int length,int distance)
+    {
+        static const uint16_t length_base[29]={3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+        static const uint8_t length_extra[29]={0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+        static const uint16_t distance_base[30]={1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+        static const uint8_t distance_extra[30]={0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+        int l=28;
+        while(length_base[l]>length)
+            l--;
+        put_symbol(257+l);
+        put_bits(length-length_base[l],length_extra[l]);
+        int d=29;
+        while(distance_base[d]>distance)
+            d--;
+        put_code(d,5);
+        put_bits(distance-distance_base[d],distance_extra[d]);
+    }
+    // Codes the window up to its end, or while a longest match still fits
+    // before the end unless is_last, so matches run on into the next row.
+    void deflate(bool is_last)
+    {
+        auto end=window_base+window.size();
+        auto at=[&](size_t p){return window[p-window_base];};
+        auto hash=[&](size_t p){return (size_t(at(p))<<10^size_t(at(p+1))<<5^at(p+2))&(window_size-1);};
+        auto insert=[&](size_t p){
+            if(p+min_match>end)
+                return;
+            auto h=hash(p);
+            chain[p&(window_size-1)]=head[h];
+            head[h]=int64_t(p);
+        };
+        while(encoded<end && (is_last || encoded+max_match<=end))
+        {
+            int best_length=0;
+            size_t best_distance=0;
+            if(encoded+min_match<=end)
+            {
+                auto limit=int(std::min(end-encoded,size_t(max_match)));
+                auto candidate=head[hash(encoded)];
+                for(int k=0;k<max_chain && candidate>=0 && encoded-size_t(candidate)<=window_size;k++)
+                {
+                    auto p=size_t(candidate);
+                    int length=0;
+                    while(length<limit && at(p+length)==at(encoded+length))
+                        length++;
+                    if(length>best_length)
+                    {
+                        best_length=length;
+                        best_distance=encoded-p;
+                        if(length==limit)
+                            break;
+                    }
+                    auto next=chain[p&(window_size-1)];
+                    if(next>=candidate)             // the slot was reused by a newer position
+                        break;
+                    candidate=next;
+                }
+            }
+            if(best_length>=min_match)
+            {
+                put_match(best_length,int(best_distance));
+                for(int k=0;k<best_length;k++)
+                    insert(encoded++);
+            }
+            else
+            {
+                put_symbol(at(encoded));
+                insert(encoded++);
+            }
+        }
+        // keep the window and the bytes not yet coded
+        if(encoded-window_base>2*window_size)
+        {
+            auto drop=encoded-window_size-window_base;
+            window.erase(window.begin(),window.begin()+drop);
+            window_base+=drop;
+        }
+    }
+public:
+    virtual bool begin(FILE *out,int width,int height)override
+    {
+        image_writer_t::begin(out,width,height);
+        adler_a=1;
+        adler_b=0;
+        prior.assign(size_t(width)*3,0);
+        window.clear();
+        window_base=encoded=0;
+        head.assign(window_size,-1);
+        chain.assign(window_size,-1);
+        bits=0;
+        bit_count=0;
+        static const uint8_t signature[8]={0x89,'P','N','G','\r','\n',0x1a,'\n'};
+        if(put(signature,sizeof(signature))==false)
+            return false;
+        start_chunk("IHDR");
+        put_u32(chunk,width);
+        put_u32(chunk,height);
+        chunk.insert(chunk.end(),{8,2,0,0,0});      // 8 bit RGB, no interlace
+        return put_chunk();
+    }
+    virtual bool write_row(const colour_t *row)override
+    {
+        raw.resize(size_t(width)*3);
+        for(int x=0;x<width;x++)
+        {
+            raw[3*x+0]=to_byte(row[x].x);
+            raw[3*x+1]=to_byte(row[x].y);
+            raw[3*x+2]=to_byte(row[x].z);
+        }
+        filter_row();
+        std::swap(raw,prior);
+        adler32(row_bytes.data(),row_bytes.size());
+        window.insert(window.end(),row_bytes.begin(),row_bytes.end());
+        start_chunk("IDAT");
+        if(y==0)
+        {
+            chunk.insert(chunk.end(),{0x78,0x01});   // zlib header, 32K window
+            put_bits(3,3);                           // the final block, fixed codes
+        }
+        y++;
+        bool is_last=y==height;
+        deflate(is_last);
+        if(is_last)
+        {
+            put_symbol(256);                         // end of block
+            put_bits(0,7);                           // pad to a byte
+            bit_count=0;
+            put_u32(chunk,(adler_b<<16)|adler_a);
+        }
+        return chunk.size()==4 || put_chunk();
+    }
+    virtual bool end()override
+    {
+        start_chunk("IEND");
+        return put_chunk() && image_writer_t::end();
+    }
+};
+
+// The Quite OK Image format (qoiformat.org), RGB
+class qoi_writer_t:public image_writer_t
+{
+    struct pixel_t{uint8_t r,g,b,a;};
+    pixel_t index[64];
+    pixel_t prev;
+    int run;
+    std::vector<uint8_t> bytes;
+
+    static bool same(pixel_t p,pixel_t q){return p.r==q.r && p.g==q.g && p.b==q.b && p.a==q.a;}
+    void put_u32(uint32_t x)
+    {
+        bytes.insert(bytes.end(),{uint8_t(x>>24),uint8_t(x>>16),uint8_t(x>>8),uint8_t(x)});
+    }
+public:
+    virtual bool begin(FILE *out,int width,int height)override
+    {
+        image_writer_t::begin(out,width,height);
+        for(auto &p:index)
+            p={0,0,0,0};
+        prev={0,0,0,255};
+        run=0;
+        bytes.assign({'q','o','i','f'});
+        put_u32(width);
+        put_u32(height);
+        bytes.insert(bytes.end(),{3,0});            // RGB, sRGB
+        return put(bytes.data(),bytes.size());
+    }
+    virtual bool write_row(const colour_t *row)override
+    {
+        bytes.clear();
+        for(int x=0;x<width;x++)
+        {
+            pixel_t p{to_byte(row[x].x),to_byte(row[x].y),to_byte(row[x].z),255};
+            if(same(p,prev))
+            {
+                if(++run==62)
+                {
+                    bytes.push_back(0xc0|(run-1));
+                    run=0;
+                }
+                continue;
+            }
+            if(run)
+            {
+                bytes.push_back(0xc0|(run-1));
+                run=0;
+            }
+            int hash=(p.r*3+p.g*5+p.b*7+p.a*11)%64;
+            if(same(index[hash],p))
+                bytes.push_back(uint8_t(hash));
+            else
+            {
+                index[hash]=p;
+                int dr=int8_t(p.r-prev.r);
+                int dg=int8_t(p.g-prev.g);
+                int db=int8_t(p.b-prev.b);
+                int dr_dg=dr-dg;
+                int db_dg=db-dg;
+                if(dr>=-2 && dr<=1 && dg>=-2 && dg<=1 && db>=-2 && db<=1)
+                    bytes.push_back(uint8_t(0x40|(dr+2)<<4|(dg+2)<<2|(db+2)));
+                else if(dg>=-32 && dg<=31 && dr_dg>=-8 && dr_dg<=7 && db_dg>=-8 && db_dg<=7)
+                    bytes.insert(bytes.end(),{uint8_t(0x80|(dg+32)),uint8_t((dr_dg+8)<<4|(db_dg+8))});
+                else
+                    bytes.insert(bytes.end(),{0xfe,p.r,p.g,p.b});
+            }
+            prev=p;
+        }
+        y++;
+        return put(bytes.data(),bytes.size());
+    }
+    virtual bool end()override
+    {
+        bytes.clear();
+        if(run)
+            bytes.push_back(0xc0|(run-1));
+        bytes.insert(bytes.end(),{0,0,0,0,0,0,0,1});
+        return put(bytes.data(),bytes.size()) && image_writer_t::end();
+    }
+};
+
+// p3, p6, pfm, png or qoi; nullptr for anything else
+inline std::unique_ptr<image_writer_t> make_image_writer(const std::string &format)
+{
+    if(format=="p3")
+        return std::make_unique<p3_writer_t>();
+    if(format=="p6" || format=="ppm")
+        return std::make_unique<p6_writer_t>();
+    if(format=="pfm")
+        return std::make_unique<pfm_writer_t>();
+    if(format=="png")
+        return std::make_unique<png_writer_t>();
+    if(format=="qoi")
+        return std::make_unique<qoi_writer_t>();
+    return nullptr;
+}
+
+// the extension of path, lower case
+inline std::string image_format_of(const std::string &path)
+{
+    auto dot=path.rfind('.');
+    std::string ext=dot==std::string::npos?"":path.substr(dot+1);
+    for(auto &c:ext)
+        c=char(std::tolower(c));
+    return ext;
+}
+
+// Hands framebuffer rows to a writer on its own thread as soon as every tile
+// covering them has been rendered, so encoding and disk writes overlap the
+// rendering of the rows below.  Render threads report with tile_done().
+class image_stream_t
+{
+public:
+    image_stream_t(image_writer_t &writer,FILE *out,const std::vector<colour_t> &framebuffer,int width,int height)
+        :writer(writer),framebuffer(framebuffer),width(width),height(height),finished(height,0)
+    {
+        thread=std::thread([this,out]{ run(out); });
+    }
+    ~image_stream_t()
+    {
+        if(thread.joinable())
+            finish();
+    }
+
+    void tile_done(const tile_t &tile)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for(int y=tile.y0;y<tile.y1;y++)
+                finished[y]+=tile.x1-tile.x0;
+        }
+        ready.notify_one();
+    }
+
+    // Writes whatever rows are left, for callers that filled the framebuffer
+    // without tile_done().  Returns false if any write failed.
+    bool finish()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            is_done=true;
+        }
+        ready.notify_one();
+        thread.join();
+        return ok;
+    }
+
+private:
+    image_writer_t &writer;
+    const std::vector<colour_t> &framebuffer;
+    int width,height;
+    std::vector<int> finished;      // rendered pixels per row
+    int next_row=0;                 // only touched by the writer thread
+    bool is_done=false;
+    bool ok=true;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::thread thread;
+
+    void run(FILE *out)
+    {
+        ok=writer.begin(out,width,height);
+        while(next_row<height)
+        {
+            int last;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                ready.wait(lock,[this]{ return is_done || finished[next_row]>=width; });
+                last=next_row;
+                while(last<height && (is_done || finished[last]>=width))
+                    last++;
+            }
+            for(;next_row<last;next_row++)
+                ok=writer.write_row(&framebuffer[size_t(next_row)*width]) && ok;
+        }
+        ok=writer.end() && ok;
+    }
+};
+
+#endif
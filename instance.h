@@ -0,0 +1,195 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include<hittable.h>
+#include<aabb.h>
+#include<cmath>
+#include<cstdio>
+#include<algorithm>
+
+// The affine map p -> m*p+t, m stored by rows.
+struct affine_t
+{
+    vec3_t m[3]={{1,0,0},{0,1,0},{0,0,1}};
+    vec3_t t={0,0,0};
+
+    static affine_t translate(const vec3_t &v)
+    {
+        affine_t a;
+        a.t=v;
+        return a;
+    }
+    static affine_t scale(const vec3_t &s)
+    {
+        affine_t a;
+        a.m[0]={s.x,0,0};
+        a.m[1]={0,s.y,0};
+        a.m[2]={0,0,s.z};
+        return a;
+    }
+    static affine_t scale(real_t s)
+    {
+        return scale(vec3_t(s,s,s));
+    }
+    // degrees, turning the same way as plane_t::rotate_y
+    static affine_t rotate_y(double theta)
+    {
+        theta=dtor(theta);
+        real_t c=std::cos(theta),s=std::sin(theta);
+        affine_t a;
+        a.m[0]={c,0,s};
+        a.m[2]={-s,0,c};
+        return a;
+    }
+    // degrees about a unit axis through the origin (Rodrigues)
+    static affine_t rotate(const vec3_t &axis,double theta)
+    {
+        theta=dtor(theta);
+        auto u=axis.unit();
+        real_t c=std::cos(theta),s=std::sin(theta),k=1-c;
+        affine_t a;
+        a.m[0]={c+u.x*u.x*k,    u.x*u.y*k-u.z*s, u.x*u.z*k+u.y*s};
+        a.m[1]={u.y*u.x*k+u.z*s, c+u.y*u.y*k,    u.y*u.z*k-u.x*s};
+        a.m[2]={u.z*u.x*k-u.y*s, u.z*u.y*k+u.x*s, c+u.z*u.z*k};
+        return a;
+    }
+
+    point3_t point(const point3_t &p)const
+    {
+        return vector(p)+t;
+    }
+    vec3_t vector(const vec3_t &v)const
+    {
+        return vec3_t(dot(m[0],v),dot(m[1],v),dot(m[2],v));
+    }
+    // m transposed times v, maps normals when called on the inverse map
+    vec3_t transposed(const vec3_t &v)const
+    {
+        return m[0]*v.x+m[1]*v.y+m[2]*v.z;
+    }
+    // the largest stretch of a vector's max norm, bounds how errors grow
+    real_t norm()const
+    {
+        auto row=[](const vec3_t &r){return std::fabs(r.x)+std::fabs(r.y)+std::fabs(r.z);};
+        return std::max({row(m[0]),row(m[1]),row(m[2])});
+    }
+
+    affine_t inverse()const
+    {
+        // rows of the inverse are the cross products of the columns over the determinant
+        vec3_t c0(m[0].x,m[1].x,m[2].x),c1(m[0].y,m[1].y,m[2].y),c2(m[0].z,m[1].z,m[2].z);
+        auto det=dot(c0,cross(c1,c2));
+        if(det==0)
+            std::fprintf(stderr,"error! singular affine transform\n");
+        affine_t a;
+        a.m[0]=cross(c1,c2)/det;
+        a.m[1]=cross(c2,c0)/det;
+        a.m[2]=cross(c0,c1)/det;
+        a.t=-a.vector(t);
+        return a;
+    }
+    // the box of the mapped box, per axis the extremes of each term (Arvo)
+    aabb_t box(const aabb_t &b)const
+    {
+        point3_t lo=t,hi=t;
+        real_t *los[]={&lo.x,&lo.y,&lo.z},*his[]={&hi.x,&hi.y,&hi.z};
+        const real_t bmin[]={b.min().x,b.min().y,b.min().z},bmax[]={b.max().x,b.max().y,b.max().z};
+        for(int i=0;i<3;i++)
+        {
+            const real_t row[]={m[i].x,m[i].y,m[i].z};
+            for(int j=0;j<3;j++)
+            {
+                auto e=row[j]*bmin[j],f=row[j]*bmax[j];
+                *los[i]+=std::min(e,f);
+                *his[i]+=std::max(e,f);
+            }
+        }
+        return aabb_t(lo,hi);
+    }
+};
+
+// a then b
+inline affine_t operator*(const affine_t &b,const affine_t &a)
+{
+    affine_t c;
+    for(int i=0;i<3;i++)
+        c.m[i]=a.transposed(b.m[i]);
+    c.t=b.point(a.t);
+    return c;
+}
+
+// One placement of a shared object.  The object, usually a linear_bvh_t or a
+// triangle_mesh_t acting as a bottom level BVH, is built once in its own space
+// and referenced by every instance, so the scene's BVH over instances is the
+// top level and each copy costs only its two transforms and box.  Rays are
+// mapped into object space unnormalized, so t is the same in both spaces.
+//
+// Lights inside an instance are not sampled directly: collect_lights() does
+// not forward, and with no light pdf their emission is counted on BSDF hits.
+class instance_t:public hittable_t
+{
+public:
+    std::shared_ptr<const hittable_t> object;
+    affine_t to_world;
+    affine_t to_object;
+    aabb_t box;
+    bool has_box=false;
+
+    instance_t(std::shared_ptr<const hittable_t> object,const affine_t &to_world,double time0=0,double time1=1)
+        :object(object),to_world(to_world),to_object(to_world.inverse())
+    {
+        auto [exist_box,object_box]=object->bounding_box(time0,time1);
+        has_box=exist_box;
+        if(exist_box)
+            box=to_world.box(object_box);
+    }
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        auto [is_hit,rec]=object->hit(local(r),t_min,t_max);
+        if(is_hit==false)
+            return {false,{}};
+        // errors of the object space point grow with the map, and mapping it adds rounding
+        auto p=rec.p;
+        rec.p=to_world.point(p);
+        rec.p_error=to_world.norm()*rec.p_error+reprojection_error(rec.p,to_world.norm()*max_abs(p));
+        // the inverse transpose keeps dot(normal,direction), so front_face stays valid
+        rec.normal=to_object.transposed(rec.normal).unit();
+        return {true,rec};
+    }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        return object->occluded(local(r),t_min,t_max);
+    }
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const override
+    {
+        return {has_box,box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        object->collect_materials(out);
+    }
+    virtual bool has_media()const override
+    {
+        return object->has_media();
+    }
+
+    void move(const vec3_t &direction)
+    {
+        to_world.t+=direction;
+        to_object=to_world.inverse();
+        box=aabb_t(box.min()+direction,box.max()+direction);
+    }
+
+private:
+    ray_t local(const ray_t &r)const
+    {
+        return ray_t(to_object.point(r.origin()),to_object.vector(r.direction()),r.time());
+    }
+    static real_t max_abs(const point3_t &p)
+    {
+        return std::max({std::fabs(p.x),std::fabs(p.y),std::fabs(p.z)});
+    }
+};
+
+#endif
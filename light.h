@@ -0,0 +1,52 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include<hittable.h>
+#include<vector>
+
+// The emitters of a scene that can be sampled directly.  A light sample picks
+// one of them uniformly, then a point on it.
+class light_list_t
+{
+public:
+    std::vector<const hittable_t*> lights;
+
+    light_list_t()=default;
+    explicit light_list_t(const hittable_t &world)
+    {
+        world.collect_lights(lights);
+    }
+
+    size_t size()const{return lights.size();}
+    bool empty()const{return lights.empty();}
+
+    const hittable_t *pick()const
+    {
+        auto i=size_t(rand_uniform()*lights.size());
+        return lights[std::min(i,lights.size()-1)];
+    }
+
+    // Density of a light sample from o arriving along v at the light that v
+    // meets first.  Lights hidden behind it are never seen through a shadow
+    // ray, so they do not count.
+    double pdf_value(const point3_t &o,const vec3_t &v)const
+    {
+        ray_t r(o,v,0);
+        const hittable_t *nearest=nullptr;
+        auto closest_so_far=infinity;
+        for(auto light:lights)
+        {
+            auto [is_hit,rec]=light->hit(r,ray_t_min,closest_so_far);
+            if(is_hit)
+            {
+                nearest=light;
+                closest_so_far=rec.t;
+            }
+        }
+        if(nearest==nullptr)
+            return 0;
+        return nearest->pdf_value(o,v)/lights.size();
+    }
+};
+
+#endif
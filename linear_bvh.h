@@ -0,0 +1,394 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include<hittable.h>
+#include<aabb.h>
+#include<bvh.h>
+#include<cstdint>
+
+// One node per cache line, or two in float mode, where the box takes 24 bytes
+// and a node packs into 32.  Interior nodes keep their first child right
+// behind them and the second one at `offset`; leaves keep `count` primitives
+// starting at `offset` in linear_bvh_t::prims.  Nodes are in depth first
+// order, so a subtree is a contiguous run of nodes and of primitives.
+struct alignas(sizeof(aabb_t)+8<=32?32:64) linear_bvh_node_t
+{
+    aabb_t   box;
+    uint32_t offset;
+    uint16_t count;
+    uint8_t  axis;
+
+    bool is_leaf()const{return count!=0;}
+};
+static_assert(64%sizeof(linear_bvh_node_t)==0,"a node must not straddle cache lines");
+
+class linear_bvh_t:public hittable_t
+{
+public:
+    std::vector<linear_bvh_node_t> nodes;
+    std::vector<const hittable_t*> prims;
+    std::vector<std::shared_ptr<hittable_t>> objects;   // keeps prims alive
+    bvh_build_options_t options;
+    std::vector<double> built_quality;                  // per node, SAH cost per area when built
+
+    static constexpr int stack_size=64;
+    // a walk holds at most one entry per level plus the sibling of the last
+    static_assert(bvh_builder_t::max_depth+1<=stack_size,"traversal stack shallower than the deepest tree");
+
+    linear_bvh_t()=default;
+    linear_bvh_t(const hittable_list_t &list,double time0,double time1,const bvh_build_options_t &options=bvh_build_options_t())
+        :options(options)
+    {
+        std::vector<aabb_t> boxes;
+        boxes.reserve(list.objects.size());
+        for(auto &object:list.objects)
+        {
+            auto [exist_box,box]=object->bounding_box(time0,time1);
+            if(exist_box==false)
+                std::fprintf(stderr,"error! linear bvh constructor\n");
+            boxes.push_back(box);
+        }
+        bvh_builder_t builder(boxes,options);
+        auto root=builder.build();
+        if(!root)
+            return;
+        for(auto i:builder.indices)
+            objects.push_back(list.objects[i]);
+        for(auto &object:objects)
+            prims.push_back(object.get());
+        nodes.reserve(builder.node_count);
+        flatten(*root,nodes,0);
+        subtree_costs(nodes,cost);
+        built_quality.resize(nodes.size());
+        for(size_t k=0;k<nodes.size();k++)
+            built_quality[k]=cost_per_area(k);
+    }
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        hit_record_t temp_rec{};
+        bool hit_anything=false;
+        if(nodes.empty())
+            return {false,temp_rec};
+
+        ray_inv_t ray(r);
+        uint32_t stack[stack_size];
+        int top=0;
+        uint32_t current=0;
+        while(true)
+        {
+            auto &node=nodes[current];
+            if(node.box.hit(ray,t_min,t_max))
+            {
+                if(node.is_leaf())
+                {
+                    for(uint32_t i=node.offset;i<node.offset+node.count;i++)
+                    {
+                        auto [is_hit,rec]=prims[i]->hit(r,t_min,t_max);
+                        if(is_hit)
+                        {
+                            hit_anything=true;
+                            t_max=rec.t;
+                            temp_rec=rec;
+                        }
+                    }
+                    if(top==0)
+                        break;
+                    current=stack[--top];
+                }
+                else if(ray.sign[node.axis])
+                {
+                    // the second child lies nearer along this ray
+                    stack[top++]=current+1;
+                    current=node.offset;
+                }
+                else
+                {
+                    stack[top++]=node.offset;
+                    current=current+1;
+                }
+            }
+            else
+            {
+                if(top==0)
+                    break;
+                current=stack[--top];
+            }
+        }
+        return {hit_anything,temp_rec};
+    }
+    // no near-first ordering, any primitive in range ends the walk
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        if(nodes.empty())
+            return false;
+        ray_inv_t ray(r);
+        uint32_t stack[stack_size];
+        int top=0;
+        stack[top++]=0;
+        while(top)
+        {
+            auto &node=nodes[stack[--top]];
+            if(node.box.hit(ray,t_min,t_max)==false)
+                continue;
+            if(node.is_leaf())
+            {
+                for(uint32_t i=node.offset;i<node.offset+node.count;i++)
+                    if(prims[i]->occluded(r,t_min,t_max))
+                        return true;
+                continue;
+            }
+            stack[top++]=node.offset;
+            stack[top++]=uint32_t(&node-nodes.data())+1;
+        }
+        return false;
+    }
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1) const override
+    {
+        if(nodes.empty())
+            return {false,{}};
+        return {true,nodes[0].box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_lights(out);
+    }
+    virtual bool has_media()const override
+    {
+        for(auto &object:objects)
+            if(object->has_media())
+                return true;
+        return false;
+    }
+
+    // Recomputes every box bottom-up from the primitives' boxes over
+    // [time0,time1], the topology stays.  Children follow their parent, so
+    // one backward pass over the nodes does it.
+    void refit(double time0,double time1)
+    {
+        for(size_t k=nodes.size();k-->0;)
+        {
+            auto &node=nodes[k];
+            if(node.is_leaf())
+            {
+                node.box=prims[node.offset]->bounding_box(time0,time1).second;
+                for(uint32_t i=node.offset+1;i<node.offset+node.count;i++)
+                    node.box=surrounding_box(node.box,prims[i]->bounding_box(time0,time1).second);
+            }
+            else
+                node.box=surrounding_box(nodes[k+1].box,nodes[node.offset].box);
+        }
+        subtree_costs(nodes,cost);
+    }
+    // the root's quality after the last refit, 1 right after a build
+    double quality()const
+    {
+        return nodes.empty()?1:quality(0);
+    }
+    // Refits, then rebuilds what degraded: the largest subtrees past
+    // partial_ratio, or the whole tree past full_ratio or when those hold
+    // full_fraction of the primitives.
+    bvh_update_t update(double time0,double time1,const bvh_refit_options_t &refit_options={})
+    {
+        if(nodes.empty())
+            return bvh_update_t::refit;
+        refit(time0,time1);
+        if(quality(0)>=refit_options.full_ratio)
+            return rebuild_all(time0,time1);
+        if(nodes[0].is_leaf())
+            return bvh_update_t::refit;
+        std::vector<uint32_t> degraded;
+        uint32_t stack[stack_size];
+        int top=0;
+        stack[top++]=1;
+        stack[top++]=nodes[0].offset;
+        while(top)
+        {
+            auto k=stack[--top];
+            if(nodes[k].is_leaf())
+                continue;
+            if(quality(k)>=refit_options.partial_ratio)
+            {
+                degraded.push_back(k);
+                continue;
+            }
+            stack[top++]=k+1;
+            stack[top++]=nodes[k].offset;
+        }
+        if(degraded.empty())
+            return bvh_update_t::refit;
+        size_t degraded_prims=0;
+        for(auto k:degraded)
+        {
+            uint32_t node_end,prim_first,prim_end;
+            subtree_range(k,node_end,prim_first,prim_end);
+            degraded_prims+=prim_end-prim_first;
+        }
+        if(degraded_prims>=refit_options.full_fraction*prims.size())
+            return rebuild_all(time0,time1);
+        std::sort(degraded.begin(),degraded.end());
+        rebuild(degraded,time0,time1);
+        subtree_costs(nodes,cost);
+        return bvh_update_t::partial;
+    }
+
+private:
+    std::vector<double> cost;     // SAH cost of each subtree, from the last refit
+
+    double cost_per_area(size_t k)const
+    {
+        auto area=surface_area(nodes[k].box);
+        return area>0?cost[k]/area:1;
+    }
+    double quality(size_t k)const
+    {
+        return cost_per_area(k)/built_quality[k];
+    }
+    // cost of a leaf is its area times its count, an inner node adds the
+    // traversal cost times its area to its children's
+    void subtree_costs(const std::vector<linear_bvh_node_t> &tree,std::vector<double> &out)const
+    {
+        out.resize(tree.size());
+        for(size_t k=tree.size();k-->0;)
+        {
+            auto &node=tree[k];
+            auto area=surface_area(node.box);
+            out[k]=node.is_leaf()?area*node.count:options.traversal_cost*area+out[k+1]+out[node.offset];
+        }
+    }
+    // the depth of every node, children always come after their parent
+    std::vector<int> node_depths()const
+    {
+        std::vector<int> depth(nodes.size(),0);
+        for(size_t k=0;k<nodes.size();k++)
+            if(nodes[k].is_leaf()==false)
+                depth[k+1]=depth[nodes[k].offset]=depth[k]+1;
+        return depth;
+    }
+    // the nodes [k,node_end) and primitives [prim_first,prim_end) of the
+    // subtree at node k, from its leftmost and rightmost leaves
+    void subtree_range(uint32_t k,uint32_t &node_end,uint32_t &prim_first,uint32_t &prim_end)const
+    {
+        uint32_t last=k;
+        while(nodes[last].is_leaf()==false)
+            last=nodes[last].offset;
+        uint32_t first=k;
+        while(nodes[first].is_leaf()==false)
+            first++;
+        node_end=last+1;
+        prim_first=nodes[first].offset;
+        prim_end=nodes[last].offset+nodes[last].count;
+    }
+    bvh_update_t rebuild_all(double time0,double time1)
+    {
+        hittable_list_t list;
+        list.objects=std::move(objects);
+        *this=linear_bvh_t(list,time0,time1,options);
+        return bvh_update_t::full;
+    }
+    // Builds the subtrees at the sorted, disjoint nodes in roots anew over
+    // the same primitives and splices them in with one pass over the nodes.
+    void rebuild(const std::vector<uint32_t> &roots,double time0,double time1)
+    {
+        struct splice_t
+        {
+            uint32_t begin,end;
+            std::vector<linear_bvh_node_t> nodes;
+            int64_t shift;        // how far the nodes behind end move
+        };
+        std::vector<splice_t> splices;
+        int64_t shift=0;
+        auto depth=node_depths();
+        for(auto k:roots)
+        {
+            uint32_t end,prim_first,prim_end;
+            subtree_range(k,end,prim_first,prim_end);
+            std::vector<aabb_t> boxes;
+            for(auto i=prim_first;i<prim_end;i++)
+                boxes.push_back(prims[i]->bounding_box(time0,time1).second);
+            bvh_builder_t builder(boxes,options);
+            auto root=builder.build(depth[k]);
+            std::vector<std::shared_ptr<hittable_t>> reordered;
+            for(auto i:builder.indices)
+                reordered.push_back(objects[prim_first+i]);
+            for(size_t i=0;i<reordered.size();i++)
+            {
+                objects[prim_first+i]=reordered[i];
+                prims[prim_first+i]=reordered[i].get();
+            }
+            splice_t splice{k,end,{},0};
+            flatten(*root,splice.nodes,prim_first);
+            shift+=int64_t(splice.nodes.size())-int64_t(end-k);
+            splice.shift=shift;
+            splices.push_back(std::move(splice));
+        }
+        // an old index moves by the shift of the last splice ending at or before it
+        auto new_index=[&](uint32_t x){
+            auto it=std::upper_bound(splices.begin(),splices.end(),x,[](uint32_t x,const splice_t &s){return x<s.end;});
+            return uint32_t(x+(it==splices.begin()?0:(it-1)->shift));
+        };
+        std::vector<linear_bvh_node_t> out;
+        std::vector<double> out_quality;
+        out.reserve(size_t(int64_t(nodes.size())+shift));
+        out_quality.reserve(out.capacity());
+        size_t next=0;
+        for(uint32_t j=0;j<nodes.size();)
+        {
+            if(next<splices.size() && j==splices[next].begin)
+            {
+                auto &splice=splices[next++];
+                std::vector<double> splice_cost;
+                subtree_costs(splice.nodes,splice_cost);
+                auto base=uint32_t(out.size());
+                for(size_t i=0;i<splice.nodes.size();i++)
+                {
+                    auto node=splice.nodes[i];
+                    if(node.is_leaf()==false)
+                        node.offset+=base;
+                    auto area=surface_area(node.box);
+                    out.push_back(node);
+                    out_quality.push_back(area>0?splice_cost[i]/area:1);
+                }
+                j=splice.end;
+                continue;
+            }
+            auto node=nodes[j];
+            if(node.is_leaf()==false)
+                node.offset=new_index(node.offset);
+            out.push_back(node);
+            out_quality.push_back(built_quality[j]);
+            j++;
+        }
+        nodes=std::move(out);
+        built_quality=std::move(out_quality);
+    }
+    // appends the build tree to out in depth first order, primitive offsets
+    // counted from prim_base
+    static uint32_t flatten(const bvh_build_node_t &build_node,std::vector<linear_bvh_node_t> &out,uint32_t prim_base)
+    {
+        auto index=uint32_t(out.size());
+        out.emplace_back();
+        out[index].box=build_node.box;
+        out[index].axis=uint8_t(build_node.axis);
+        if(build_node.is_leaf())
+        {
+            out[index].offset=prim_base+uint32_t(build_node.first);
+            out[index].count=uint16_t(build_node.count);
+        }
+        else
+        {
+            out[index].count=0;
+            flatten(*build_node.left,out,prim_base);
+            out[index].offset=flatten(*build_node.right,out,prim_base);
+        }
+        return index;
+    }
+};
+
+#endif
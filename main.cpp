@@ -12,32 +12,84 @@
 #include<box.h>
 #include<plane.h>
 #include<constant_medium.h>
+#include<bvh.h>
+#include<linear_bvh.h>
+#include<wide_bvh.h>
+#include<sphere_batch.h>
+#include<motion_bvh.h>
+#include<typed_bvh.h>
+#include<mesh_loader.h>
+#include<scene_cache.h>
+#include<instance.h>
+#include<wavefront.h>
+#include<scheduler.h>
+#include<scene.h>
+#include<ray_colour.h>
+#include<adaptive.h>
+#include<progressive.h>
+#include<image_output.h>
+#include<csignal>
+#include<string>
+#include<chrono>
+#include<tuple>
+#ifdef _WIN32
+#include<io.h>
+#include<fcntl.h>
+#endif
 
 using namespace std;
 
 
-colour_t ray_colour(const ray_t &r,const hittable_list_t &world,const colour_t &background={0,0,0},int depth=50)
+colour_t ray_colour(const ray_t &r,const hittable_list_t &world,const compiled_materials_t &materials,const colour_t &background={0,0,0},int depth=50);
+
+// shades a hit that was already found, the rest of the path is traced by ray_colour
+colour_t shade_hit(const ray_t &r,bool is_hit,const hit_record_t &rec,const hittable_list_t &world,const compiled_materials_t &materials,const colour_t &background={0,0,0},int depth=50)
 {
-    if(depth<=0)
-        return {0,0,0};
-    auto [is_hit,rec]=world.hit(r, 0.001, infinity);
     if(is_hit==false)
         return background;
 
-    auto [is_reflect, attenuation, scattered] = rec.mat_ptr->scatter(r, rec);
-    auto emitted=rec.mat_ptr->emitted(rec.u,rec.v,rec.p);
+    auto [is_reflect, attenuation, scattered] = materials.scatter(r, rec);
+    auto emitted=materials.emitted(rec);
     if (is_reflect)
-        return emitted + attenuation * ray_colour(scattered, world, background, depth - 1);
+        return emitted + attenuation * ray_colour(scattered, world, materials, background, depth - 1);
     else
         return emitted;
 }
 
-hittable_list_t rand_world()
+colour_t ray_colour(const ray_t &r,const hittable_list_t &world,const compiled_materials_t &materials,const colour_t &background,int depth)
+{
+    if(depth<=0)
+        return {0,0,0};
+    auto [is_hit,rec]=world.hit(r, ray_t_min, infinity);
+    return shade_hit(r,is_hit,rec,world,materials,background,depth);
+}
+
+// With is_moving the diffuse balls bounce and drift during the shutter.  With
+// noise_cell>0 the ground's noise near the camera is read from a cached
+// volume of cells that wide.
+hittable_list_t rand_world(scene_builder_t &builder,bool is_moving=false,double noise_cell=0,int thread_num=1)
 {
     hittable_list_t world;
-    auto material5 = make_shared<lambertian_t>(make_shared<noise_texture_t>(4));
-    auto ground_material = make_shared<lambertian_t>(make_shared<checker_texture_t>(colour_t(0.2, 0.3, 0.6), colour_t(0.9, 0.9, 0.9)));
-    world.add(make_shared<sphere_t>(point3_t(0, -1000, 0), 1000, material5));
+    auto noise=builder.make<noise_texture_t>(4);
+    if(noise_cell>0)
+    {
+        auto t0=chrono::steady_clock::now();
+        if(noise->cache(aabb_t(point3_t(-20,-0.25,-20),point3_t(20,0.01,20)),noise_cell,thread_num))
+        {
+            auto &volume=*noise->volume;
+            fprintf(stderr,"noise cache: %dx%dx%d samples, %.1f MB, %.2f s, max error %.4f\n",volume.n[0],volume.n[1],volume.n[2],
+                volume.bytes()/1048576.0,chrono::duration<double>(chrono::steady_clock::now()-t0).count(),volume.max_error);
+        }
+    }
+    auto material5 = builder.make<lambertian_t>(noise);
+    auto ground_material = builder.make<lambertian_t>(builder.make<checker_texture_t>(builder.solid(colour_t(0.2, 0.3, 0.6)), builder.solid(colour_t(0.9, 0.9, 0.9))));
+    world.add(builder.make<sphere_t>(point3_t(0, -1000, 0), 1000, material5));
+    auto add_diffuse=[&](const point3_t &center,shared_ptr<material_t> mat){
+        if(is_moving)
+            world.add(builder.make<moving_sphere_t>(center,center+vec3_t(rand_double(-1,1),rand_double(0,0.5),rand_double(-1,1)),0,1,0.2,mat));
+        else
+            world.add(builder.make<sphere_t>(center,0.2,mat));
+    };
 
     for (int a = -11; a < 11; a+=2)
     {
@@ -55,15 +107,15 @@ hittable_list_t rand_world()
                     if(choose_mat<0.3)
                     {
                         auto albedo = colour_t::random() * colour_t::random();
-                        auto tex=make_shared<checker_texture_t>(albedo,colour_t(1,1,1)-albedo);
-                        sphere_material=make_shared<lambertian_t>(tex);
-                        world.add(make_shared<sphere_t>(center, 0.2, sphere_material));
+                        auto tex=builder.make<checker_texture_t>(builder.solid(albedo),builder.solid(colour_t(1,1,1)-albedo));
+                        sphere_material=builder.make<lambertian_t>(tex);
+                        add_diffuse(center, sphere_material);
                     }
                     else 
                     {
                         auto albedo = colour_t::random() * colour_t::random();
-                        sphere_material = make_shared<lambertian_t>(albedo);
-                        world.add(make_shared<sphere_t>(center, 0.2, sphere_material));
+                        sphere_material = builder.make<lambertian_t>(builder.solid(albedo));
+                        add_diffuse(center, sphere_material);
                     }
                     
                 }
@@ -72,63 +124,63 @@ hittable_list_t rand_world()
                     // metal
                     auto albedo = colour_t::random(0.5, 1);
                     auto fuzz = rand_double(0, 0.5);
-                    sphere_material = make_shared<metal_t>(albedo, fuzz);
-                    world.add(make_shared<sphere_t>(center, 0.2, sphere_material));
+                    sphere_material = builder.make<metal_t>(albedo, fuzz);
+                    world.add(builder.make<sphere_t>(center, 0.2, sphere_material));
                 }
                 else
                 {
                     // glass
-                    sphere_material = make_shared<dielectric_t>(1.5);
-                    world.add(make_shared<sphere_t>(center, 0.2, sphere_material));
+                    sphere_material = builder.make<dielectric_t>(1.5);
+                    world.add(builder.make<sphere_t>(center, 0.2, sphere_material));
                 }
             }
         }
     }
 
-    auto material1 = make_shared<dielectric_t>(1.5);
-    world.add(make_shared<sphere_t>(point3_t(0, 1, 0), 1.0, material1));
-    world.add(make_shared<sphere_t>(point3_t(0, 1, 0), -0.9, material1));
+    auto material1 = builder.make<dielectric_t>(1.5);
+    world.add(builder.make<sphere_t>(point3_t(0, 1, 0), 1.0, material1));
+    world.add(builder.make<sphere_t>(point3_t(0, 1, 0), -0.9, material1));
 
-    auto material2 = make_shared<diffuse_light_t>(colour_t(2, 2, 2));
-    world.add(make_shared<sphere_t>(point3_t(-4, 1, 0), 1.0, material2));
+    auto material2 = builder.make<diffuse_light_t>(builder.solid(colour_t(2, 2, 2)));
+    world.add(builder.make<sphere_t>(point3_t(-4, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal_t>(colour_t(1, 1, 1));
-    world.add(make_shared<sphere_t>(point3_t(4, 1, 0), 1.0, material3));
+    auto material3 = builder.make<metal_t>(colour_t(1, 1, 1));
+    world.add(builder.make<sphere_t>(point3_t(4, 1, 0), 1.0, material3));
 
-    auto material4 = make_shared<dielectric_t>(1.5,colour_t{1,1,1},0.01);
-    world.add(make_shared<moving_sphere_t>(point3_t(0, 1, 2.5),point3_t(0, 1, 2),0,1, 1.0, material4));
+    auto material4 = builder.make<dielectric_t>(1.5,colour_t{1,1,1},0.01);
+    world.add(builder.make<moving_sphere_t>(point3_t(0, 1, 2.5),point3_t(0, 1, 2),0,1, 1.0, material4));
 
     //auto material5 = make_shared<lambertian_t>(make_shared<noise_texture_t>());
     //world.add(make_shared<sphere_t>(point3_t(0, 1, 2.5)-vec3_t(8,1,5).unit()*2, 1.0, material5));
 
-    world.add(make_shared<rect_t>(vec3_t(0,0,-1),point3_t(0,0,0),point3_t(2,1,1),material2));
+    world.add(builder.make<rect_t>(vec3_t(0,0,-1),point3_t(0,0,0),point3_t(2,1,1),material2));
 
     return world;
 }
 
-hittable_list_t cornell_box() 
+hittable_list_t cornell_box(scene_builder_t &builder)
 {
     hittable_list_t objects;
 
-    auto red   = make_shared<lambertian_t>(colour_t(.65, .05, .05));
-    auto white = make_shared<lambertian_t>(colour_t(.73, .73, .73));
-    auto green = make_shared<lambertian_t>(colour_t(.12, .45, .15));
-    auto light = make_shared<diffuse_light_t>(colour_t(15, 15, 15));
-    auto light1 = make_shared<diffuse_light_t>(colour_t(1, 1, 1));
-
-    objects.add(make_shared<rect_t>(vec3_t(1,0,0), point3_t(0,0,-100),point3_t(0,100,0), green)); //left
-    objects.add(make_shared<rect_t>(vec3_t(-1,0,0),point3_t(100,0,-100),point3_t(100,100,0), red)); //right
-    objects.add(make_shared<rect_t>(vec3_t(0,-1,0),point3_t(20,100-0.0001,-65),point3_t(80,100-0.0001,-35), light));
-    objects.add(make_shared<rect_t>(vec3_t(0,0,1),point3_t(0,0,-100),point3_t(100,100,-100), white)); //back
-    objects.add(make_shared<rect_t>(vec3_t(0,-1,0),point3_t(0,100,-100),point3_t(100,100,0), white)); //up
-    objects.add(make_shared<rect_t>(vec3_t(0,1,0),point3_t(0,0,-100),point3_t(100,0,0), white)); //down
-
-    auto box1=make_shared<xbox_t>(point3_t(20,40,-60),30,50,30,green);
-    auto box2=make_shared<xbox_t>(point3_t(60,70,-50),50,80,50,green);
+    auto red   = builder.make<lambertian_t>(builder.solid(colour_t(.65, .05, .05)));
+    auto white = builder.make<lambertian_t>(builder.solid(colour_t(.73, .73, .73)));
+    auto green = builder.make<lambertian_t>(builder.solid(colour_t(.12, .45, .15)));
+    auto light = builder.make<diffuse_light_t>(builder.solid(colour_t(15, 15, 15)));
+    auto light1 = builder.make<diffuse_light_t>(builder.solid(colour_t(1, 1, 1)));
+
+    objects.add(builder.make<rect_t>(vec3_t(1,0,0), point3_t(0,0,-100),point3_t(0,100,0), green)); //left
+    objects.add(builder.make<rect_t>(vec3_t(-1,0,0),point3_t(100,0,-100),point3_t(100,100,0), red)); //right
+    objects.add(builder.make<rect_t>(vec3_t(0,-1,0),point3_t(20,100-0.0001,-65),point3_t(80,100-0.0001,-35), light));
+    objects.add(builder.make<rect_t>(vec3_t(0,0,1),point3_t(0,0,-100),point3_t(100,100,-100), white)); //back
+    objects.add(builder.make<rect_t>(vec3_t(0,-1,0),point3_t(0,100,-100),point3_t(100,100,0), white)); //up
+    objects.add(builder.make<rect_t>(vec3_t(0,1,0),point3_t(0,0,-100),point3_t(100,0,0), white)); //down
+
+    auto box1=builder.make<xbox_t>(point3_t(20,40,-60),30,50,30,green);
+    auto box2=builder.make<xbox_t>(point3_t(60,70,-50),50,80,50,green);
     box1->rotate_y(10);
     box2->rotate_y(-10);
-    objects.add(make_shared<constant_medium_t>(box1, 0.02, colour_t(0,0,0)));
-    objects.add(make_shared<constant_medium_t>(box2, 0.02, colour_t(1,1,1)));
+    objects.add(builder.make<constant_medium_t>(box1, 0.02, builder.make<isotropic_t>(builder.solid(colour_t(0,0,0)))));
+    objects.add(builder.make<constant_medium_t>(box2, 0.02, builder.make<isotropic_t>(builder.solid(colour_t(1,1,1)))));
     // auto glass=make_shared<dielectric_t>(1.5,colour_t{1,1,1},0);
     // auto box=make_shared<box_t>(point3_t(20,0,-20),point3_t(80,60,-80),glass);
     
@@ -146,35 +198,366 @@ hittable_list_t cornell_box()
     return objects;
 }
 
-void image_render(int image_height,int image_width,int image_height_begin,int image_height_end,const camera_t &camera,const hittable_list_t &world,vector<colour_t> &out)
+// The object the instances scene repeats: a pedestal and a ball under a
+// bottom level BVH of their own.
+shared_ptr<hittable_t> pawn(scene_builder_t &builder,const bvh_build_options_t &options)
+{
+    hittable_list_t parts;
+    parts.add(builder.box(point3_t(-0.3,0,-0.3),point3_t(0.3,0.4,0.3),builder.make<lambertian_t>(builder.solid(colour_t(.7,.3,.2)))));
+    parts.add(builder.make<sphere_t>(point3_t(0,0.6,0),0.2,builder.make<metal_t>(colour_t(.9,.9,.9),0.1)));
+    return builder.make<linear_bvh_t>(parts,0,1,options);
+}
+
+// grid*grid copies of one object, each turned, scaled and placed at random.
+// The object is stored once however many copies there are.
+hittable_list_t instanced_world(scene_builder_t &builder,shared_ptr<const hittable_t> object,int grid)
 {
-    for(int i=image_height_begin-1;i>=image_height_end;i--)
-    {   
+    hittable_list_t world;
+    auto ground=builder.make<lambertian_t>(builder.make<checker_texture_t>(builder.solid(colour_t(0.2,0.3,0.1)),builder.solid(colour_t(0.9,0.9,0.9))));
+    world.add(builder.make<sphere_t>(point3_t(0,-1000,0),1000,ground));
+    world.add(builder.make<sphere_t>(point3_t(0,30,10),8,builder.make<diffuse_light_t>(builder.solid(colour_t(6,6,6)))));
+    for(int a=0;a<grid;a++)
+    {
+        for(int b=0;b<grid;b++)
+        {
+            auto x=a-grid*0.5+rand_double(0.2,0.8);
+            auto z=b-grid*0.5+rand_double(0.2,0.8);
+            auto place=affine_t::translate(vec3_t(x,0,z))*affine_t::rotate_y(rand_double(0,360))*affine_t::scale(rand_double(0.6,1.2));
+            world.add(builder.make<instance_t>(object,place));
+        }
+    }
+    return world;
+}
+
+// accel is one of list, bvh2 (bvh_node_t), linear, bvh4, bvh8, typed4,
+// typed8 (typed_bvh_t, primitives in per kind arrays).  With
+// is_sphere_batch the static spheres go into one sphere_batch_t first.  The
+// objects moving during the shutter go into a motion_bvh8_t with
+// motion_segments time segments, 0 picks the count, or with a negative count
+// their swept boxes go into the accel with the rest.
+hittable_list_t build_world(const hittable_list_t &world_in,const string &accel,const bvh_build_options_t &options,bool is_sphere_batch=false,int motion_segments=0)
+{
+    if(accel=="list")
+        return world_in;
+    auto world=is_sphere_batch?batch_spheres(world_in,8,options):world_in;
+    if(motion_segments>=0)
+        world=split_moving(world,0,1,options,motion_segments);
+    if(accel=="bvh2")
+        return make_bvh_world<bvh_node_t>(world,0,1,options);
+    if(accel=="linear")
+        return make_bvh_world<linear_bvh_t>(world,0,1,options);
+    if(accel=="bvh4")
+        return make_bvh_world<bvh4_t>(world,0,1,options);
+    if(accel=="typed4")
+        return make_bvh_world<typed_bvh4_t>(world,0,1,options);
+    if(accel=="typed8")
+        return make_bvh_world<typed_bvh8_t>(world,0,1,options);
+    if(accel!="bvh8")
+        fprintf(stderr,"unknown accel %s, using bvh8\n",accel.c_str());
+    return make_bvh_world<bvh8_t>(world,0,1,options);
+}
+
+// Times every acceleration structure on the same rays: one primary ray per
+// pixel plus a diffuse bounce from each primary hit.
+void compare_accel(const hittable_list_t &world,const camera_t &camera,int image_width,int image_height,const bvh_build_options_t &options)
+{
+    auto reference=build_world(world,"linear",options,false,-1);
+    vector<ray_t> rays;
+    for(int i=0;i<image_height;i++)
+    {
         for(int j=0;j<image_width;j++)
         {
-            constexpr int samples=100;
-            colour_t pixel_colour(0, 0, 0);
-            for(int k=0;k<samples;k++)
+            auto r=camera.get_ray(double(j)/image_width,double(i)/image_height);
+            rays.push_back(r);
+            auto [is_hit,rec]=reference.hit(r,ray_t_min,infinity);
+            if(is_hit)
+                rays.push_back(rec.spawn(random_in_hemisphere(rec.normal),r.time()));
+        }
+    }
+    // moving objects in swept boxes, then in motion BVHs of 1, 4 and a picked number of segments
+    const tuple<const char*,bool,int> variants[]={{"bvh2",false,-1},{"linear",false,-1},{"bvh4",false,-1},{"bvh8",false,-1},{"typed4",false,-1},{"typed8",false,-1},{"linear",true,-1},{"bvh8",true,-1},{"bvh8",true,1},{"bvh8",true,4},{"bvh8",true,0},{"typed8",false,0}};
+    for(auto [accel,is_sphere_batch,motion_segments]:variants)
+    {
+        auto t0=chrono::steady_clock::now();
+        auto scene=build_world(world,accel,options,is_sphere_batch,motion_segments);
+        auto t1=chrono::steady_clock::now();
+        size_t hits=0;
+        for(auto &r:rays)
+            hits+=scene.hit(r,ray_t_min,infinity).first;
+        auto t2=chrono::steady_clock::now();
+        auto build_ms=chrono::duration<double,milli>(t1-t0).count();
+        auto trace_s=chrono::duration<double>(t2-t1).count();
+        auto motion=motion_segments<0?string():motion_segments==0?string("+m"):"+m"+to_string(motion_segments);
+        fprintf(stderr,"%-6s %-3s %-4s build %8.2f ms  %8.3f Mrays/s  (%zu rays, %zu hits)\n",accel,is_sphere_batch?"+sb":"",motion.c_str(),build_ms,rays.size()/trace_s*1e-6,rays.size(),hits);
+    }
+}
+
+// Drifts every small sphere, rect_t, box_t and instance of the scene along its own line
+// and times the per frame setup of the BVH: a fresh build against update()
+// in place.  Frame f covers the time [f,f+1], so moving spheres go on moving.
+// Both trees must find the same hits on one primary ray per pixel, but in
+// media, which scatter at random.
+template<class bvh_type>
+void animate_accel(const hittable_list_t &world,const camera_t &camera,int image_width,int image_height,int frames,const bvh_build_options_t &options)
+{
+    hittable_list_t bounded;
+    for(auto &object:world.objects)
+        if(object->bounding_box(0,1).first)
+            bounded.add(object);
+    if(bounded.objects.empty())
+        return;
+    hittable_list_t moving;
+    for(auto &object:bounded.objects)
+    {
+        auto sphere=dynamic_pointer_cast<sphere_t>(object);
+        if((sphere && fabs(sphere->radius)<2) || dynamic_pointer_cast<rect_t>(object) || dynamic_pointer_cast<box_t>(object) || dynamic_pointer_cast<instance_t>(object))
+            moving.add(object);
+    }
+    // a few thousandths of the space they move in per frame
+    vector<pair<shared_ptr<hittable_t>,vec3_t>> movers;
+    if(moving.objects.size())
+    {
+        auto extent=moving.bounding_box(0,1).second;
+        auto speed=(extent.max()-extent.min()).len()*0.002;
+        for(auto &object:moving.objects)
+            movers.push_back({object,vec3_t(rand_double(-1,1),0,rand_double(-1,1))*speed});
+    }
+    auto move=[](hittable_t *object,const vec3_t &v){
+        if(auto sphere=dynamic_cast<sphere_t*>(object))
+            sphere->center+=v;
+        else if(auto rect=dynamic_cast<rect_t*>(object))
+            rect->move(v);
+        else if(auto box=dynamic_cast<box_t*>(object))
+            box->move(v);
+        else if(auto instance=dynamic_cast<instance_t*>(object))
+            instance->move(v);
+    };
+    fprintf(stderr,"%zu primitives, %zu moving\n",bounded.objects.size(),movers.size());
+
+    bvh_type updated(bounded,0,1,options);
+    for(int f=1;f<frames;f++)
+    {
+        for(auto &[object,v]:movers)
+            move(object.get(),v);
+        double time0=f,time1=f+1;
+        auto t0=chrono::steady_clock::now();
+        auto action=updated.update(time0,time1);
+        auto t1=chrono::steady_clock::now();
+        bvh_type fresh(bounded,time0,time1,options);
+        auto t2=chrono::steady_clock::now();
+        vector<real_t> ts[2];
+        double trace_s[2];
+        const bvh_type *trees[2]={&updated,&fresh};
+        for(int k=0;k<2;k++)
+        {
+            auto t3=chrono::steady_clock::now();
+            for(int i=0;i<image_height;i++)
+            {
+                for(int j=0;j<image_width;j++)
+                {
+                    auto r=camera.get_ray(double(j)/image_width,double(i)/image_height);
+                    auto [is_hit,rec]=trees[k]->hit(ray_t(r.origin(),r.direction(),time0+0.5),ray_t_min,infinity);
+                    ts[k].push_back(is_hit?rec.t:-1);
+                }
+            }
+            trace_s[k]=chrono::duration<double>(chrono::steady_clock::now()-t3).count();
+        }
+        size_t differ=0;
+        for(size_t i=0;i<ts[0].size();i++)
+            differ+=ts[0][i]!=ts[1][i];
+        auto rays=double(image_width)*image_height*1e-6;
+        fprintf(stderr,"frame %3d  update %-7s %8.2f ms  quality %.2f  build %8.2f ms  %7.3f / %7.3f Mrays/s  %zu hits differ\n",
+            f,to_string(action),chrono::duration<double,milli>(t1-t0).count(),updated.quality(),chrono::duration<double,milli>(t2-t1).count(),
+            rays/trace_s[0],rays/trace_s[1],differ);
+    }
+}
+
+// Traces the primary rays of packet_size neighbouring pixels of a row together,
+// secondary rays go one by one through ray_colour, or through nee if given.
+void image_render_packet(int image_height,int image_width,int y,int x,int packet_size,int first_sample,int samples,const camera_t &camera,const hittable_list_t &world,const compiled_materials_t &materials,const ray_colour_nee_t *nee,vector<colour_t> &framebuffer)
+{
+    int i=image_height-1-y;
+    ray_packet_t packet;
+    packet.size=packet_size;
+    uint32_t mask=(uint32_t(1)<<packet.size)-1;
+    colour_t pixel_colour[ray_packet_t::max_size]={};
+    for(int k=first_sample;k<first_sample+samples;k++)
+    {
+        for(int l=0;l<packet.size;l++)
+        {
+            seed_sample(size_t(y)*image_width+x+l,k);
+            auto v = (i+rand_double(-1,1)) / image_height;
+            auto u = (x+l+rand_double(-1,1)) / image_width;
+            packet.set(l,camera.get_ray(u,v),infinity);
+        }
+        world.hit_packet(packet,mask,ray_t_min);
+        for(int l=0;l<packet.size;l++)
+        {
+            // media inside the packet traversal drew from the last lane's stream
+            seed_sample(size_t(y)*image_width+x+l,k,1);
+            if(nee)
+                pixel_colour[l] += nee->shade(packet.ray(l),packet.is_hit[l],packet.rec[l]);
+            else
+                pixel_colour[l] += shade_hit(packet.ray(l),packet.is_hit[l],packet.rec[l],world,materials);
+        }
+    }
+    for(int l=0;l<packet.size;l++)
+        framebuffer[size_t(y)*image_width+x+l]=pixel_colour[l]*(1.0/samples);
+}
+
+// Averages samples [first_sample,first_sample+samples) of every pixel.
+// packet_size 0 traces every camera ray on its own, 4/8/16 uses ray packets;
+// nee selects light sampling instead of ray_colour when not null, adaptive
+// replaces the fixed sample count of the single ray path
+void image_render(int image_height,int image_width,const tile_t &tile,int first_sample,int samples,const camera_t &camera,const hittable_list_t &world,const compiled_materials_t &materials,int packet_size,const ray_colour_nee_t *nee,adaptive_sampler_t *adaptive,vector<colour_t> &framebuffer)
+{
+    auto sample=[&](int j,int y,int k){
+        seed_sample(size_t(y)*image_width+j,k);
+        auto v = (image_height-1-y+rand_double(-1,1)) / image_height;
+        auto u = (j+rand_double(-1,1)) / image_width;
+        auto r=camera.get_ray(u,v);
+        return nee?(*nee)(r):ray_colour(r, world, materials);
+    };
+    if(adaptive)
+    {
+        adaptive->render(image_width,tile,sample,framebuffer);
+        return;
+    }
+    for(int y=tile.y0;y<tile.y1;y++)
+    {
+        for(int j=tile.x0;j<tile.x1;j++)
+        {
+            if(packet_size>0)
             {
-                auto v = (i+rand_double(-1,1)) / image_height;
-                auto u = (j+rand_double(-1,1)) / image_width;
-                auto r=camera.get_ray(u,v);
-                pixel_colour += ray_colour(r, world);
+                auto n=min(packet_size,tile.x1-j);
+                image_render_packet(image_height,image_width,y,j,n,first_sample,samples,camera,world,materials,nee,framebuffer);
+                j+=n-1;
+                continue;
             }
+            colour_t pixel_colour(0, 0, 0);
+            for(int k=first_sample;k<first_sample+samples;k++)
+                pixel_colour += sample(j,y,k);
             pixel_colour*=1.0/samples;
-            out.push_back(pixel_colour);
+            framebuffer[size_t(y)*image_width+j]=pixel_colour;
         }
     }
 }
 
+// set by SIGINT/SIGTERM, a progressive render checkpoints and stops after the current pass
+volatile sig_atomic_t stop_requested=0;
+
 int main(int argc, const char *argv[])
 {
+    string accel="bvh8";
+    bool is_sphere_batch=true;
+    string scene_name="cornell";
+    string mesh_path;
+    string scene_cache;
+    bool is_compare_accel=false;
+    int motion_segments=0;
+    double noise_cell=0;
+    int animate_frames=0;
+    int packet_size=0;
+    string integrator="recursive";
+    int thread_num=int(thread::hardware_concurrency());
+    int tile_size=32;
+    double adaptive_threshold=0;
+    int min_spp=16;
+    int max_spp=1024;
+    string spp_map;
+    int spp=100;
+    int pass_spp=0;
+    string checkpoint;
+    string resume;
+    vector<string> merge;
+    double checkpoint_every=60;
+    string output;
+    string format;
+    for(int i=1;i<argc;i++)
+    {
+        string arg=argv[i];
+        if(arg=="--accel" && i+1<argc)
+            accel=argv[++i];
+        else if(arg=="--sphere-batch" && i+1<argc)
+            is_sphere_batch=atoi(argv[++i])!=0;
+        else if(arg=="--scene" && i+1<argc)
+            scene_name=argv[++i];
+        else if(arg=="--mesh" && i+1<argc)
+            mesh_path=argv[++i];
+        else if(arg=="--scene-cache" && i+1<argc)
+            scene_cache=argv[++i];
+        else if(arg=="--motion-segments" && i+1<argc)
+            motion_segments=atoi(argv[++i]);
+        else if(arg=="--noise-cache" && i+1<argc)
+        {
+            char *end;
+            noise_cell=strtod(argv[++i],&end);
+            if(end==argv[i] || *end || !(noise_cell>0 && std::isfinite(noise_cell)))
+            {
+                fprintf(stderr,"error! --noise-cache takes a cell size above 0, not %s\n",argv[i]);
+                return 1;
+            }
+        }
+        else if(arg=="--compare-accel")
+            is_compare_accel=true;
+        else if(arg=="--animate" && i+1<argc)
+            animate_frames=atoi(argv[++i]);
+        else if(arg=="--packet" && i+1<argc)
+            packet_size=clamp(atoi(argv[++i]),0,ray_packet_t::max_size);
+        else if(arg=="--integrator" && i+1<argc)
+            integrator=argv[++i];
+        else if(arg=="--threads" && i+1<argc)
+        {
+            char *end;
+            auto n=strtol(argv[++i],&end,10);
+            if(end==argv[i] || *end)
+            {
+                fprintf(stderr,"error! --threads takes a number, not %s\n",argv[i]);
+                return 1;
+            }
+            thread_num=int(clamp(n,1l,4096l));
+        }
+        else if(arg=="--tile" && i+1<argc)
+            tile_size=atoi(argv[++i]);
+        else if(arg=="--adaptive" && i+1<argc)
+            adaptive_threshold=atof(argv[++i]);
+        else if(arg=="--min-spp" && i+1<argc)
+            min_spp=atoi(argv[++i]);
+        else if(arg=="--max-spp" && i+1<argc)
+            max_spp=atoi(argv[++i]);
+        else if(arg=="--spp-map" && i+1<argc)
+            spp_map=argv[++i];
+        else if(arg=="--spp" && i+1<argc)
+            spp=max(atoi(argv[++i]),1);
+        else if(arg=="--seed" && i+1<argc)
+            render_seed=strtoull(argv[++i],nullptr,10);
+        else if(arg=="--progressive" && i+1<argc)
+            pass_spp=max(atoi(argv[++i]),0);
+        else if(arg=="--checkpoint" && i+1<argc)
+            checkpoint=argv[++i];
+        else if(arg=="--checkpoint-every" && i+1<argc)
+            checkpoint_every=atof(argv[++i]);
+        else if(arg=="--resume" && i+1<argc)
+            resume=argv[++i];
+        else if(arg=="--merge" && i+1<argc)
+            merge.push_back(argv[++i]);
+        else if(arg=="--output" && i+1<argc)
+            output=argv[++i];
+        else if(arg=="--format" && i+1<argc)
+            format=argv[++i];
+        else
+            fprintf(stderr,"usage: %s [--scene cornell|random|motion|instances] [--mesh file.ply|obj [--scene-cache dir]] [--accel list|bvh2|linear|bvh4|bvh8|typed4|typed8] [--sphere-batch 0|1] [--motion-segments n] [--noise-cache cell] [--compare-accel] [--animate frames] [--packet 0|4|8|16] [--integrator recursive|wavefront|nee] [--threads n] [--tile size] [--adaptive threshold [--min-spp n] [--max-spp n] [--spp-map file.pgm]]"
+                " [--output file.ppm|pfm|png|qoi] [--format p3|p6|pfm|png|qoi] [--spp n] [--seed n] [--progressive pass_spp [--checkpoint file] [--checkpoint-every s] [--resume file]] [--merge file]...\n",argv[0]);
+    }
+
+    // hardware_concurrency() is 0 when it cannot tell
+    thread_num=max(thread_num,1);
+
     //srand(time(NULL));
     //image
     const auto aspect_ratio = 9.0 / 9.0;
     const int image_width = 512;
     const int image_height = static_cast<int>(image_width / aspect_ratio);
-    printf("P3 %d %d 255\n",image_width,image_height);
 
     //camera 
     // auto lookfrom=point3_t{8,2,5};
@@ -182,6 +565,16 @@ int main(int argc, const char *argv[])
     auto lookfrom=point3_t{50,50,150};//-vec3_t(1000,1000,1000);
     auto lookat=point3_t{50,50,-10};//-vec3_t(1000,1000,1000);
     //lookfrom=lookfrom+(lookfrom-lookat).unit()*2;
+    if(scene_name=="random" || scene_name=="motion")
+    {
+        lookfrom=point3_t{8,2,5};
+        lookat=point3_t{0,1,0};
+    }
+    else if(scene_name=="instances")
+    {
+        lookfrom=point3_t{0,9,40};
+        lookat=point3_t{0,0,0};
+    }
     camera_t camera(lookfrom,lookat,{0,1,0},37,aspect_ratio,0,0,0,1);
 
 
@@ -193,6 +586,7 @@ int main(int argc, const char *argv[])
     auto dielectric1 = make_shared<dielectric_t>(1.5);
     auto dielectric2 = make_shared<dielectric_t>(1);
 
+    scene_builder_t builder;
     hittable_list_t world;
     // world.add(make_shared<sphere_t>(point3_t(0,0,-1), 0.5,dielectric1));
     // world.add(make_shared<sphere_t>(point3_t(0,-1000.5,-1), 1000,lambertian2));
@@ -201,27 +595,232 @@ int main(int argc, const char *argv[])
     // world.add(make_shared<sphere_t>(point3_t(1,0,-1),0.5,metal3));
     // world.add(make_shared<sphere_t>(point3_t(0,0,-20000),9900,metal2));
     
-    //world=rand_world();
-    world=cornell_box();
+    bvh_build_options_t bvh_options;
+    bvh_options.thread_num=thread_num;
+    // placed standing on the floor in the middle of the scene, or repeated
+    // all over the instances scene
+    shared_ptr<hittable_t> mesh_object;
+    if(mesh_path.size())
+    {
+        auto t0=chrono::steady_clock::now();
+        aabb_t fit(point3_t(25,0,-75),point3_t(75,60,-25));
+        if(scene_name=="random" || scene_name=="motion")
+            fit=aabb_t(point3_t(-1,0,-1),point3_t(1,2,1));
+        else if(scene_name=="instances")
+            fit=aabb_t(point3_t(-0.4,0,-0.4),point3_t(0.4,0.8,0.4));
+        colour_t albedo(.73,.73,.73);
+        // with --scene-cache the fitted mesh and its BVH are kept in a file
+        // named by the hash of the source and the build options, and mapped
+        // in place by later runs.  Only the mesh: the rest of the scene
+        // builds in well under a millisecond
+        string cache_path;
+        uint64_t cache_key=0;
+        if(scene_cache.size())
+        {
+            mapped_file_t source(mesh_path);
+            if(source.is_open()==false)
+            {
+                fprintf(stderr,"error! cannot read %s\n",mesh_path.c_str());
+                return 1;
+            }
+            cache_key=mesh_cache_key(source,fit,albedo,bvh_options);
+            cache_path=mesh_cache_path(scene_cache,cache_key);
+            if(auto cached=load_mesh_cache(cache_path,cache_key,builder))
+            {
+                fprintf(stderr,"mesh %s: %zu triangles, mapped from %s in %.2f ms\n",mesh_path.c_str(),cached->triangle_count(),cache_path.c_str(),
+                    chrono::duration<double,milli>(chrono::steady_clock::now()-t0).count());
+                mesh_object=cached;
+                cache_path.clear();
+            }
+        }
+        if(mesh_object==nullptr)
+        {
+            mesh_data_t mesh;
+            if(load_mesh(mesh_path,mesh)==false)
+                return 1;
+            auto t1=chrono::steady_clock::now();
+            mesh.fit(fit);
+            auto triangles=mesh.triangle_count();
+            auto built=builder.make<triangle_mesh_t>(std::move(mesh),builder.make<lambertian_t>(builder.solid(albedo)),bvh_options);
+            auto t2=chrono::steady_clock::now();
+            fprintf(stderr,"mesh %s: %zu triangles, load %.2f s, bvh %.2f s\n",mesh_path.c_str(),triangles,
+                chrono::duration<double>(t1-t0).count(),chrono::duration<double>(t2-t1).count());
+            if(cache_path.size() && save_mesh_cache(cache_path,cache_key,*built,albedo))
+                fprintf(stderr,"mesh cached in %s\n",cache_path.c_str());
+            mesh_object=built;
+        }
+    }
+    auto build_start=chrono::steady_clock::now();
+    if(scene_name=="random" || scene_name=="motion")
+        world=rand_world(builder,scene_name=="motion",noise_cell,thread_num);
+    else if(scene_name=="instances")
+    {
+        const int grid=64;
+        world=instanced_world(builder,mesh_object?mesh_object:pawn(builder,bvh_options),grid);
+        fprintf(stderr,"instances: %d copies of one %s\n",grid*grid,mesh_object?"mesh":"pawn");
+    }
+    else
+    {
+        if(scene_name!="cornell")
+            fprintf(stderr,"unknown scene %s, using cornell\n",scene_name.c_str());
+        world=cornell_box(builder);
+    }
+    if(mesh_object && scene_name!="instances")
+        world.add(mesh_object);
 
-    constexpr int thread_num=12;
-    constexpr auto part=image_height/thread_num;
-    vector<vector<colour_t>> output(thread_num);
-    vector<thread> thread_pool(thread_num);
-    for(int i=0;i<thread_num;i++)
+    // the image goes to --output, or to stdout as binary P6 unless --format says otherwise
+    if(format.empty())
+        format=output.size()?image_format_of(output):"p6";
+    auto writer=make_image_writer(format);
+    if(writer==nullptr)
     {
-        auto start=image_height-i*part;
-        auto end  =image_height-(i+1)*part;
-        if(i==thread_num-1) end=0;
-        thread_pool[i]=thread(image_render,image_height,image_width,start,end,cref(camera),cref(world),ref(output[i]));
+        fprintf(stderr,"error! unknown image format %s\n",format.c_str());
+        return 1;
     }
-    for(auto &t:thread_pool)
-        t.join();
+    FILE *out=stdout;
+    if(output.size() && (out=fopen(output.c_str(),"wb"))==nullptr)
+    {
+        fprintf(stderr,"error! cannot write %s\n",output.c_str());
+        return 1;
+    }
+#ifdef _WIN32
+    if(out==stdout)
+        _setmode(_fileno(stdout),_O_BINARY);
+#endif
+    auto close_output=[&](bool ok){
+        if(out!=stdout && fclose(out)!=0)
+            ok=false;
+        if(ok==false)
+            fprintf(stderr,"error! writing the image failed\n");
+        return ok?0:1;
+    };
+
+    // rows from the top of the image
+    vector<colour_t> framebuffer(size_t(image_width)*image_height);
 
-    for(auto &thread_result:output)
+    // combines checkpoints of separate runs, nothing is rendered
+    if(merge.size())
     {
-        for(auto &c:thread_result)
-            write_clour(c);
+        accum_buffer_t accum;
+        for(auto &file:merge)
+        {
+            accum_buffer_t part;
+            if(part.load(file)==false)
+            {
+                fprintf(stderr,"error! cannot read checkpoint %s\n",file.c_str());
+                return 1;
+            }
+            if(&file==&merge.front())
+                accum=move(part);
+            else if(accum.merge(part)==false)
+                return 1;
+        }
+        if(checkpoint.size() && accum.save(checkpoint)==false)
+            fprintf(stderr,"cannot write %s\n",checkpoint.c_str());
+        auto image=accum.resolve();
+        image_stream_t stream(*writer,out,image,accum.width,accum.height);
+        return close_output(stream.finish());
     }
-    return 0;
+
+    if(is_compare_accel)
+    {
+        compare_accel(world,camera,image_width,image_height,bvh_options);
+        return 0;
+    }
+    if(animate_frames>0)
+    {
+        if(accel=="linear")
+            animate_accel<linear_bvh_t>(world,camera,image_width,image_height,animate_frames,bvh_options);
+        else if(accel=="bvh4")
+            animate_accel<bvh4_t>(world,camera,image_width,image_height,animate_frames,bvh_options);
+        else
+            animate_accel<bvh8_t>(world,camera,image_width,image_height,animate_frames,bvh_options);
+        return 0;
+    }
+    auto scene=builder.freeze(build_world(world,accel,bvh_options,is_sphere_batch,motion_segments));
+    world.clear();
+    {
+        auto bytes=scene.bytes();
+        fprintf(stderr,"scene: built in %.2f ms, objects %zu B in %zu chunks, primitives %zu B, nodes %zu B, materials %zu B, textures %zu B\n",
+            chrono::duration<double,milli>(chrono::steady_clock::now()-build_start).count(),bytes.objects,scene.arena->chunk_count(),
+            bytes.primitives,bytes.nodes,bytes.materials,bytes.textures);
+    }
+
+    vector<wavefront_integrator_t> wavefront(thread_num,wavefront_integrator_t(scene.world,scene.shading,camera));
+    ray_colour_nee_t nee(scene.world,scene.lights,scene.shading);
+    // recursive and nee only, the wavefront batches keep a fixed count
+    unique_ptr<adaptive_sampler_t> adaptive;
+    if(adaptive_threshold>0 && integrator!="wavefront" && pass_spp==0)
+        adaptive=make_unique<adaptive_sampler_t>(framebuffer.size(),adaptive_threshold,min_spp,max_spp);
+    // stream, if given, is told about every finished tile
+    auto render_pass=[&](int first_sample,int samples,image_stream_t *stream){
+        tile_scheduler_t scheduler(image_width,image_height,tile_size,thread_num);
+        return scheduler.run([&](int thread,const tile_t &tile){
+            if(integrator=="wavefront")
+                wavefront[thread].render(image_height,image_width,tile,first_sample,samples,framebuffer);
+            else
+                image_render(image_height,image_width,tile,first_sample,samples,camera,scene.world,scene.shading,packet_size,integrator=="nee"?&nee:nullptr,adaptive.get(),framebuffer);
+            if(stream)
+                stream->tile_done(tile);
+        });
+    };
+    bool is_written=true;
+
+    if(pass_spp>0)
+    {
+        accum_buffer_t accum(image_width,image_height,render_seed);
+        if(resume.size())
+        {
+            if(accum.load(resume)==false || accum.width!=uint32_t(image_width) || accum.height!=uint32_t(image_height))
+            {
+                fprintf(stderr,"error! cannot resume from %s\n",resume.c_str());
+                return 1;
+            }
+            // the remaining samples must come from the same streams
+            render_seed=accum.seed;
+        }
+        signal(SIGINT,[](int){stop_requested=1;});
+        signal(SIGTERM,[](int){stop_requested=1;});
+        auto last_checkpoint=chrono::steady_clock::now();
+        while(accum.next_sample<uint64_t(spp) && stop_requested==0)
+        {
+            auto first=int(accum.next_sample);
+            auto samples=min(pass_spp,spp-first);
+            auto stats=render_pass(first,samples,nullptr);
+            accum.add(framebuffer,samples);
+            double busy=0;
+            for(auto &s:stats)
+                busy+=s.busy;
+            fprintf(stderr,"pass: samples %d..%d  busy %.3f s\n",first,first+samples-1,busy);
+            auto now=chrono::steady_clock::now();
+            bool is_last=accum.next_sample>=uint64_t(spp) || stop_requested;
+            if(checkpoint.size() && (is_last || chrono::duration<double>(now-last_checkpoint).count()>=checkpoint_every))
+            {
+                if(accum.save(checkpoint))
+                    fprintf(stderr,"checkpoint: %s, %llu spp\n",checkpoint.c_str(),(unsigned long long)accum.next_sample);
+                else
+                    fprintf(stderr,"cannot write %s\n",checkpoint.c_str());
+                last_checkpoint=now;
+            }
+        }
+        framebuffer=accum.resolve();
+        image_stream_t stream(*writer,out,framebuffer,image_width,image_height);
+        is_written=stream.finish();
+    }
+    else
+    {
+        // rows are encoded and written while the tiles below them render
+        image_stream_t stream(*writer,out,framebuffer,image_width,image_height);
+        auto stats=render_pass(0,spp,&stream);
+        is_written=stream.finish();
+        tile_scheduler_t::report(stats);
+    }
+    if(adaptive)
+    {
+        fprintf(stderr,"adaptive: %zu samples, %.1f spp on average\n",adaptive->total(),double(adaptive->total())/framebuffer.size());
+        if(spp_map.size() && adaptive->write_spp_map(spp_map.c_str(),image_width,image_height)==false)
+            fprintf(stderr,"cannot write %s\n",spp_map.c_str());
+    }
+
+    return close_output(is_written);
 }
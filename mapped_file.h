@@ -0,0 +1,113 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include<string>
+#include<cstdio>
+#include<cstddef>
+#ifdef _WIN32
+#include<vector>
+#else
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<fcntl.h>
+#include<unistd.h>
+#endif
+
+// A whole file mapped read-only into memory, pages are read in as the parser
+// touches them and never copied.  Windows reads the file into a buffer.
+class mapped_file_t
+{
+public:
+    // how the pages will be read: front to back once by a parser, or all of
+    // them in any order by data used in place
+    enum access_t{sequential,in_place};
+
+    mapped_file_t()=default;
+    explicit mapped_file_t(const std::string &path,access_t access=sequential)
+    {
+        open(path,access);
+    }
+    mapped_file_t(const mapped_file_t&)=delete;
+    mapped_file_t &operator=(const mapped_file_t&)=delete;
+    ~mapped_file_t()
+    {
+        close();
+    }
+
+    bool open(const std::string &path,access_t access=sequential)
+    {
+        close();
+#ifdef _WIN32
+        auto file=std::fopen(path.c_str(),"rb");
+        if(file==nullptr)
+            return false;
+        std::fseek(file,0,SEEK_END);
+        buffer.resize(size_t(std::ftell(file)));
+        std::fseek(file,0,SEEK_SET);
+        bool ok=std::fread(buffer.data(),1,buffer.size(),file)==buffer.size();
+        std::fclose(file);
+        if(ok==false)
+        {
+            buffer.clear();
+            return false;
+        }
+        addr=buffer.data();
+        length=buffer.size();
+        opened=true;
+        return true;
+#else
+        int fd=::open(path.c_str(),O_RDONLY);
+        if(fd<0)
+            return false;
+        struct stat st;
+        if(fstat(fd,&st)!=0)
+        {
+            ::close(fd);
+            return false;
+        }
+        length=size_t(st.st_size);
+        if(length)
+        {
+            auto p=mmap(nullptr,length,PROT_READ,MAP_PRIVATE,fd,0);
+            if(p==MAP_FAILED)
+            {
+                ::close(fd);
+                length=0;
+                return false;
+            }
+            madvise(p,length,access==sequential?MADV_SEQUENTIAL:MADV_WILLNEED);
+            addr=static_cast<const char*>(p);
+        }
+        ::close(fd);
+        opened=true;
+        return true;
+#endif
+    }
+    void close()
+    {
+#ifdef _WIN32
+        buffer.clear();
+        buffer.shrink_to_fit();
+#else
+        if(addr)
+            munmap(const_cast<char*>(addr),length);
+#endif
+        opened=false;
+        addr=nullptr;
+        length=0;
+    }
+
+    bool is_open()const{return opened;}
+    const char *data()const{return addr;}
+    size_t size()const{return length;}
+
+private:
+    const char *addr=nullptr;
+    size_t length=0;
+    bool opened=false;
+#ifdef _WIN32
+    std::vector<char> buffer;
+#endif
+};
+
+#endif
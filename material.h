@@ -6,12 +6,25 @@
 #include<vec3.h>
 #include<utility>
 #include<texture.h>
+#include<cstdint>
 
 class material_t
 {
 public:
+    static constexpr uint32_t no_id=~uint32_t(0);
+    uint32_t id=no_id;      // index in the frozen scene's material table
+
     virtual std::tuple<bool,colour_t,ray_t> scatter(const ray_t &r_in,const hit_record_t &rec) const = 0;
     virtual colour_t emitted(double u,double v,const point3_t &p)const{ return {0,0,0}; }
+    virtual bool is_emissive()const{ return false; }
+
+    // Materials that return true here can be lit by light sampling.  They
+    // give the solid angle density with which scatter() picks the unit
+    // direction dir, and the matching f*cos, so an integrator can weigh a
+    // light sample against a scatter() sample.
+    virtual bool samples_lights()const{ return false; }
+    virtual double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const{ return 0; }
+    virtual colour_t eval(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const{ return {0,0,0}; }
 };
 
 class lambertian_t:public material_t
@@ -23,12 +36,34 @@ public:
     lambertian_t(std::shared_ptr<texture_t> a):albedo(a){}
 
     virtual std::tuple<bool,colour_t,ray_t> scatter(const ray_t &r_in,const hit_record_t &rec) const override
+    {
+        auto scattered=sample(r_in,rec);
+        return {true,albedo->value(rec.u, rec.v, rec.p),scattered};
+    }
+
+    // normal plus a point on the unit sphere is cosine distributed
+    virtual bool samples_lights()const override{ return true; }
+    virtual double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const override
+    {
+        return pdf(rec,dir);
+    }
+    virtual colour_t eval(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const override
+    {
+        return albedo->value(rec.u, rec.v, rec.p)*scatter_pdf(r_in,rec,dir);
+    }
+
+    // the sampling without the texture, shared with compiled_lambertian_t
+    static ray_t sample(const ray_t &r_in,const hit_record_t &rec)
     {
         auto scatter_direction = rec.normal.unit() + random_in_unit_sphere().unit();
-        auto attenuation = albedo->value(rec.u, rec.v, rec.p);
         if(scatter_direction.near_zero())
-            return {true,attenuation,{rec.p, rec.normal,r_in.time()}};
-        return {true,attenuation,{rec.p, scatter_direction,r_in.time()}};
+            return rec.spawn(rec.normal,r_in.time());
+        return rec.spawn(scatter_direction,r_in.time());
+    }
+    static double pdf(const hit_record_t &rec,const vec3_t &dir)
+    {
+        auto cosine=dot(rec.normal.unit(),dir);
+        return cosine>0?cosine/pi:0;
     }
 };
 
@@ -42,9 +77,46 @@ public:
     metal_t(const colour_t &albedo,double fuzz=0):albedo(albedo),fuzz(fuzz){}
 
     virtual std::tuple<bool,colour_t,ray_t> scatter(const ray_t &r_in,const hit_record_t &rec) const override
+    {
+        auto [is_reflect,scattered]=sample(r_in,rec,fuzz);
+        return {is_reflect,albedo,scattered};
+    }
+
+    // A mirror (fuzz 0) is a delta and cannot use light samples.
+    virtual bool samples_lights()const override{ return fuzz>0; }
+    virtual double scatter_pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const override
+    {
+        return pdf(r_in,rec,dir,fuzz);
+    }
+    virtual colour_t eval(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir)const override
+    {
+        return albedo*scatter_pdf(r_in,rec,dir);
+    }
+
+    static std::pair<bool,ray_t> sample(const ray_t &r_in,const hit_record_t &rec,double fuzz)
     {
         auto reflected = reflect(r_in.direction(),rec.normal).unit() + fuzz*random_in_unit_sphere().unit();;
-        return {dot(reflected,rec.normal)>0,albedo,{rec.p, reflected,r_in.time()}};
+        return {dot(reflected,rec.normal)>0,rec.spawn(reflected,r_in.time())};
+    }
+    // sample() takes a uniform point q on the sphere of radius fuzz around
+    // the unit reflection R.  For every q on the ray s*dir the area density
+    // 1/(4*pi*fuzz^2) converts to solid angle by s^2/|cos|, where |cos| =
+    // sqrt(disc)/fuzz.  Directions below the surface are absorbed.
+    static double pdf(const ray_t &r_in,const hit_record_t &rec,const vec3_t &dir,double fuzz)
+    {
+        if(fuzz<=0 || dot(dir,rec.normal)<=0)
+            return 0;
+        auto R=reflect(r_in.direction(),rec.normal).unit();
+        auto b=dot(dir,R);
+        auto disc=b*b-1+fuzz*fuzz;
+        if(disc<=0)
+            return 0;
+        auto sqrtd=sqrt(disc);
+        double pdf=0;
+        for(auto s:{b-sqrtd,b+sqrtd})
+            if(s>0)
+                pdf+=s*s;
+        return pdf/(4*pi*fuzz*sqrtd);
     }
 };
 
@@ -64,6 +136,11 @@ public:
 
 
     virtual std::tuple<bool,colour_t,ray_t> scatter(const ray_t &r_in,const hit_record_t &rec) const override
+    {
+        return {true,attenuation,sample(r_in,rec,ir,is_fresnel_reflectance,fuzz)};
+    }
+
+    static ray_t sample(const ray_t &r_in,const hit_record_t &rec,double ir,bool is_fresnel_reflectance,double fuzz)
     {
         double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
@@ -80,7 +157,7 @@ public:
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
         direction = direction + fuzz*random_in_unit_sphere();
-        return {true,attenuation,ray_t(rec.p,direction,r_in.time())};
+        return rec.spawn(direction,r_in.time());
     }
 private:
     static double reflectance(double cosine, double ref_idx)
@@ -107,6 +184,7 @@ public:
     {
         return emit->value(u, v, p);
     }
+    virtual bool is_emissive()const override{ return true; }
 };
 
 class isotropic_t:public material_t
@@ -118,9 +196,14 @@ public:
     isotropic_t(std::shared_ptr<texture_t> a):albedo{a}{}
     virtual std::tuple<bool,colour_t,ray_t> scatter(const ray_t &r_in,const hit_record_t &rec) const override
     {
-        auto ray=ray_t(rec.p,random_in_unit_sphere(),r_in.time());
+        auto ray=sample(r_in,rec);
         return {true,albedo->value(rec.u,rec.v,rec.p),ray};
     }
+
+    static ray_t sample(const ray_t &r_in,const hit_record_t &rec)
+    {
+        return rec.spawn(random_in_unit_sphere(),r_in.time());
+    }
 };
 
 class material_test_t:public material_t
@@ -130,7 +213,7 @@ public:
     {
         return {false,{},{}};
     }
-    virtual colour_t emitted(double u,double v,const point3_t &p)const{ return (p.unit()+colour_t{1,1,1})*0.5; }
+    virtual colour_t emitted(double u,double v,const point3_t &p)const{ return (colour_t(p.unit())+colour_t{1,1,1})*0.5; }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,338 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include<hittable.h>
+#include<aabb.h>
+#include<bvh.h>
+#include<linear_bvh.h>
+#include<material.h>
+#include<vector>
+#include<cstdint>
+#include<cmath>
+#include<limits>
+#include<algorithm>
+
+// Vertex and index buffers of a triangle mesh as a loader fills them, three
+// indices per triangle.
+struct mesh_data_t
+{
+    std::vector<point3_t> positions;
+    std::vector<uint32_t> indices;
+
+    size_t triangle_count()const{return indices.size()/3;}
+
+    aabb_t bounds()const
+    {
+        aabb_t box;
+        for(size_t i=0;i<positions.size();i++)
+            box=i?surrounding_box(box,aabb_t(positions[i],positions[i])):aabb_t(positions[i],positions[i]);
+        return box;
+    }
+    // scales uniformly and moves the mesh into target, centred in x and z and
+    // standing on its floor
+    void fit(const aabb_t &target)
+    {
+        if(positions.empty())
+            return;
+        auto box=bounds();
+        auto size=box.max()-box.min();
+        auto room=target.max()-target.min();
+        // flat axes do not limit the scale; a mesh whose vertices all
+        // coincide is only moved
+        auto scale=std::numeric_limits<real_t>::infinity();
+        for(auto [r,e]:{std::pair{room.x,size.x},std::pair{room.y,size.y},std::pair{room.z,size.z}})
+            if(e>0)
+                scale=std::min(scale,r/e);
+        if(std::isinf(scale))
+            scale=1;
+        auto from=(box.min()+box.max())*0.5;
+        auto to=(target.min()+target.max())*0.5;
+        from.y=box.min().y;
+        to.y=target.min().y;
+        for(auto &p:positions)
+            p=to+(p-from)*scale;
+    }
+};
+
+// The ray sheared so that it runs along +z from the origin, built once per
+// ray for the watertight triangle test of Woop, Benthin and Wald, "Watertight
+// Ray/Triangle Intersection" (JCGT 2013): edges shared by two triangles are
+// evaluated bit-identically from both, so no ray slips between them.
+struct watertight_ray_t
+{
+    point3_t org;
+    int      kx,ky,kz;
+    real_t   sx,sy,sz;
+
+    watertight_ray_t(const ray_t &r):org(r.origin())
+    {
+        auto d=r.direction();
+        auto ax=std::fabs(d.x),ay=std::fabs(d.y),az=std::fabs(d.z);
+        kz=ax>ay?(ax>az?0:2):(ay>az?1:2);
+        kx=(kz+1)%3;
+        ky=(kx+1)%3;
+        // keep the winding, a mirrored frame would flip every edge function
+        if(axis_of(d,kz)<0)
+            std::swap(kx,ky);
+        sx=real_t(axis_of(d,kx)/axis_of(d,kz));
+        sy=real_t(axis_of(d,ky)/axis_of(d,kz));
+        sz=real_t(1/axis_of(d,kz));
+    }
+};
+
+// A read-only run of elements someone else owns.
+template<class T>
+struct array_view_t
+{
+    const T *ptr=nullptr;
+    size_t  count=0;
+
+    array_view_t()=default;
+    array_view_t(const T *ptr,size_t count):ptr(ptr),count(count){}
+    array_view_t(const std::vector<T> &v):ptr(v.data()),count(v.size()){}
+
+    const T &operator[](size_t i)const{return ptr[i];}
+    const T *data()const{return ptr;}
+    size_t size()const{return count;}
+    bool empty()const{return count==0;}
+    const T *begin()const{return ptr;}
+    const T *end()const{return ptr+count;}
+};
+
+// Triangles sharing one vertex buffer under their own BVH.  The mesh is one
+// primitive of the scene, so millions of triangles cost two buffers and the
+// nodes rather than a heap object each.  The buffers are views: into the
+// vectors built here, or into a mapped cache file used as it lies.
+class triangle_mesh_t:public hittable_t
+{
+public:
+    array_view_t<point3_t> positions;
+    array_view_t<uint32_t> indices;          // in leaf order, leaves hold triangles [offset,offset+count)
+    array_view_t<linear_bvh_node_t> nodes;
+    std::shared_ptr<material_t> mat_ptr;
+    std::shared_ptr<const void> storage;     // whatever the views point into
+
+    static constexpr int stack_size=64;
+    static_assert(bvh_builder_t::max_depth+1<=stack_size,"traversal stack shallower than the deepest tree");
+
+    triangle_mesh_t()=default;
+    triangle_mesh_t(mesh_data_t mesh,std::shared_ptr<material_t> mat,const bvh_build_options_t &options=bvh_build_options_t())
+        :mat_ptr(mat)
+    {
+        auto buffers=std::make_shared<buffers_t>();
+        storage=buffers;
+        buffers->positions=std::move(mesh.positions);
+        positions=buffers->positions;
+        auto count=mesh.triangle_count();
+        std::vector<aabb_t> boxes;
+        boxes.reserve(count);
+        for(size_t i=0;i<count;i++)
+        {
+            auto &a=positions[mesh.indices[3*i]];
+            auto &b=positions[mesh.indices[3*i+1]];
+            auto &c=positions[mesh.indices[3*i+2]];
+            boxes.emplace_back(point3_t(std::min({a.x,b.x,c.x}),std::min({a.y,b.y,c.y}),std::min({a.z,b.z,c.z})),
+                               point3_t(std::max({a.x,b.x,c.x}),std::max({a.y,b.y,c.y}),std::max({a.z,b.z,c.z})));
+        }
+        bvh_builder_t builder(boxes,options);
+        auto root=builder.build();
+        if(!root)
+            return;
+        auto &leaf_indices=buffers->indices;
+        leaf_indices.reserve(mesh.indices.size());
+        for(auto i:builder.indices)
+            leaf_indices.insert(leaf_indices.end(),mesh.indices.begin()+3*i,mesh.indices.begin()+3*i+3);
+        buffers->nodes.reserve(builder.node_count);
+        flatten(*root,buffers->nodes);
+        indices=leaf_indices;
+        nodes=buffers->nodes;
+    }
+    // over buffers kept alive by storage, as save_mesh_cache() wrote them
+    triangle_mesh_t(array_view_t<point3_t> positions,array_view_t<uint32_t> indices,array_view_t<linear_bvh_node_t> nodes,std::shared_ptr<const void> storage,std::shared_ptr<material_t> mat)
+        :positions(positions),indices(indices),nodes(nodes),mat_ptr(mat),storage(std::move(storage)){}
+
+    size_t triangle_count()const{return indices.size()/3;}
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        if(nodes.empty())
+            return {false,{}};
+        ray_inv_t ray(r);
+        watertight_ray_t sheared(r);
+        int64_t nearest=-1;
+        real_t u=0,v=0;
+        uint32_t stack[stack_size];
+        int top=0;
+        uint32_t current=0;
+        while(true)
+        {
+            auto &node=nodes[current];
+            if(node.box.hit(ray,t_min,t_max))
+            {
+                if(node.is_leaf())
+                {
+                    for(uint32_t i=node.offset;i<node.offset+node.count;i++)
+                    {
+                        real_t t,b1,b2;
+                        if(intersect(sheared,i,t_min,t_max,t,b1,b2))
+                        {
+                            t_max=t;
+                            nearest=i;
+                            u=b1;
+                            v=b2;
+                        }
+                    }
+                    if(top==0)
+                        break;
+                    current=stack[--top];
+                }
+                else if(ray.sign[node.axis])
+                {
+                    stack[top++]=current+1;
+                    current=node.offset;
+                }
+                else
+                {
+                    stack[top++]=node.offset;
+                    current=current+1;
+                }
+            }
+            else
+            {
+                if(top==0)
+                    break;
+                current=stack[--top];
+            }
+        }
+        if(nearest<0)
+            return {false,{}};
+        return {true,record(r,uint32_t(nearest),t_max,u,v)};
+    }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        if(nodes.empty())
+            return false;
+        ray_inv_t ray(r);
+        watertight_ray_t sheared(r);
+        uint32_t stack[stack_size];
+        int top=0;
+        stack[top++]=0;
+        while(top)
+        {
+            auto &node=nodes[stack[--top]];
+            if(node.box.hit(ray,t_min,t_max)==false)
+                continue;
+            if(node.is_leaf())
+            {
+                for(uint32_t i=node.offset;i<node.offset+node.count;i++)
+                {
+                    real_t t,b1,b2;
+                    if(intersect(sheared,i,t_min,t_max,t,b1,b2))
+                        return true;
+                }
+                continue;
+            }
+            stack[top++]=node.offset;
+            stack[top++]=uint32_t(&node-nodes.data())+1;
+        }
+        return false;
+    }
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1) const override
+    {
+        if(nodes.empty())
+            return {false,{}};
+        return {true,nodes[0].box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        out.push_back(mat_ptr);
+    }
+
+    // Watertight test of triangle i: t and the barycentrics b1,b2 of its
+    // second and third vertex on a hit in [t_min,t_max].
+    bool intersect(const watertight_ray_t &r,uint32_t i,real_t t_min,real_t t_max,real_t &t,real_t &b1,real_t &b2)const
+    {
+        auto a=positions[indices[3*i]]-r.org;
+        auto b=positions[indices[3*i+1]]-r.org;
+        auto c=positions[indices[3*i+2]]-r.org;
+        auto az=axis_of(a,r.kz),bz=axis_of(b,r.kz),cz=axis_of(c,r.kz);
+        real_t ax=real_t(axis_of(a,r.kx)-r.sx*az),ay=real_t(axis_of(a,r.ky)-r.sy*az);
+        real_t bx=real_t(axis_of(b,r.kx)-r.sx*bz),by=real_t(axis_of(b,r.ky)-r.sy*bz);
+        real_t cx=real_t(axis_of(c,r.kx)-r.sx*cz),cy=real_t(axis_of(c,r.ky)-r.sy*cz);
+        real_t u=difference_of_products(cx,by,cy,bx);
+        real_t v=difference_of_products(ax,cy,ay,cx);
+        real_t w=difference_of_products(bx,ay,by,ax);
+        if((u<0 || v<0 || w<0) && (u>0 || v>0 || w>0))
+            return false;
+        auto det=u+v+w;
+        if(det==0)
+            return false;
+        t=(u*real_t(r.sz*az)+v*real_t(r.sz*bz)+w*real_t(r.sz*cz))/det;
+        if(t<t_min || t>t_max)
+            return false;
+        b1=v/det;
+        b2=w/det;
+        return true;
+    }
+
+private:
+    struct buffers_t
+    {
+        std::vector<point3_t> positions;
+        std::vector<uint32_t> indices;
+        std::vector<linear_bvh_node_t> nodes;
+    };
+
+    // a*b-c*d with Kahan's fma correction.  Its sign is exact, so both
+    // triangles of a shared edge agree on the side the ray passes, which the
+    // plain expression loses once the compiler contracts it into an fma
+    static real_t difference_of_products(real_t a,real_t b,real_t c,real_t d)
+    {
+        auto cd=c*d;
+        auto err=std::fma(-c,d,cd);
+        return std::fma(a,b,-cd)+err;
+    }
+    hit_record_t record(const ray_t &r,uint32_t i,real_t t,real_t b1,real_t b2)const
+    {
+        auto &p0=positions[indices[3*i]];
+        auto &p1=positions[indices[3*i+1]];
+        auto &p2=positions[indices[3*i+2]];
+        hit_record_t rec{};
+        rec.t=t;
+        // from the barycentrics rather than r.at(t), whose error grows with t
+        auto b0=1-b1-b2;
+        rec.p=b0*p0+b1*p1+b2*p2;
+        auto size=std::max({max_abs(p0),max_abs(p1),max_abs(p2)});
+        rec.p_error=size*8*std::numeric_limits<real_t>::epsilon();
+        rec.set_face_normal(r,cross(p1-p0,p2-p0).unit());
+        rec.mat_ptr=mat_ptr.get();
+        rec.u=b1;
+        rec.v=b2;
+        return rec;
+    }
+    static real_t max_abs(const point3_t &p)
+    {
+        return std::max({std::fabs(p.x),std::fabs(p.y),std::fabs(p.z)});
+    }
+    static uint32_t flatten(const bvh_build_node_t &build_node,std::vector<linear_bvh_node_t> &nodes)
+    {
+        auto index=uint32_t(nodes.size());
+        nodes.emplace_back();
+        nodes[index].box=build_node.box;
+        nodes[index].axis=uint8_t(build_node.axis);
+        if(build_node.is_leaf())
+        {
+            nodes[index].offset=uint32_t(build_node.first);
+            nodes[index].count=uint16_t(build_node.count);
+        }
+        else
+        {
+            nodes[index].count=0;
+            flatten(*build_node.left,nodes);
+            nodes[index].offset=flatten(*build_node.right,nodes);
+        }
+        return index;
+    }
+};
+
+#endif
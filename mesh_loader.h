@@ -0,0 +1,454 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include<mesh.h>
+#include<mapped_file.h>
+#include<string>
+#include<vector>
+#include<charconv>
+#include<cstring>
+#include<cstdio>
+#include<cstdint>
+#include<cctype>
+#include<algorithm>
+
+// Reads the file into positions and triangle indices, polygons are split into
+// fans.  The file is mapped rather than read, and vertices and indices go
+// straight into the two buffers, so there is no allocation per triangle.
+
+// Cursor over a mapped text buffer, which need not end in a null.
+struct text_cursor_t
+{
+    const char *p;
+    const char *end;
+
+    bool at_end()const{return p>=end;}
+    void skip_blanks()
+    {
+        while(p<end && (*p==' ' || *p=='\t' || *p=='\r'))
+            p++;
+    }
+    void skip_line()
+    {
+        while(p<end && *p!='\n')
+            p++;
+        if(p<end)
+            p++;
+    }
+    bool at_line_end()
+    {
+        skip_blanks();
+        return p>=end || *p=='\n' || *p=='#';
+    }
+    std::string word()
+    {
+        skip_blanks();
+        auto first=p;
+        while(p<end && *p!=' ' && *p!='\t' && *p!='\r' && *p!='\n')
+            p++;
+        return std::string(first,p);
+    }
+    bool number(double &x)
+    {
+        skip_blanks();
+        if(p<end && *p=='+')
+            p++;
+        auto [next,ec]=std::from_chars(p,end,x);
+        if(ec!=std::errc())
+            return false;
+        p=next;
+        return true;
+    }
+    bool integer(long long &x)
+    {
+        skip_blanks();
+        if(p<end && *p=='+')
+            p++;
+        auto [next,ec]=std::from_chars(p,end,x);
+        if(ec!=std::errc())
+            return false;
+        p=next;
+        return true;
+    }
+};
+
+// v and f lines of a Wavefront OBJ, f takes v, v/vt, v//vn and v/vt/vn
+// corners and negative (relative) indices.  Everything else is skipped.
+inline bool load_obj(const std::string &path,mesh_data_t &mesh)
+{
+    mapped_file_t file(path);
+    if(file.is_open()==false)
+    {
+        std::fprintf(stderr,"error! cannot open %s\n",path.c_str());
+        return false;
+    }
+    text_cursor_t in{file.data(),file.data()+file.size()};
+    std::vector<uint32_t> face;
+    size_t line=0;
+    while(in.at_end()==false)
+    {
+        line++;
+        in.skip_blanks();
+        if(in.end-in.p>=2 && in.p[0]=='v' && (in.p[1]==' ' || in.p[1]=='\t'))
+        {
+            in.p++;
+            double x,y,z;
+            if(in.number(x)==false || in.number(y)==false || in.number(z)==false)
+            {
+                std::fprintf(stderr,"error! %s:%zu: bad vertex\n",path.c_str(),line);
+                return false;
+            }
+            mesh.positions.emplace_back(x,y,z);
+        }
+        else if(in.end-in.p>=2 && in.p[0]=='f' && (in.p[1]==' ' || in.p[1]=='\t'))
+        {
+            in.p++;
+            face.clear();
+            while(in.at_line_end()==false)
+            {
+                long long index;
+                if(in.integer(index)==false)
+                {
+                    std::fprintf(stderr,"error! %s:%zu: bad face\n",path.c_str(),line);
+                    return false;
+                }
+                index=index<0?(long long)mesh.positions.size()+index:index-1;
+                if(index<0 || index>=(long long)mesh.positions.size())
+                {
+                    std::fprintf(stderr,"error! %s:%zu: vertex %lld out of range\n",path.c_str(),line,index+1);
+                    return false;
+                }
+                face.push_back(uint32_t(index));
+                // texture and normal indices of the corner
+                while(in.p<in.end && *in.p!=' ' && *in.p!='\t' && *in.p!='\r' && *in.p!='\n')
+                    in.p++;
+            }
+            for(size_t i=2;i<face.size();i++)
+                mesh.indices.insert(mesh.indices.end(),{face[0],face[i-1],face[i]});
+        }
+        in.skip_line();
+    }
+    return true;
+}
+
+// Stanford PLY in ascii, binary_little_endian or binary_big_endian.  Takes
+// x,y,z of the vertex element and the vertex_indices (or vertex_index) list
+// of the face element, any other element or property is skipped.
+class ply_reader_t
+{
+public:
+    bool load(const std::string &path,mesh_data_t &mesh)
+    {
+        this->path=path;
+        mapped_file_t file(path);
+        if(file.is_open()==false)
+            return fail("cannot open");
+        text_cursor_t in{file.data(),file.data()+file.size()};
+        if(read_header(in)==false)
+            return false;
+        for(auto &element:elements)
+        {
+            bool ok;
+            if(element.name=="vertex")
+                ok=read_vertices(in,element,mesh);
+            else if(element.name=="face")
+                ok=read_faces(in,element,mesh);
+            else
+                ok=skip(in,element);
+            if(ok==false)
+                return false;
+        }
+        for(auto i:mesh.indices)
+            if(i>=mesh.positions.size())
+                return fail("vertex index out of range");
+        return true;
+    }
+
+private:
+    enum type_t{t_none,t_int8,t_uint8,t_int16,t_uint16,t_int32,t_uint32,t_float32,t_float64};
+    struct property_t
+    {
+        std::string name;
+        type_t type=t_none;
+        type_t count_type=t_none;   // set for lists
+    };
+    struct element_t
+    {
+        std::string name;
+        size_t count=0;
+        std::vector<property_t> properties;
+    };
+
+    std::string path;
+    enum{ascii,little,big} format=ascii;
+    std::vector<element_t> elements;
+
+    bool fail(const char *what)
+    {
+        std::fprintf(stderr,"error! %s: %s\n",path.c_str(),what);
+        return false;
+    }
+
+    static type_t type_of(const std::string &name)
+    {
+        if(name=="char" || name=="int8") return t_int8;
+        if(name=="uchar" || name=="uint8") return t_uint8;
+        if(name=="short" || name=="int16") return t_int16;
+        if(name=="ushort" || name=="uint16") return t_uint16;
+        if(name=="int" || name=="int32") return t_int32;
+        if(name=="uint" || name=="uint32") return t_uint32;
+        if(name=="float" || name=="float32") return t_float32;
+        if(name=="double" || name=="float64") return t_float64;
+        return t_none;
+    }
+    static size_t size_of(type_t type)
+    {
+        switch(type)
+        {
+        case t_int8: case t_uint8: return 1;
+        case t_int16: case t_uint16: return 2;
+        case t_int32: case t_uint32: case t_float32: return 4;
+        case t_float64: return 8;
+        default: return 0;
+        }
+    }
+
+    bool read_header(text_cursor_t &in)
+    {
+        if(in.word()!="ply")
+            return fail("not a ply file");
+        in.skip_line();
+        while(true)
+        {
+            if(in.at_end())
+                return fail("no end_header");
+            auto keyword=in.word();
+            if(keyword=="format")
+            {
+                auto name=in.word();
+                if(name=="ascii")
+                    format=ascii;
+                else if(name=="binary_little_endian")
+                    format=little;
+                else if(name=="binary_big_endian")
+                    format=big;
+                else
+                    return fail("unknown format");
+            }
+            else if(keyword=="element")
+            {
+                element_t element;
+                element.name=in.word();
+                long long count;
+                if(in.integer(count)==false || count<0)
+                    return fail("bad element count");
+                element.count=size_t(count);
+                elements.push_back(element);
+            }
+            else if(keyword=="property")
+            {
+                if(elements.empty())
+                    return fail("property before element");
+                property_t property;
+                auto type=in.word();
+                if(type=="list")
+                {
+                    property.count_type=type_of(in.word());
+                    property.type=type_of(in.word());
+                    if(property.count_type==t_none || property.type==t_none)
+                        return fail("unknown list type");
+                }
+                else if((property.type=type_of(type))==t_none)
+                    return fail("unknown property type");
+                property.name=in.word();
+                elements.back().properties.push_back(property);
+            }
+            else if(keyword=="end_header")
+            {
+                in.skip_line();
+                return true;
+            }
+            in.skip_line();
+        }
+    }
+
+    // one value of a binary file, in the byte order of the file
+    double binary(text_cursor_t &in,type_t type)
+    {
+        unsigned char bytes[8];
+        auto size=size_of(type);
+        std::memcpy(bytes,in.p,size);
+        in.p+=size;
+        static const bool is_native_little=[]{uint16_t one=1;unsigned char b;std::memcpy(&b,&one,1);return b==1;}();
+        if((format==little)!=is_native_little)
+            std::reverse(bytes,bytes+size);
+        switch(type)
+        {
+        case t_int8:    {int8_t v;   std::memcpy(&v,bytes,1);return v;}
+        case t_uint8:   {uint8_t v;  std::memcpy(&v,bytes,1);return v;}
+        case t_int16:   {int16_t v;  std::memcpy(&v,bytes,2);return v;}
+        case t_uint16:  {uint16_t v; std::memcpy(&v,bytes,2);return v;}
+        case t_int32:   {int32_t v;  std::memcpy(&v,bytes,4);return v;}
+        case t_uint32:  {uint32_t v; std::memcpy(&v,bytes,4);return v;}
+        case t_float32: {float v;    std::memcpy(&v,bytes,4);return v;}
+        case t_float64: {double v;   std::memcpy(&v,bytes,8);return v;}
+        default: return 0;
+        }
+    }
+    bool value(text_cursor_t &in,type_t type,double &x)
+    {
+        if(format==ascii)
+        {
+            while(in.p<in.end && (*in.p=='\n' || *in.p==' ' || *in.p=='\t' || *in.p=='\r'))
+                in.p++;
+            return in.number(x);
+        }
+        if(size_t(in.end-in.p)<size_of(type))
+            return false;
+        x=binary(in,type);
+        return true;
+    }
+
+    bool read_vertices(text_cursor_t &in,const element_t &element,mesh_data_t &mesh)
+    {
+        int xyz[3]={-1,-1,-1};
+        for(size_t i=0;i<element.properties.size();i++)
+        {
+            auto &name=element.properties[i].name;
+            if(element.properties[i].count_type==t_none && name.size()==1 && name[0]>='x' && name[0]<='z')
+                xyz[name[0]-'x']=int(i);
+        }
+        if(xyz[0]<0 || xyz[1]<0 || xyz[2]<0)
+            return fail("vertex without x, y, z");
+        mesh.positions.reserve(mesh.positions.size()+element.count);
+        double p[3]={};
+        for(size_t v=0;v<element.count;v++)
+        {
+            for(int i=0;i<int(element.properties.size());i++)
+            {
+                auto &property=element.properties[i];
+                double x;
+                if(property.count_type!=t_none)
+                {
+                    if(skip_list(in,property)==false)
+                        return fail("truncated vertex");
+                    continue;
+                }
+                if(value(in,property.type,x)==false)
+                    return fail("truncated vertex");
+                for(int a=0;a<3;a++)
+                    if(xyz[a]==i)
+                        p[a]=x;
+            }
+            mesh.positions.emplace_back(p[0],p[1],p[2]);
+        }
+        return true;
+    }
+
+    bool read_faces(text_cursor_t &in,const element_t &element,mesh_data_t &mesh)
+    {
+        int list=-1;
+        for(size_t i=0;i<element.properties.size();i++)
+        {
+            auto &property=element.properties[i];
+            if(property.count_type!=t_none && (property.name=="vertex_indices" || property.name=="vertex_index"))
+                list=int(i);
+        }
+        if(list<0)
+            return fail("face without vertex_indices");
+        // most meshes are all triangles
+        mesh.indices.reserve(mesh.indices.size()+3*element.count);
+        for(size_t f=0;f<element.count;f++)
+        {
+            for(int i=0;i<int(element.properties.size());i++)
+            {
+                auto &property=element.properties[i];
+                if(i!=list)
+                {
+                    double x;
+                    if(property.count_type!=t_none ? skip_list(in,property)==false : value(in,property.type,x)==false)
+                        return fail("truncated face");
+                    continue;
+                }
+                double count,first=0,previous=0,index;
+                if(value(in,property.count_type,count)==false)
+                    return fail("truncated face");
+                if(!(count>=0 && count<=INT32_MAX))
+                    return fail("bad face size");
+                for(int k=0;k<int(count);k++)
+                {
+                    if(value(in,property.type,index)==false)
+                        return fail("truncated face");
+                    // the cast is undefined out of range, the vertex count is
+                    // checked at the end as faces may come first
+                    if(!(index>=0 && index<=UINT32_MAX))
+                        return fail("vertex index out of range");
+                    if(k==0)
+                        first=index;
+                    else if(k>=2)
+                        mesh.indices.insert(mesh.indices.end(),{uint32_t(first),uint32_t(previous),uint32_t(index)});
+                    previous=index;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool skip_list(text_cursor_t &in,const property_t &property)
+    {
+        double count,x;
+        if(value(in,property.count_type,count)==false)
+            return false;
+        // as in read_faces, the casts are undefined out of range
+        if(!(count>=0 && count<=INT32_MAX))
+            return false;
+        if(format!=ascii)
+        {
+            // compared by division, so the byte count cannot overflow
+            auto element_size=size_of(property.type);
+            if(element_size==0 || size_t(count)>size_t(in.end-in.p)/element_size)
+                return false;
+            in.p+=size_t(count)*element_size;
+            return true;
+        }
+        for(int k=0;k<int(count);k++)
+            if(value(in,property.type,x)==false)
+                return false;
+        return true;
+    }
+    bool skip(text_cursor_t &in,const element_t &element)
+    {
+        for(size_t e=0;e<element.count;e++)
+        {
+            for(auto &property:element.properties)
+            {
+                double x;
+                if(property.count_type!=t_none ? skip_list(in,property)==false : value(in,property.type,x)==false)
+                    return fail("truncated element");
+            }
+        }
+        return true;
+    }
+};
+
+inline bool load_ply(const std::string &path,mesh_data_t &mesh)
+{
+    return ply_reader_t().load(path,mesh);
+}
+
+// picks the loader by extension, .ply or .obj
+inline bool load_mesh(const std::string &path,mesh_data_t &mesh)
+{
+    auto dot=path.rfind('.');
+    auto extension=dot==std::string::npos?std::string():path.substr(dot+1);
+    for(auto &c:extension)
+        c=char(std::tolower((unsigned char)c));
+    if(extension=="ply")
+        return load_ply(path,mesh);
+    if(extension=="obj")
+        return load_obj(path,mesh);
+    std::fprintf(stderr,"error! %s: unknown mesh format, expected .ply or .obj\n",path.c_str());
+    return false;
+}
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include<hittable.h>
+#include<aabb.h>
+#include<bvh.h>
+#include<wide_bvh.h>
+#include<cstdint>
+#include<cmath>
+#include<limits>
+#include<algorithm>
+
+// How far each slot bound of the node with the same index moves from the
+// start of its time segment to the end, in the layout of its bounds.
+template<int N>
+struct alignas(32) wide_motion_t
+{
+    float bounds[6][N];
+};
+
+// An N-wide BVH over moving primitives whose slots hold their bounds at the
+// start of a time segment and how far they move by its end.  A ray of time t
+// tests the bounds interpolated to t, so a node is about as tight at any
+// instant as its primitives are then, instead of as wide as their whole
+// sweep over the shutter.  Interpolated bounds enclose a primitive when its
+// own boxes at both ends do so interpolated, which holds for the linear
+// motion of moving_sphere_t and for anything static.
+//
+// The shutter may be cut into time_segments equal slices with a tree each,
+// built over its own slice.  Primitives moving apart or across each other
+// leave the inner nodes of one tree loose whatever the interpolation, and
+// shorter slices bound that growth.
+template<int N>
+class motion_bvh_t:public hittable_t
+{
+public:
+    struct segment_t
+    {
+        double  time0;
+        double  inv_span;
+        int32_t root;
+    };
+    std::vector<wide_bvh_node_t<N>> nodes;      // the trees of all segments, one after another
+    std::vector<wide_motion_t<N>> motion;
+    std::vector<segment_t> segments;
+    std::vector<const hittable_t*> prims;       // per segment in its leaf order
+    std::vector<std::shared_ptr<hittable_t>> objects;
+    aabb_t box;
+
+    static constexpr int stack_size=64*N;
+    static_assert(N*(bvh_builder_t::max_depth+1)<=stack_size,"traversal stack shallower than the deepest tree");
+
+    motion_bvh_t()=default;
+    // each segment is built as a wide_bvh_t over its swept boxes, then refit
+    // to either end
+    motion_bvh_t(const hittable_list_t &list,double time0,double time1,const bvh_build_options_t &options=bvh_build_options_t(),int time_segments=1)
+        :objects(list.objects)
+    {
+        time_segments=std::max(time_segments,1);
+        if(objects.empty() || time1<=time0)
+            return;
+        auto span=(time1-time0)/time_segments;
+        for(int s=0;s<time_segments;s++)
+        {
+            auto t0=time0+s*span,t1=s+1==time_segments?time1:t0+span;
+            wide_bvh_t<N> start(list,t0,t1,options);
+            if(start.nodes.empty())
+                continue;
+            box=segments.empty()?start.box:surrounding_box(box,start.box);
+            auto end=start;
+            start.refit(t0,t0);
+            end.refit(t1,t1);
+            auto node_base=int32_t(nodes.size());
+            auto prim_base=int32_t(prims.size());
+            segments.push_back({t0,1/(t1-t0),node_base});
+            prims.insert(prims.end(),start.prims.begin(),start.prims.end());
+            for(size_t k=0;k<start.nodes.size();k++)
+            {
+                auto node=start.nodes[k];
+                wide_motion_t<N> delta{};
+                for(int c=0;c<N;c++)
+                {
+                    if(node.child[c]<0)
+                        continue;
+                    node.child[c]+=node.count[c]?prim_base:node_base;
+                    for(int a=0;a<6;a++)
+                    {
+                        // the interpolation rounds unlike the primitive's own
+                        // motion, a few ulps of room keep it inside
+                        float b0=node.bounds[a][c],b1=end.nodes[k].bounds[a][c];
+                        float pad=4*std::numeric_limits<float>::epsilon()*std::max(std::fabs(b0),std::fabs(b1));
+                        node.bounds[a][c]=a<3?round_down(double(b0)-pad):round_up(double(b0)+pad);
+                        delta.bounds[a][c]=b1-b0;
+                    }
+                }
+                nodes.push_back(node);
+                motion.push_back(delta);
+            }
+        }
+    }
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        hit_record_t temp_rec{};
+        bool hit_anything=false;
+        if(nodes.empty())
+            return {false,temp_rec};
+        float f;
+        auto root=find_segment(r.time(),f);
+        wide_ray_t ray(r);
+        entry_t stack[stack_size];
+        int top=0;
+        stack[top++]={root,0,-std::numeric_limits<float>::infinity()};
+        wide_bvh_node_t<N> now;
+        alignas(32) float dist[N];
+        while(top)
+        {
+            auto entry=stack[--top];
+            if(entry.dist>t_max)
+                continue;
+            if(entry.count)
+            {
+                for(int i=entry.child;i<entry.child+entry.count;i++)
+                {
+                    auto [is_hit,rec]=prims[i]->hit(r,t_min,t_max);
+                    if(is_hit)
+                    {
+                        hit_anything=true;
+                        t_max=rec.t;
+                        temp_rec=rec;
+                    }
+                }
+                continue;
+            }
+            auto &node=nodes[entry.child];
+            interpolate(node,motion[entry.child],f,now);
+            int mask=wide_box_hit<N>(now,ray,float(t_min),float(t_max),dist);
+            int order[N];
+            int n=wide_sort_children<N>(mask,dist,order);
+            for(int k=0;k<n;k++)
+            {
+                auto c=order[k];
+                stack[top++]={node.child[c],node.count[c],dist[c]};
+            }
+        }
+        return {hit_anything,temp_rec};
+    }
+    // no near-first ordering, any primitive in range ends the walk
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        if(nodes.empty())
+            return false;
+        float f;
+        auto root=find_segment(r.time(),f);
+        wide_ray_t ray(r);
+        entry_t stack[stack_size];
+        int top=0;
+        stack[top++]={root,0,0};
+        wide_bvh_node_t<N> now;
+        alignas(32) float dist[N];
+        while(top)
+        {
+            auto entry=stack[--top];
+            if(entry.count)
+            {
+                for(int i=entry.child;i<entry.child+entry.count;i++)
+                    if(prims[i]->occluded(r,t_min,t_max))
+                        return true;
+                continue;
+            }
+            auto &node=nodes[entry.child];
+            interpolate(node,motion[entry.child],f,now);
+            int mask=wide_box_hit<N>(now,ray,float(t_min),float(t_max),dist);
+            for(int c=0;c<N;c++)
+                if(mask>>c&1)
+                    stack[top++]={node.child[c],node.count[c],dist[c]};
+        }
+        return false;
+    }
+    // the sweep over the whole shutter
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1) const override
+    {
+        return {nodes.empty()==false,box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_lights(out);
+    }
+    virtual bool has_media()const override
+    {
+        for(auto &object:objects)
+            if(object->has_media())
+                return true;
+        return false;
+    }
+
+private:
+    struct entry_t
+    {
+        int32_t  child;
+        uint16_t count;
+        float    dist;
+    };
+
+    // the root of the segment holding time and the fraction of it passed.
+    // Times off the shutter are clamped: bounds are interpolated, never
+    // extrapolated, and would not hold there.
+    int32_t find_segment(double time,float &f)const
+    {
+        auto s=std::upper_bound(segments.begin()+1,segments.end(),time,[](double time,const segment_t &s){return time<s.time0;})-1;
+        f=float(std::clamp((time-s->time0)*s->inv_span,0.0,1.0));
+        return s->root;
+    }
+    // only the bounds of now are written, wide_box_hit reads nothing else.
+    // Empty slots move by 0 and stay inverted.
+    static void interpolate(const wide_bvh_node_t<N> &node,const wide_motion_t<N> &delta,float f,wide_bvh_node_t<N> &now)
+    {
+        for(int a=0;a<6;a++)
+            for(int c=0;c<N;c++)
+                now.bounds[a][c]=node.bounds[a][c]+f*delta.bounds[a][c];
+    }
+};
+
+using motion_bvh4_t=motion_bvh_t<4>;
+using motion_bvh8_t=motion_bvh_t<8>;
+
+// The world with the objects whose box changes over [time0,time1] taken out
+// into one motion_bvh8_t, which joins the rest as a single bounded object.
+// A BVH over the rest then holds no swept boxes at all.  time_segments<1
+// picks a segment per two sizes the moving objects travel on average, at
+// most 8: slower ones gain less from segments than the trees cost to walk.
+inline hittable_list_t split_moving(const hittable_list_t &world,double time0,double time1,const bvh_build_options_t &options=bvh_build_options_t(),int time_segments=0)
+{
+    auto same=[](const vec3_t &a,const vec3_t &b){return a.x==b.x && a.y==b.y && a.z==b.z;};
+    hittable_list_t out;
+    hittable_list_t moving;
+    double travel=0,size=0;
+    for(auto &object:world.objects)
+    {
+        auto [exist0,box0]=object->bounding_box(time0,time0);
+        auto [exist1,box1]=object->bounding_box(time1,time1);
+        if(exist0 && exist1 && (same(box0.min(),box1.min())==false || same(box0.max(),box1.max())==false))
+        {
+            moving.add(object);
+            travel+=((box1.min()+box1.max())-(box0.min()+box0.max())).len()*0.5;
+            auto d=box0.max()-box0.min();
+            size+=std::max({d.x,d.y,d.z});
+        }
+        else
+            out.add(object);
+    }
+    if(moving.objects.empty())
+        return world;
+    if(time_segments<1)
+        time_segments=size>0?int(std::clamp(std::lround(travel/size*0.5),1l,8l)):8;
+    out.add(std::make_shared<motion_bvh8_t>(moving,time0,time1,options,time_segments));
+    return out;
+}
+
+#endif
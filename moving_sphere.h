@@ -8,7 +8,7 @@ class moving_sphere_t: public hittable_t
 public:
     point3_t center0, center1;
     double time0, time1;
-    double radius;
+    real_t radius;
     std::shared_ptr<material_t> mat_ptr;
 
     moving_sphere_t() {}
@@ -17,42 +17,71 @@ public:
         : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m){};
 
     point3_t center(double time) const
+    {
+        return center(center0, center1, time0, time1, time);
+    }
+    static point3_t center(const point3_t &center0, const point3_t &center1, double time0, double time1, double time)
     {
         return center0 + ((time - time0) / (time1 - time0))*(center1 - center0);
     }
 
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t root;
+        auto c = center(r.time());
+        if (intersect(c, radius, r, t_min, t_max, root) == false)
+            return {false, {}};
+        return {true, record(c, radius, mat_ptr.get(), r, root)};
+    }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t root;
+        return intersect(r, t_min, t_max, root);
+    }
+
+    bool intersect(const ray_t &r, real_t t_min, real_t t_max, real_t &root) const
     {
-        auto AC = r.origin() - center(r.time());
+        return intersect(center(r.time()), radius, r, t_min, t_max, root);
+    }
+    // the tests at the centre the sphere has at the ray's time
+    static bool intersect(const point3_t &cen, real_t radius, const ray_t &r, real_t t_min, real_t t_max, real_t &root)
+    {
+        auto AC = r.origin() - cen;
         auto a = dot(r.direction(), r.direction());
         auto b = 2 * dot(r.direction(), AC);
         auto c = dot(AC, AC) - radius * radius;
         auto discriminant = b * b - 4 * a * c;
         if (discriminant < 0)
-            return {false, {}};
+            return false;
 
         // Find the nearest root that lies in the acceptable range.
         auto sqrtd = sqrt(discriminant);
 
-        auto root = (-b - sqrtd) / (2 * a);
+        root = (-b - sqrtd) / (2 * a);
         if (root < t_min || t_max < root)
         {
             root = (-b + sqrtd) / (2 * a);
             if (root < t_min || t_max < root)
-                return {false, {}};
+                return false;
         }
+        return true;
+    }
+    static hit_record_t record(const point3_t &c, real_t radius, const material_t *mat, const ray_t &r, real_t root)
+    {
         hit_record_t rec;
         rec.t = root;
-        rec.p = r.at(rec.t);
-        auto outward_normal = (rec.p - center(r.time())) / radius;
+        auto v = r.at(rec.t) - c;
+        rec.p = c + v * (std::fabs(radius) / v.len());      // a negative radius only flips the normal
+        rec.p_error = reprojection_error(c, radius);
+        auto outward_normal = (rec.p - c) / radius;
         rec.set_face_normal(r, outward_normal);
-        rec.mat_ptr = mat_ptr;
-        return {true, rec};
+        rec.mat_ptr = mat;
+        return rec;
     }
 
     virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const override
     {
-        auto vec=vec3_t(radius,radius,radius);
+        auto vec=vec3_t(std::fabs(radius),std::fabs(radius),std::fabs(radius));
         aabb_t box0(
             center(time0)-vec,
             center(time0)+vec
@@ -63,6 +92,10 @@ public:
         );
         return {true,surrounding_box(box0,box1)};
     }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        out.push_back(mat_ptr);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -1,118 +1,264 @@
-#ifndef PERLIN_H 
+#ifndef PERLIN_H
 #define PERLIN_H
 
-#include<vector>
+#include<cstdint>
+#include<cmath>
+#include<cstdio>
+#include<algorithm>
 #include<vec3.h>
+#include<aabb.h>
+#include<thread>
+#include<vector>
+#if defined(__AVX2__)
+#include<immintrin.h>
+#define PERLIN_AVX2
+#endif
 
-class perlin_t
+// Gradients and permutations every perlin_t reads.  They are drawn from the
+// random stream once, when the first perlin_t is made, and never change
+// after, so textures share them and threads read them without locks.
+struct perlin_tables_t
 {
-    std::vector<vec3_t> ranvec;
-    std::vector<int>    perm_x;
-    std::vector<int>    perm_y;
-    std::vector<int>    perm_z;
-
     static constexpr int point_count=256;
 
-    static std::vector<int> perlin_generate_perm()
+    double  gx[point_count],gy[point_count],gz[point_count];
+    float   fx[point_count],fy[point_count],fz[point_count];  // the same in float
+    int32_t perm_x[point_count],perm_y[point_count],perm_z[point_count];
+
+    static const perlin_tables_t &shared()
     {
-        std::vector<int> p;
-        for (int i = 0; i < point_count; i++)
-            p.push_back(i);
-        for(auto i=p.size()-1;i>0;i--)
-        {
-            auto swap_target=rand_int(0,i);
-            std::swap(p[i],p[swap_target]);
-        }
-        return p;
+        static const perlin_tables_t tables;
+        return tables;
     }
 
-    static void permute(std::vector<int> &p)
+private:
+    perlin_tables_t()
     {
-        for (int i = p.size()-1; i > 0; i--)
+        for(int i=0;i<point_count;i++)
         {
-            int target = rand_int(0, i);
-            std::swap(p[i],p[target]);
+            auto g=vec3_t::random(-1,1).unit();
+            gx[i]=g.x;
+            gy[i]=g.y;
+            gz[i]=g.z;
+            fx[i]=float(g.x);
+            fy[i]=float(g.y);
+            fz[i]=float(g.z);
         }
+        generate_perm(perm_x);
+        generate_perm(perm_y);
+        generate_perm(perm_z);
     }
-
-    static double trilinear_interp(double c[2][2][2], double u, double v, double w)
+    static void generate_perm(int32_t *p)
     {
-        auto accum = 0.0;
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++)
-                    accum += (i * u + (1 - i) * (1 - u)) *
-                             (j * v + (1 - j) * (1 - v)) *
-                             (k * w + (1 - k) * (1 - w)) * c[i][j][k];
-
-        return accum;
+        for(int i=0;i<point_count;i++)
+            p[i]=i;
+        for(int i=point_count-1;i>0;i--)
+            std::swap(p[i],p[rand_int(0,i)]);
     }
+};
 
-    static double perlin_interp(vec3_t c[2][2][2], double u, double v, double w)
+class perlin_t
+{
+public:
+    perlin_t():tables(&perlin_tables_t::shared()){}
+
+    double noise(const point3_t &p)const
     {
-        auto uu = u * u * (3 - 2 * u);
-        auto vv = v * v * (3 - 2 * v);
-        auto ww = w * w * (3 - 2 * w);
-        auto accum = 0.0;
-
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++)
+        auto fx=std::floor(double(p.x)),fy=std::floor(double(p.y)),fz=std::floor(double(p.z));
+        auto u=p.x-fx,v=p.y-fy,w=p.z-fz;
+        auto uu=u*u*(3-2*u),vv=v*v*(3-2*v),ww=w*w*(3-2*w);
+        int i=int(fx),j=int(fy),k=int(fz);
+        auto &t=*tables;
+        int px[2]={t.perm_x[i&255],t.perm_x[(i+1)&255]};
+        int py[2]={t.perm_y[j&255],t.perm_y[(j+1)&255]};
+        int pz[2]={t.perm_z[k&255],t.perm_z[(k+1)&255]};
+        auto accum=0.0;
+        for(int di=0;di<2;di++)
+            for(int dj=0;dj<2;dj++)
+                for(int dk=0;dk<2;dk++)
                 {
-                    vec3_t weight_v(u - i, v - j, w - k);
-                    accum += (i * uu + (1 - i) * (1 - uu)) * (j * vv + (1 - j) * (1 - vv)) * (k * ww + (1 - k) * (1 - ww)) * dot(c[i][j][k], weight_v);
+                    auto h=px[di]^py[dj]^pz[dk];
+                    auto weight=(di?uu:1-uu)*(dj?vv:1-vv)*(dk?ww:1-ww);
+                    accum+=weight*(t.gx[h]*(u-di)+t.gy[h]*(v-dj)+t.gz[h]*(w-dk));
                 }
-
         return accum;
     }
-
-public:
-    perlin_t()
+    double turb(const point3_t &p,int depth=7)const
     {
-        for (int i = 0; i < point_count; ++i)
-            ranvec.push_back(vec3_t::random(-1,1).unit());
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
+        auto accum=0.0;
+#if defined(PERLIN_AVX2)
+        // octave i samples p*2^i and weighs it 2^-i, eight octaves at a time
+        const __m256d low=_mm256_set_pd(8,4,2,1),high=_mm256_set_pd(128,64,32,16);
+        __m256 weight=_mm256_set_ps(1.f/128,1.f/64,1.f/32,1.f/16,1.f/8,1.f/4,1.f/2,1);
+        __m256 sum=_mm256_setzero_ps();
+        auto scale=1.0;
+        for(int i=0;i<depth;i+=8,scale*=256)
+        {
+            auto x=_mm256_set1_pd(p.x*scale),y=_mm256_set1_pd(p.y*scale),z=_mm256_set1_pd(p.z*scale);
+            auto n=noise8(_mm256_mul_pd(x,low),_mm256_mul_pd(x,high),_mm256_mul_pd(y,low),_mm256_mul_pd(y,high),_mm256_mul_pd(z,low),_mm256_mul_pd(z,high));
+            if(depth-i<8)
+                n=_mm256_and_ps(n,_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(depth-i),_mm256_set_epi32(7,6,5,4,3,2,1,0))));
+            sum=_mm256_add_ps(sum,_mm256_mul_ps(_mm256_mul_ps(weight,_mm256_set1_ps(float(1/scale))),n));
+        }
+        alignas(32) float lane[8];
+        _mm256_store_ps(lane,sum);
+        for(int i=0;i<8;i++)
+            accum+=lane[i];
+#else
+        auto temp_p=p;
+        auto weight=1.0;
+        for(int i=0;i<depth;i++)
+        {
+            accum+=weight*noise(temp_p);
+            weight*=0.5;
+            temp_p*=2;
+        }
+#endif
+        return std::fabs(accum);
     }
-    double noise(const point3_t &p) const
-    {
-        auto u = p.x - floor(p.x);
-        auto v = p.y - floor(p.y);
-        auto w = p.z - floor(p.z);
 
-        auto i = static_cast<int>(floor(p.x)) ;
-        auto j = static_cast<int>(floor(p.y)) ;
-        auto k = static_cast<int>(floor(p.z)) ;
-
-        vec3_t c[2][2][2];
-
-        for (int di = 0; di < 2; di++)
-            for (int dj = 0; dj < 2; dj++)
-                for (int dk = 0; dk < 2; dk++)
+#if defined(PERLIN_AVX2)
+    // Noise at eight points given as two halves per coordinate.  Lattice
+    // cells and the offsets in them are found in double, so far from the
+    // origin they are as exact as the scalar noise(); the rest runs in float.
+    __m256 noise8(__m256d x0,__m256d x1,__m256d y0,__m256d y1,__m256d z0,__m256d z1)const
+    {
+        auto &t=*tables;
+        auto split=[](__m256d a0,__m256d a1,__m256 &frac,__m256i &cell){
+            __m256d f0=_mm256_floor_pd(a0),f1=_mm256_floor_pd(a1);
+            frac=_mm256_set_m128(_mm256_cvtpd_ps(_mm256_sub_pd(a1,f1)),_mm256_cvtpd_ps(_mm256_sub_pd(a0,f0)));
+            cell=_mm256_set_m128i(_mm256_cvttpd_epi32(f1),_mm256_cvttpd_epi32(f0));
+        };
+        __m256 u,v,w;
+        __m256i i,j,k;
+        split(x0,x1,u,i);
+        split(y0,y1,v,j);
+        split(z0,z1,w,k);
+        auto smooth=[](__m256 a){
+            return _mm256_mul_ps(_mm256_mul_ps(a,a),_mm256_sub_ps(_mm256_set1_ps(3),_mm256_add_ps(a,a)));
+        };
+        const __m256 one=_mm256_set1_ps(1);
+        __m256 uu[2],vv[2],ww[2];
+        uu[1]=smooth(u);
+        vv[1]=smooth(v);
+        ww[1]=smooth(w);
+        uu[0]=_mm256_sub_ps(one,uu[1]);
+        vv[0]=_mm256_sub_ps(one,vv[1]);
+        ww[0]=_mm256_sub_ps(one,ww[1]);
+        __m256 du[2]={u,_mm256_sub_ps(u,one)},dv[2]={v,_mm256_sub_ps(v,one)},dw[2]={w,_mm256_sub_ps(w,one)};
+        const __m256i mask=_mm256_set1_epi32(255),step=_mm256_set1_epi32(1);
+        auto perm=[&](const int32_t *table,__m256i c,int d){
+            return _mm256_i32gather_epi32(table,_mm256_and_si256(d?_mm256_add_epi32(c,step):c,mask),4);
+        };
+        __m256i px[2]={perm(t.perm_x,i,0),perm(t.perm_x,i,1)};
+        __m256i py[2]={perm(t.perm_y,j,0),perm(t.perm_y,j,1)};
+        __m256i pz[2]={perm(t.perm_z,k,0),perm(t.perm_z,k,1)};
+        __m256 accum=_mm256_setzero_ps();
+        for(int di=0;di<2;di++)
+            for(int dj=0;dj<2;dj++)
+                for(int dk=0;dk<2;dk++)
                 {
-                    auto n=ranvec[perm_x[(i + di) & 255] ^perm_y[(j + dj) & 255] ^perm_z[(k + dk) & 255]];              
-                    c[di][dj][dk] = n;
+                    __m256i h=_mm256_xor_si256(_mm256_xor_si256(px[di],py[dj]),pz[dk]);
+                    __m256 d=_mm256_mul_ps(_mm256_i32gather_ps(t.fx,h,4),du[di]);
+                    d=_mm256_add_ps(d,_mm256_mul_ps(_mm256_i32gather_ps(t.fy,h,4),dv[dj]));
+                    d=_mm256_add_ps(d,_mm256_mul_ps(_mm256_i32gather_ps(t.fz,h,4),dw[dk]));
+                    __m256 weight=_mm256_mul_ps(_mm256_mul_ps(uu[di],vv[dj]),ww[dk]);
+                    accum=_mm256_add_ps(accum,_mm256_mul_ps(weight,d));
                 }
-                     
-        return perlin_interp(c, u, v, w);
+        return accum;
     }
-    double turb(const point3_t &p, int depth = 7) const
-    {
-        auto accum = 0.0;
-        auto temp_p = p;
-        auto weight = 1.0;
+#endif
+
+private:
+    const perlin_tables_t *tables;
+};
+
+// turb() sampled at the corners of cubic cells over a box and read back
+// trilinearly, for when a bounded error is fine.  Octaves finer than a cell
+// are smoothed away, so the error grows with the cell size; max_error is
+// the largest one seen on random points in the box.  Points outside the box
+// are evaluated exactly.  Every axis has at least two samples, a flat one
+// reads the first with weight one.  A volume that would take more than
+// max_samples is not made: it stays empty and contains no point.
+class turb_volume_t
+{
+public:
+    static constexpr size_t max_samples=size_t(1)<<28;     // 1 GB of floats
+
+    aabb_t box;
+    double cell;
+    int    n[3]={0,0,0};
+    std::vector<float> samples;     // x fastest, then y, then z
+    double max_error=0;
 
-        for (int i = 0; i < depth; i++)
+    turb_volume_t(const perlin_t &noise,const aabb_t &box,double cell,int depth=7,int thread_num=1)
+        :box(box),cell(cell)
+    {
+        auto size=box.max()-box.min();
+        double extent[3]={size.x,size.y,size.z},count[3],total=1;
+        for(int i=0;i<3;i++)
         {
-            accum += weight * noise(temp_p);
-            weight *= 0.5;
-            temp_p *= 2;
+            count[i]=std::max(std::ceil(extent[i]/cell)+1,2.0);
+            total*=count[i];
         }
+        // also false for a NaN
+        if(!(cell>0 && total<=double(max_samples)))
+        {
+            std::fprintf(stderr,"error! a noise cache of %g wide cells takes more than %zu samples, not cached\n",cell,max_samples);
+            return;
+        }
+        for(int i=0;i<3;i++)
+            n[i]=int(count[i]);
+        samples.resize(size_t(n[0])*n[1]*n[2]);
+        auto fill=[&](int z0,int z1){
+            for(int z=z0;z<z1;z++)
+                for(int y=0;y<n[1];y++)
+                    for(int x=0;x<n[0];x++)
+                        samples[index(x,y,z)]=float(noise.turb(box.min()+vec3_t(x,y,z)*cell,depth));
+        };
+        thread_num=std::clamp(thread_num,1,n[2]);
+        std::vector<std::thread> workers;
+        for(int i=1;i<thread_num;i++)
+            workers.emplace_back(fill,n[2]*i/thread_num,n[2]*(i+1)/thread_num);
+        fill(0,n[2]/thread_num);
+        for(auto &worker:workers)
+            worker.join();
+        pcg32_t rng(1);
+        for(int i=0;i<4096;i++)
+        {
+            point3_t p(box.min().x+size.x*rng.next_double(),box.min().y+size.y*rng.next_double(),box.min().z+size.z*rng.next_double());
+            max_error=std::max(max_error,std::fabs(turb(p)-noise.turb(p,depth)));
+        }
+    }
 
-        return fabs(accum);
+    bool contains(const point3_t &p)const
+    {
+        return samples.empty()==false && p.x>=box.min().x && p.x<=box.max().x && p.y>=box.min().y && p.y<=box.max().y && p.z>=box.min().z && p.z<=box.max().z;
+    }
+    // only for points the box contains
+    double turb(const point3_t &p)const
+    {
+        auto q=(p-box.min())/cell;
+        int x=std::min(int(q.x),n[0]-2),y=std::min(int(q.y),n[1]-2),z=std::min(int(q.z),n[2]-2);
+        x=std::max(x,0);
+        y=std::max(y,0);
+        z=std::max(z,0);
+        double u=q.x-x,v=q.y-y,w=q.z-z;
+        auto lerp=[](double a,double b,double t){return a+(b-a)*t;};
+        auto row=[&](int y,int z){
+            auto i=index(x,y,z);
+            return lerp(samples[i],samples[i+1],u);
+        };
+        return lerp(lerp(row(y,z),row(y+1,z),v),lerp(row(y,z+1),row(y+1,z+1),v),w);
+    }
+    size_t bytes()const{return samples.size()*sizeof(float);}
+
+private:
+    size_t index(int x,int y,int z)const
+    {
+        return (size_t(z)*n[1]+y)*n[0]+x;
     }
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -11,7 +11,7 @@ public:
     vec3_t height;
     std::shared_ptr<material_t> mat_ptr;
     vec3_t n;
-    double d;
+    real_t d;
 
     plane_t()=default;
     plane_t(point3_t center,vec3_t width,vec3_t height,std::shared_ptr<material_t> mat):center(center),width(width),height(height),mat_ptr(mat)
@@ -20,29 +20,52 @@ public:
         d=-dot(n,center);
     }
 
-    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
     {
-        auto denominator=dot(n,r.direction());
-        if(denominator==0)
-            return {false,{}};
-        auto t=(-d-dot(n,r.origin()))/denominator;
-        
-        if(t<t_min || t> t_max)
+        real_t t;
+        if(intersect(r,t_min,t_max,t)==false)
             return {false,{}};
+        return {true,record(center,width,height,n,d,mat_ptr.get(),r,t)};
+    }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t t;
+        return intersect(r,t_min,t_max,t);
+    }
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const override
+    {
+        return {false,{}};
+    }
 
+    bool intersect(const ray_t &r, real_t t_min, real_t t_max, real_t &t) const
+    {
+        return intersect(n,d,r,t_min,t_max,t);
+    }
+    // the tests without an object, for copies of the fields kept elsewhere
+    static bool intersect(const vec3_t &n, real_t d, const ray_t &r, real_t t_min, real_t t_max, real_t &t)
+    {
+        auto denominator=dot(n,r.direction());
+        if(denominator==0)
+            return false;
+        t=(-d-dot(n,r.origin()))/denominator;
+        return t>=t_min && t<=t_max;
+    }
+    static hit_record_t record(const point3_t &center, const vec3_t &width, const vec3_t &height, const vec3_t &n, real_t d, const material_t *mat, const ray_t &r, real_t t)
+    {
         hit_record_t rec{};
         rec.p=r.at(t);
+        rec.p-=n*((dot(n,rec.p)+d)/n.len_squared());   // back onto the plane
         rec.t=t;
-        rec.mat_ptr=mat_ptr;
+        rec.mat_ptr=mat;
         rec.set_face_normal(r,n.unit());
         auto v=rec.p-center;
         rec.u=dot(v,width.unit());
         rec.v=dot(v,height.unit());
-        return {true,rec};
+        return rec;
     }
-    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1)const override
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
     {
-        return {false,{}};
+        out.push_back(mat_ptr);
     }
 
     void move(vec3_t direction)
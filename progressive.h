@@ -0,0 +1,173 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include<vec3.h>
+#include<vector>
+#include<string>
+#include<cstdio>
+#include<cstdint>
+#include<cstring>
+#include<algorithm>
+
+// Sum of all samples and their count per pixel, rows from the top.  A buffer
+// that came from one run (render_seed `seed`) holds exactly its samples
+// [0,next_sample) of every pixel, so a resumed run carries on at next_sample
+// and never repeats one.  seeds lists every run whose samples are in it,
+// `seed` first and then those merged in.
+//
+// Checkpoint file, native byte order:
+//   char     magic[8]        "RTACCUM"
+//   uint32_t version
+//   uint32_t width,height
+//   uint64_t seed
+//   uint64_t next_sample
+//   uint32_t seed_count      version 2 on, version 1 holds only `seed`
+//   uint64_t seeds[seed_count]
+//   double   sum[width*height][3]
+//   uint32_t count[width*height]
+class accum_buffer_t
+{
+public:
+    static constexpr char magic[8]="RTACCUM";
+    static constexpr uint32_t version=2;
+
+    uint32_t width=0;
+    uint32_t height=0;
+    uint64_t seed=0;
+    uint64_t next_sample=0;
+    std::vector<uint64_t> seeds;
+    std::vector<basic_vec3_t<double>> sum;    // double even when colour_t is float
+    std::vector<uint32_t> count;
+
+    accum_buffer_t()=default;
+    accum_buffer_t(int width,int height,uint64_t seed)
+        :width(width),height(height),seed(seed),seeds{seed},sum(size_t(width)*height,basic_vec3_t<double>(0,0,0)),count(size_t(width)*height,0)
+    {
+    }
+
+    // adds a pass that averaged `samples` samples per pixel
+    void add(const std::vector<colour_t> &mean,int samples)
+    {
+        for(size_t i=0;i<sum.size();i++)
+        {
+            sum[i]+=basic_vec3_t<double>(mean[i])*samples;
+            count[i]+=samples;
+        }
+        next_sample+=samples;
+    }
+
+    std::vector<colour_t> resolve()const
+    {
+        std::vector<colour_t> image(sum.size(),colour_t(0,0,0));
+        for(size_t i=0;i<sum.size();i++)
+            if(count[i])
+                image[i]=sum[i]*(1.0/count[i]);
+        return image;
+    }
+
+    // Adds the samples of other.  Two runs with the same seed drew the same
+    // samples, merging them would only count those twice, so no seed may be
+    // in both buffers.
+    bool merge(const accum_buffer_t &other)
+    {
+        if(other.width!=width || other.height!=height)
+        {
+            std::fprintf(stderr,"error! cannot merge a %ux%u checkpoint into %ux%u\n",other.width,other.height,width,height);
+            return false;
+        }
+        for(auto s:other.seeds)
+            if(std::find(seeds.begin(),seeds.end(),s)!=seeds.end())
+            {
+                std::fprintf(stderr,"error! the samples of seed %llu are merged twice\n",(unsigned long long)s);
+                return false;
+            }
+        seeds.insert(seeds.end(),other.seeds.begin(),other.seeds.end());
+        for(size_t i=0;i<sum.size();i++)
+        {
+            sum[i]+=other.sum[i];
+            count[i]+=other.count[i];
+        }
+        return true;
+    }
+
+    // writes path.tmp and renames it, a kill while saving keeps the old file
+    bool save(const std::string &path)const
+    {
+        static_assert(sizeof(sum[0])==3*sizeof(double),"sum is written as three doubles");
+        auto tmp=path+".tmp";
+        auto file=std::fopen(tmp.c_str(),"wb");
+        if(file==nullptr)
+            return false;
+        bool ok=std::fwrite(magic,1,sizeof(magic),file)==sizeof(magic);
+        ok=ok && write(file,version) && write(file,width) && write(file,height) && write(file,seed) && write(file,next_sample);
+        ok=ok && write(file,uint32_t(seeds.size())) && std::fwrite(seeds.data(),sizeof(uint64_t),seeds.size(),file)==seeds.size();
+        ok=ok && std::fwrite(sum.data(),sizeof(sum[0]),sum.size(),file)==sum.size();
+        ok=ok && std::fwrite(count.data(),sizeof(uint32_t),count.size(),file)==count.size();
+        ok=std::fclose(file)==0 && ok;
+        if(ok==false || std::rename(tmp.c_str(),path.c_str())!=0)
+        {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool load(const std::string &path)
+    {
+        auto file=std::fopen(path.c_str(),"rb");
+        if(file==nullptr)
+            return false;
+        // bytes between the read position and the end of the file, checked
+        // before any buffer is sized from the header
+        auto remaining=[file]()->uint64_t{
+            auto at=std::ftell(file);
+            if(at<0 || std::fseek(file,0,SEEK_END)!=0)
+                return 0;
+            auto end=std::ftell(file);
+            if(end<at || std::fseek(file,at,SEEK_SET)!=0)
+                return 0;
+            return uint64_t(end-at);
+        };
+        char file_magic[sizeof(magic)];
+        uint32_t file_version=0;
+        bool ok=std::fread(file_magic,1,sizeof(file_magic),file)==sizeof(file_magic) && std::memcmp(file_magic,magic,sizeof(magic))==0;
+        ok=ok && read(file,file_version) && (file_version==1 || file_version==version);
+        ok=ok && read(file,width) && read(file,height) && read(file,seed) && read(file,next_sample);
+        seeds.assign(1,seed);
+        uint32_t seed_count=1;
+        if(ok && file_version>=2)
+        {
+            ok=read(file,seed_count) && seed_count>=1 && seed_count<=(1u<<20) && seed_count<=remaining()/sizeof(uint64_t);
+            if(ok)
+            {
+                seeds.resize(seed_count);
+                ok=std::fread(seeds.data(),sizeof(uint64_t),seed_count,file)==seed_count && seeds[0]==seed;
+            }
+        }
+        // the rest is the pixels; width*height fits in 64 bits, its byte
+        // count need not, so the file size is divided instead
+        if(ok)
+        {
+            auto rest=remaining();
+            auto pixel_size=sizeof(sum[0])+sizeof(uint32_t);
+            ok=rest%pixel_size==0 && rest/pixel_size==uint64_t(width)*height;
+        }
+        if(ok)
+        {
+            sum.resize(size_t(width)*height);
+            count.resize(size_t(width)*height);
+            ok=std::fread(sum.data(),sizeof(sum[0]),sum.size(),file)==sum.size();
+            ok=ok && std::fread(count.data(),sizeof(uint32_t),count.size(),file)==count.size();
+        }
+        std::fclose(file);
+        return ok;
+    }
+
+private:
+    template<class T>
+    static bool write(FILE *file,const T &value){return std::fwrite(&value,sizeof(T),1,file)==1;}
+    template<class T>
+    static bool read(FILE *file,T &value){return std::fread(&value,sizeof(T),1,file)==1;}
+};
+
+#endif
@@ -1,32 +1,80 @@
 #ifndef RAY_H
 #define RAY_H
 #include<vec3.h>
+#include<cstdint>
+#include<cstring>
+#include<limits>
 
-class ray_t
+template<class T>
+class basic_ray_t
 {
 public:
-    point3_t orig;
-    vec3_t   dir;
+    using scalar_t=T;
+    basic_vec3_t<T> orig;
+    basic_vec3_t<T> dir;
     double   tm;
-    ray_t()=default;
-    ray_t(const point3_t &origin,const vec3_t &direction,double tm):orig(origin),dir(direction),tm(tm){}
-    point3_t origin()const{return orig;}
-    vec3_t direction()const{return dir;}
-    point3_t at(double t)const{return orig+dir*t;}
+    basic_ray_t()=default;
+    basic_ray_t(const basic_vec3_t<T> &origin,const basic_vec3_t<T> &direction,double tm):orig(origin),dir(direction),tm(tm){}
+    basic_vec3_t<T> origin()const{return orig;}
+    basic_vec3_t<T> direction()const{return dir;}
+    basic_vec3_t<T> at(T t)const{return orig+dir*t;}
     double time()const{return tm;}
 };
 
+using ray_t=basic_ray_t<real_t>;
+
+// Rays that leave a surface start at offset_ray_origin(), already off the
+// surface, so every intersection search starts at t=0 and no scene scale
+// dependent epsilon such as 0.001 is needed.
+constexpr real_t ray_t_min=0;
+
+// Wachter and Binder, "A Fast and Robust Method for Avoiding
+// Self-Intersection" (Ray Tracing Gems, ch. 6): moves p along the normal n
+// (pointing to the side the new ray leaves on) by a few ulps of each
+// coordinate, or by a fixed distance close to the origin where ulps are tiny.
+template<class T>
+inline basic_vec3_t<T> offset_ray_origin(const basic_vec3_t<T> &p,const basic_vec3_t<T> &n)
+{
+    using int_t=std::conditional_t<sizeof(T)==4,int32_t,int64_t>;
+    constexpr T origin=T(1.0/32);
+    constexpr T float_scale=sizeof(T)==4?T(1.0/65536):T(1.0/(65536.0*65536.0*4096.0));
+    constexpr int_t int_scale=256;
+    auto offset=[](T v,T normal){
+        int_t bits;
+        std::memcpy(&bits,&v,sizeof(v));
+        int_t of=int_t(int_scale*normal);
+        bits+=(v<0)?-of:of;
+        T moved;
+        std::memcpy(&moved,&bits,sizeof(moved));
+        return moved;
+    };
+    basic_vec3_t<T> p_i(offset(p.x,n.x),offset(p.y,n.y),offset(p.z,n.z));
+    return basic_vec3_t<T>(
+        std::fabs(p.x)<origin?p.x+float_scale*n.x:p_i.x,
+        std::fabs(p.y)<origin?p.y+float_scale*n.y:p_i.y,
+        std::fabs(p.z)<origin?p.z+float_scale*n.z:p_i.z);
+}
+
+// Rounding error bound of a point computed from q and values of size r, as the
+// reprojection onto a sphere of radius r around q does.
+template<class T>
+inline T reprojection_error(const basic_vec3_t<T> &q,T r)
+{
+    auto size=std::fmax(std::fmax(std::fabs(q.x),std::fabs(q.y)),std::fabs(q.z))+std::fabs(r);
+    return size*4*std::numeric_limits<T>::epsilon();
+}
+
 inline vec3_t reflect(const vec3_t &v, const vec3_t &n)
 {
     return v - 2 * dot(v, n.unit()) * n.unit();
 }
 
-inline vec3_t refract(const vec3_t &uv, const vec3_t &n, double etai_over_etat)
+inline vec3_t refract(const vec3_t &uv, const vec3_t &n, real_t etai_over_etat)
 {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
+    auto cos_theta = std::fmin(dot(-uv, n), real_t(1));
     vec3_t r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vec3_t r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.len_squared())) * n;
+    vec3_t r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.len_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
-#endif
\ No newline at end of file
+#endif
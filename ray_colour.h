@@ -2,14 +2,18 @@
 #define RAY_COLOUR_H
 #include<ray.h>
 #include<hittable.h>
+#include<material.h>
+#include<light.h>
+#include<compiled_material.h>
 
 class ray_colour_t
 {
 public:
     const hittable_list_t &world;
+    const compiled_materials_t &materials;
     colour_t background;
     double min_albedo;
-    ray_colour_t(const hittable_list_t &world,const colour_t &background={0,0,0},double min_albedo=0.001):world(world),background(background),min_albedo(min_albedo)
+    ray_colour_t(const hittable_list_t &world,const compiled_materials_t &materials,const colour_t &background={0,0,0},double min_albedo=0.001):world(world),materials(materials),background(background),min_albedo(min_albedo)
     {
 
     }
@@ -18,12 +22,12 @@ public:
     {
         if(depth<=0 || std::max(albedo.x,std::max(albedo.y,albedo.z))<min_albedo)
             return {0,0,0};
-        auto [is_hit,rec]=world.hit(r, 0.001, infinity);
+        auto [is_hit,rec]=world.hit(r, ray_t_min, infinity);
         if(is_hit==false)
             return background;
 
-        auto [is_reflect, attenuation, scattered] = rec.mat_ptr->scatter(r, rec);
-        auto emitted=rec.mat_ptr->emitted(rec.u,rec.v,rec.p);
+        auto [is_reflect, attenuation, scattered] = materials.scatter(r, rec);
+        auto emitted=materials.emitted(rec);
         if (is_reflect)
             return emitted + attenuation * (*this)(scattered,albedo*attenuation, depth - 1);
         else
@@ -31,4 +35,95 @@ public:
     }
 };
 
+inline double power_heuristic(double pdf_f,double pdf_g)
+{
+    auto f=pdf_f*pdf_f;
+    auto g=pdf_g*pdf_g;
+    return f+g>0?f/(f+g):0;
+}
+
+// Path tracer with next-event estimation: at every vertex whose material
+// samples_lights() one point on a light is tested with a shadow ray, and the
+// light sample and the scatter() direction are combined with the power
+// heuristic.  Emission reached after a delta bounce or from the camera, and
+// emitters missing from the light list, count in full.
+class ray_colour_nee_t
+{
+public:
+    const hittable_list_t &world;
+    const light_list_t &lights;
+    const compiled_materials_t &materials;
+    colour_t background;
+    int max_depth;
+    ray_colour_nee_t(const hittable_list_t &world,const light_list_t &lights,const compiled_materials_t &materials,const colour_t &background={0,0,0},int max_depth=50)
+        :world(world),lights(lights),materials(materials),background(background),max_depth(max_depth)
+    {
+    }
+
+    colour_t operator()(const ray_t &r)const
+    {
+        if(max_depth<=0)
+            return {0,0,0};
+        auto [is_hit,rec]=world.hit(r, ray_t_min, infinity);
+        return shade(r,is_hit,rec);
+    }
+
+    // continues the path from a first hit that was already found
+    colour_t shade(ray_t r,bool is_hit,hit_record_t rec)const
+    {
+        colour_t radiance(0,0,0);
+        colour_t throughput(1,1,1);
+        double scatter_pdf=0;       // 0 after the camera and after delta bounces
+        for(int depth=max_depth;depth>0;depth--)
+        {
+            if(depth!=max_depth)
+                std::tie(is_hit,rec)=world.hit(r, ray_t_min, infinity);
+            if(is_hit==false)
+            {
+                radiance+=throughput*background;
+                break;
+            }
+            if(materials.is_emissive(rec))
+            {
+                auto weight=scatter_pdf>0?power_heuristic(scatter_pdf,lights.pdf_value(r.origin(),r.direction())):1;
+                radiance+=weight*throughput*materials.emitted(rec);
+            }
+
+            auto [is_reflect, attenuation, scattered] = materials.scatter(r, rec);
+            // the light sample is taken whether or not the scatter sample
+            // was absorbed, MIS only sums right with both strategies always
+            // evaluated: fuzzy metal absorbs the samples below its surface
+            scatter_pdf=0;
+            bool is_light_sampled=materials.samples_lights(rec) && lights.empty()==false;
+            if(is_light_sampled)
+                radiance+=throughput*sample_light(r,rec);
+            if(is_reflect==false)
+                break;
+            if(is_light_sampled)
+                scatter_pdf=materials.scatter_pdf(r,rec,scattered.direction().unit());
+            throughput=throughput*attenuation;
+            r=scattered;
+        }
+        return radiance;
+    }
+
+private:
+    colour_t sample_light(const ray_t &r,const hit_record_t &rec)const
+    {
+        auto light=lights.pick();
+        auto shadow=rec.spawn(light->random(rec.p).unit(),r.time());
+        auto light_pdf=light->pdf_value(shadow.origin(),shadow.direction())/lights.size();
+        if(light_pdf<=0)
+            return {0,0,0};
+        auto f=materials.eval(r,rec,shadow.direction());
+        if(f.x==0 && f.y==0 && f.z==0)
+            return {0,0,0};
+        auto [is_hit,light_rec]=light->hit(shadow,ray_t_min,infinity);
+        if(is_hit==false || world.occluded(shadow,ray_t_min,light_rec.t*(1-1e-6)))
+            return {0,0,0};
+        auto weight=power_heuristic(light_pdf,materials.scatter_pdf(r,rec,shadow.direction()));
+        return weight/light_pdf*f*materials.emitted(light_rec);
+    }
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,68 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include<cstdint>
+
+// PCG32 (O'Neill, pcg-random.org): 64 bit state, one multiply-add per draw,
+// and 2^63 independent streams selected by the increment.
+class pcg32_t
+{
+    uint64_t state=0x853c49e6748fea9bULL;
+    uint64_t inc=0xda3e39cb94b95bdbULL;
+public:
+    pcg32_t()=default;
+    pcg32_t(uint64_t seed,uint64_t stream=0){this->seed(seed,stream);}
+
+    void seed(uint64_t seed,uint64_t stream=0)
+    {
+        state=0;
+        inc=(stream<<1)|1;
+        next_u32();
+        state+=seed;
+        next_u32();
+    }
+
+    uint32_t next_u32()
+    {
+        auto old=state;
+        state=old*6364136223846793005ULL+inc;
+        auto xorshifted=uint32_t(((old>>18)^old)>>27);
+        auto rot=uint32_t(old>>59);
+        return (xorshifted>>rot)|(xorshifted<<((-rot)&31));
+    }
+
+    // uniform in [0,1)
+    double next_double()
+    {
+        return next_u32()*(1.0/4294967296.0);
+    }
+};
+
+// Set once before rendering, e.g. to give separate runs independent samples.
+inline uint64_t render_seed=0;
+
+inline uint64_t mix_bits(uint64_t v)
+{
+    // splitmix64 finaliser
+    v+=0x9e3779b97f4a7c15ULL;
+    v=(v^(v>>30))*0xbf58476d1ce4e5b9ULL;
+    v=(v^(v>>27))*0x94d049bb133111ebULL;
+    return v^(v>>31);
+}
+
+// Every thread draws from its own generator, there is no shared state.
+inline pcg32_t &thread_rng()
+{
+    thread_local pcg32_t rng;
+    return rng;
+}
+
+// Restarts this thread's generator for one sample of one pixel.  The numbers
+// a sample draws then only depend on (render_seed, pixel, sample, salt), never
+// on which thread renders it or what it rendered before.
+inline void seed_sample(uint64_t pixel_index,uint64_t sample_index,uint64_t salt=0)
+{
+    thread_rng().seed(mix_bits(pixel_index^mix_bits(render_seed)),mix_bits(sample_index)^salt);
+}
+
+#endif
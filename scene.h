@@ -0,0 +1,155 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include<hittable.h>
+#include<material.h>
+#include<light.h>
+#include<compiled_material.h>
+#include<linear_bvh.h>
+#include<wide_bvh.h>
+#include<motion_bvh.h>
+#include<typed_bvh.h>
+#include<box.h>
+#include<arena.h>
+#include<vector>
+#include<memory>
+#include<map>
+#include<tuple>
+
+// Every material of a finished scene in one table, indexed by material_t::id.
+// Primitives keep their shared_ptr for ownership while the scene is built;
+// hits only carry a plain pointer, so rendering touches no refcounts.
+class material_table_t
+{
+public:
+    std::vector<std::shared_ptr<material_t>> materials;
+
+    material_table_t()=default;
+    explicit material_table_t(const hittable_t &world)
+    {
+        std::vector<std::shared_ptr<material_t>> all;
+        world.collect_materials(all);
+        for(auto &m:all)
+        {
+            if(m->id<materials.size() && materials[m->id]==m)
+                continue;
+            m->id=uint32_t(materials.size());
+            materials.push_back(m);
+        }
+    }
+
+    size_t size()const{return materials.size();}
+    const material_t &operator[](uint32_t id)const{return *materials[id];}
+};
+
+// Bytes a frozen scene takes, by what they hold.  Primitives are the typed
+// arrays and leaf references of a typed_bvh_t, or the pointers of the other
+// trees, whose primitives are the objects themselves.
+struct scene_bytes_t
+{
+    size_t objects=0;       // in the arena the scene was built in
+    size_t primitives=0;
+    size_t nodes=0;
+    size_t materials=0;
+    size_t textures=0;
+};
+
+// A scene once construction is over: the acceleration structure to trace,
+// the material table, the materials compiled for shading and the lights.
+// Nothing is added to it afterwards.
+struct frozen_scene_t
+{
+    std::shared_ptr<arena_t> arena;     // shared with the scene_builder_t it came from
+    hittable_list_t world;
+    material_table_t materials;
+    light_list_t lights;
+    compiled_materials_t shading;
+
+    frozen_scene_t()=default;
+    explicit frozen_scene_t(hittable_list_t w,std::shared_ptr<arena_t> arena=nullptr)
+        :arena(std::move(arena)),world(std::move(w)),materials(world),lights(world),shading(materials.materials){}
+
+    scene_bytes_t bytes()const
+    {
+        scene_bytes_t out;
+        out.objects=arena?arena->bytes_used():0;
+        for(auto &object:world.objects)
+        {
+            if(add_tree<typed_bvh4_t>(*object,out) || add_tree<typed_bvh8_t>(*object,out))
+                continue;
+            if(add_tree<linear_bvh_t>(*object,out) || add_tree<bvh4_t>(*object,out) || add_tree<bvh8_t>(*object,out) || add_tree<motion_bvh8_t>(*object,out))
+                continue;
+            out.primitives+=sizeof(object);
+        }
+        out.materials=shading.materials.size()*sizeof(compiled_material_t);
+        out.textures=shading.textures.nodes.size()*sizeof(texture_node_t);
+        return out;
+    }
+
+private:
+    template<class bvh_type>
+    static bool add_tree(const hittable_t &object,scene_bytes_t &out)
+    {
+        auto tree=dynamic_cast<const bvh_type*>(&object);
+        if(tree==nullptr)
+            return false;
+        out.nodes+=tree->nodes.size()*sizeof(tree->nodes[0]);
+        if constexpr(std::is_same_v<bvh_type,typed_bvh4_t> || std::is_same_v<bvh_type,typed_bvh8_t>)
+            out.primitives+=tree->refs.size()*sizeof(prim_ref_t)+tree->arrays.bytes();
+        else
+            out.primitives+=tree->prims.size()*sizeof(tree->prims[0]);
+        if constexpr(std::is_same_v<bvh_type,motion_bvh8_t>)
+            out.nodes+=tree->motion.size()*sizeof(tree->motion[0]);
+        return true;
+    }
+};
+
+// Makes a scene's objects in one arena rather than one heap block each, so
+// primitives, materials and textures lie in the order they were made and
+// the whole scene is freed a chunk at a time.  freeze() ends construction:
+// the materials and textures are compiled into arrays in the order the
+// accelerator's leaves reach them, and with a typed_bvh_t so are the
+// primitives.
+//
+// The arena goes with the builder and the last scene frozen from it, every
+// object made here must be released before both.
+class scene_builder_t
+{
+public:
+    std::shared_ptr<arena_t> arena=std::make_shared<arena_t>();
+
+    template<class T>
+    arena_allocator_t<T> allocator()const
+    {
+        return arena_allocator_t<T>(arena.get());
+    }
+    template<class T,class... args_t>
+    std::shared_ptr<T> make(args_t&&... args)
+    {
+        return std::allocate_shared<T>(allocator<T>(),std::forward<args_t>(args)...);
+    }
+    // one solid_colour_t per colour, however many materials use it
+    std::shared_ptr<texture_t> solid(const colour_t &c)
+    {
+        auto &texture=solids[std::make_tuple(c.x,c.y,c.z)];
+        if(texture==nullptr)
+            texture=make<solid_colour_t>(c);
+        return texture;
+    }
+    // a box_t with its sides in the arena too
+    std::shared_ptr<box_t> box(const point3_t &a,const point3_t &b,std::shared_ptr<material_t> mat)
+    {
+        return make<box_t>(a,b,mat,allocator<rect_t>());
+    }
+
+    // world is what to trace, usually a BVH over the objects made here
+    frozen_scene_t freeze(hittable_list_t world)
+    {
+        return frozen_scene_t(std::move(world),arena);
+    }
+
+private:
+    std::map<std::tuple<real_t,real_t,real_t>,std::shared_ptr<texture_t>> solids;
+};
+
+#endif
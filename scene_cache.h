@@ -0,0 +1,228 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include<mesh.h>
+#include<scene.h>
+#include<mapped_file.h>
+#include<bvh.h>
+#include<aabb.h>
+#include<string>
+#include<memory>
+#include<random>
+#include<cstdio>
+#include<cstring>
+#include<cstdint>
+
+// 64-bit hash of a byte range, four lanes of XXH64's round over 32-byte
+// blocks and its final mix.  Fast enough to key a cache on the whole source
+// file, but not bit-compatible with XXH64.
+inline uint64_t content_hash(const void *data,size_t size,uint64_t seed=0)
+{
+    constexpr uint64_t p1=0x9E3779B185EBCA87ull,p2=0xC2B2AE3D27D4EB4Full,p3=0x165667B19E3779F9ull;
+    auto rotl=[](uint64_t x,int r){return (x<<r)|(x>>(64-r));};
+    auto p=static_cast<const unsigned char*>(data);
+    uint64_t lane[4]={seed+p1+p2,seed+p2,seed,seed-p1};
+    size_t i=0;
+    for(;i+32<=size;i+=32)
+        for(int k=0;k<4;k++)
+        {
+            uint64_t w;
+            std::memcpy(&w,p+i+8*k,8);
+            lane[k]=rotl(lane[k]+w*p2,31)*p1;
+        }
+    uint64_t h=rotl(lane[0],1)+rotl(lane[1],7)+rotl(lane[2],12)+rotl(lane[3],18)+size;
+    for(;i<size;i++)
+        h=rotl(h^(p[i]*p3),11)*p1;
+    h^=h>>33;
+    h*=p2;
+    h^=h>>29;
+    h*=p3;
+    h^=h>>32;
+    return h;
+}
+
+// A mesh fitted into a scene with its BVH, laid out so that a mapped file
+// is used as it lies: a header, then the positions, the indices in leaf
+// order and the linear_bvh_node_t nodes, each section 64-byte aligned from
+// the start of the file.  The material is a lambertian over a solid colour,
+// all the mesh loader makes.  Files hold the native byte order and layout
+// and are rejected by any build that differs.
+//
+// Only meshes are cached.  The rest of a scene is made by C++ code in well
+// under a millisecond, top level tree and material tables included, and
+// has no source to hash; a loaded mesh and its BVH take seconds.
+constexpr uint32_t scene_cache_version=1;
+
+struct scene_cache_section_t
+{
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct scene_cache_header_t
+{
+    enum material_kind_t:uint32_t{lambertian_solid};
+
+    char     magic[8];
+    uint32_t byte_order;
+    uint32_t version;
+    uint32_t real_size;
+    uint32_t point_size;
+    uint32_t node_size;
+    uint32_t material;
+    uint64_t key;
+    uint64_t file_size;
+    scene_cache_section_t positions,indices,nodes;
+    double   albedo[3];
+};
+
+constexpr char scene_cache_magic[8]={'R','T','S','C','E','N','E','\0'};
+
+// The key of a mesh cache: the source file's bytes and everything that
+// changes what is built from them.  A different thread count builds the
+// same tree, so it is left out.
+inline uint64_t mesh_cache_key(const mapped_file_t &source,const aabb_t &fit,const colour_t &albedo,const bvh_build_options_t &options)
+{
+    double params[]={fit.min().x,fit.min().y,fit.min().z,fit.max().x,fit.max().y,fit.max().z,
+                     albedo.x,albedo.y,albedo.z,
+                     double(options.bin_count),double(options.max_leaf_size),options.traversal_cost,
+                     double(scene_cache_version),double(sizeof(real_t))};
+    return content_hash(params,sizeof(params),content_hash(source.data(),source.size()));
+}
+
+inline std::string mesh_cache_path(const std::string &dir,uint64_t key)
+{
+    char name[32];
+    std::snprintf(name,sizeof(name),"%016llx.rtscene",(unsigned long long)key);
+    return dir.empty()?name:dir+"/"+name;
+}
+
+// Writes mesh to path through a temporary file of its own renamed over it,
+// so renders sharing the directory never map half a file.
+inline bool save_mesh_cache(const std::string &path,uint64_t key,const triangle_mesh_t &mesh,const colour_t &albedo)
+{
+    auto align=[](uint64_t x){return (x+63)&~uint64_t(63);};
+    scene_cache_header_t header{};
+    std::memcpy(header.magic,scene_cache_magic,sizeof(header.magic));
+    header.byte_order=0x01020304;
+    header.version=scene_cache_version;
+    header.real_size=sizeof(real_t);
+    header.point_size=sizeof(point3_t);
+    header.node_size=sizeof(linear_bvh_node_t);
+    header.material=scene_cache_header_t::lambertian_solid;
+    header.key=key;
+    header.positions={align(sizeof(header)),mesh.positions.size()};
+    header.indices={align(header.positions.offset+mesh.positions.size()*sizeof(point3_t)),mesh.indices.size()};
+    header.nodes={align(header.indices.offset+mesh.indices.size()*sizeof(uint32_t)),mesh.nodes.size()};
+    header.file_size=header.nodes.offset+mesh.nodes.size()*sizeof(linear_bvh_node_t);
+    header.albedo[0]=albedo.x;
+    header.albedo[1]=albedo.y;
+    header.albedo[2]=albedo.z;
+
+    // a name of its own per writer, created exclusively, so two renders
+    // missing the same key never write into one file
+    std::random_device entropy;
+    char suffix[32];
+    std::snprintf(suffix,sizeof(suffix),".%08x%08x.tmp",entropy(),entropy());
+    auto temp=path+suffix;
+    auto file=std::fopen(temp.c_str(),"wbx");
+    if(file==nullptr)
+    {
+        std::fprintf(stderr,"error! cannot write %s\n",temp.c_str());
+        return false;
+    }
+    uint64_t at=0;
+    auto write=[&](uint64_t offset,const void *data,size_t bytes){
+        static const char zero[64]={};
+        bool ok=std::fwrite(zero,1,size_t(offset-at),file)==offset-at && std::fwrite(data,1,bytes,file)==bytes;
+        at=offset+bytes;
+        return ok;
+    };
+    bool ok=write(0,&header,sizeof(header))
+         && write(header.positions.offset,mesh.positions.data(),mesh.positions.size()*sizeof(point3_t))
+         && write(header.indices.offset,mesh.indices.data(),mesh.indices.size()*sizeof(uint32_t))
+         && write(header.nodes.offset,mesh.nodes.data(),mesh.nodes.size()*sizeof(linear_bvh_node_t));
+    if(std::fclose(file)!=0)
+        ok=false;
+    if(ok==false || std::rename(temp.c_str(),path.c_str())!=0)
+    {
+        std::fprintf(stderr,"error! writing %s failed\n",path.c_str());
+        std::remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Whether the buffers of a mapped mesh can be walked without reading past
+// them: indices name existing vertices, leaves existing triangles, inner
+// nodes point forward to existing nodes (so no walk loops) and no leaf
+// lies deeper than the traversal stack allows.  One pass over each buffer.
+inline bool is_mesh_sound(array_view_t<point3_t> positions,array_view_t<uint32_t> indices,array_view_t<linear_bvh_node_t> nodes)
+{
+    for(auto i:indices)
+        if(i>=positions.size())
+            return false;
+    auto triangles=indices.size()/3;
+    std::vector<uint8_t> depth(nodes.size(),0);
+    for(size_t k=0;k<nodes.size();k++)
+    {
+        auto &node=nodes[k];
+        if(node.axis>2)
+            return false;
+        if(node.is_leaf())
+        {
+            if(node.offset>triangles || node.count>triangles-node.offset)
+                return false;
+            continue;
+        }
+        if(k+1>=nodes.size() || node.offset<=k || node.offset>=nodes.size() || depth[k]>=bvh_builder_t::max_depth)
+            return false;
+        depth[k+1]=std::max(depth[k+1],uint8_t(depth[k]+1));
+        depth[node.offset]=std::max(depth[node.offset],uint8_t(depth[k]+1));
+    }
+    return true;
+}
+
+// The mesh in the cache file at path over the mapped file, or nullptr when
+// there is none for key.  Nothing is parsed or copied: the mesh keeps the
+// mapping and reads its buffers from it.
+inline std::shared_ptr<triangle_mesh_t> load_mesh_cache(const std::string &path,uint64_t key,scene_builder_t &builder)
+{
+    auto file=std::make_shared<mapped_file_t>();
+    if(file->open(path,mapped_file_t::in_place)==false || file->size()<sizeof(scene_cache_header_t))
+        return nullptr;
+    scene_cache_header_t header;
+    std::memcpy(&header,file->data(),sizeof(header));
+    auto fits=[&](const scene_cache_section_t &s,size_t element){
+        return s.offset%64==0 && s.offset<=file->size() && s.count<=(file->size()-s.offset)/element;
+    };
+    if(std::memcmp(header.magic,scene_cache_magic,sizeof(header.magic))!=0 || header.byte_order!=0x01020304
+       || header.version!=scene_cache_version || header.real_size!=sizeof(real_t) || header.point_size!=sizeof(point3_t)
+       || header.node_size!=sizeof(linear_bvh_node_t) || header.material!=scene_cache_header_t::lambertian_solid)
+    {
+        std::fprintf(stderr,"%s: written by another build, rebuilding\n",path.c_str());
+        return nullptr;
+    }
+    if(header.key!=key)
+        return nullptr;
+    if(header.file_size!=file->size() || fits(header.positions,sizeof(point3_t))==false
+       || fits(header.indices,sizeof(uint32_t))==false || fits(header.nodes,sizeof(linear_bvh_node_t))==false
+       || header.indices.count%3!=0)
+    {
+        std::fprintf(stderr,"error! %s is damaged, rebuilding\n",path.c_str());
+        return nullptr;
+    }
+    auto base=file->data();
+    array_view_t<point3_t> positions(reinterpret_cast<const point3_t*>(base+header.positions.offset),size_t(header.positions.count));
+    array_view_t<uint32_t> indices(reinterpret_cast<const uint32_t*>(base+header.indices.offset),size_t(header.indices.count));
+    array_view_t<linear_bvh_node_t> nodes(reinterpret_cast<const linear_bvh_node_t*>(base+header.nodes.offset),size_t(header.nodes.count));
+    if(is_mesh_sound(positions,indices,nodes)==false)
+    {
+        std::fprintf(stderr,"error! %s is damaged, rebuilding\n",path.c_str());
+        return nullptr;
+    }
+    auto mat=builder.make<lambertian_t>(builder.solid(colour_t(header.albedo[0],header.albedo[1],header.albedo[2])));
+    return builder.make<triangle_mesh_t>(positions,indices,nodes,std::move(file),std::move(mat));
+}
+
+#endif
@@ -0,0 +1,152 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include<vector>
+#include<deque>
+#include<mutex>
+#include<thread>
+#include<chrono>
+#include<functional>
+#include<algorithm>
+#include<cstdint>
+#include<cstdio>
+
+// Pixel rectangle [x0,x1)x[y0,y1), y counts rows from the top of the image.
+struct tile_t
+{
+    int x0,y0;
+    int x1,y1;
+};
+
+struct thread_stats_t
+{
+    double busy=0;     // seconds spent rendering tiles
+    double idle=0;     // seconds spent looking for work or waiting for the others
+    int    tiles=0;
+    int    stolen=0;
+};
+
+// Interleaves the bits of x and y so that nearby tiles get nearby codes.
+inline uint32_t morton_code(uint32_t x,uint32_t y)
+{
+    auto spread=[](uint32_t v){
+        v&=0xffff;
+        v=(v|(v<<8))&0x00ff00ff;
+        v=(v|(v<<4))&0x0f0f0f0f;
+        v=(v|(v<<2))&0x33333333;
+        v=(v|(v<<1))&0x55555555;
+        return v;
+    };
+    return spread(x)|(spread(y)<<1);
+}
+
+// Splits the image into Morton ordered tiles and deals them in contiguous
+// runs to one deque per thread.  A thread pops from the front of its own
+// deque and, once that is empty, steals from the back of the others, so a
+// thread stuck on expensive tiles (lights, media) sheds its tail to the rest.
+class tile_scheduler_t
+{
+public:
+    tile_scheduler_t(int image_width,int image_height,int tile_size,int thread_num):queues(std::max(thread_num,1))
+    {
+        tile_size=std::max(tile_size,1);
+        std::vector<std::pair<uint32_t,tile_t>> tiles;
+        for(int ty=0;ty*tile_size<image_height;ty++)
+        {
+            for(int tx=0;tx*tile_size<image_width;tx++)
+            {
+                tile_t tile{tx*tile_size,ty*tile_size,std::min((tx+1)*tile_size,image_width),std::min((ty+1)*tile_size,image_height)};
+                tiles.push_back({morton_code(tx,ty),tile});
+            }
+        }
+        std::sort(begin(tiles),end(tiles),[](auto &a,auto &b){return a.first<b.first;});
+        size_t n=queues.size();
+        for(size_t i=0;i<tiles.size();i++)
+            queues[i*n/tiles.size()].tiles.push_back(tiles[i].second);
+    }
+
+    // Runs render(thread,tile) on every tile with one thread per queue and
+    // returns how each thread spent its time.
+    std::vector<thread_stats_t> run(const std::function<void(int,const tile_t &)> &render)
+    {
+        using clock=std::chrono::steady_clock;
+        std::vector<thread_stats_t> stats(queues.size());
+        std::vector<std::thread> thread_pool;
+        auto start=clock::now();
+        for(size_t t=0;t<queues.size();t++)
+        {
+            thread_pool.emplace_back([&,t]{
+                auto &s=stats[t];
+                tile_t tile;
+                bool is_stolen;
+                while(next(int(t),tile,is_stolen))
+                {
+                    auto t0=clock::now();
+                    render(int(t),tile);
+                    s.busy+=std::chrono::duration<double>(clock::now()-t0).count();
+                    s.tiles++;
+                    s.stolen+=is_stolen;
+                }
+            });
+        }
+        for(auto &t:thread_pool)
+            t.join();
+        auto wall=std::chrono::duration<double>(clock::now()-start).count();
+        for(auto &s:stats)
+            s.idle=std::max(wall-s.busy,0.0);
+        return stats;
+    }
+
+    static void report(const std::vector<thread_stats_t> &stats,FILE *out=stderr)
+    {
+        double busy=0,idle=0;
+        for(size_t t=0;t<stats.size();t++)
+        {
+            auto &s=stats[t];
+            auto total=s.busy+s.idle;
+            std::fprintf(out,"thread %2zu: busy %8.3f s  idle %8.3f s  (%5.1f%% busy)  tiles %4d  stolen %4d\n",
+                t,s.busy,s.idle,total>0?100*s.busy/total:0.0,s.tiles,s.stolen);
+            busy+=s.busy;
+            idle+=s.idle;
+        }
+        std::fprintf(out,"total   : busy %8.3f s  idle %8.3f s  (%5.1f%% busy)\n",busy,idle,busy+idle>0?100*busy/(busy+idle):0.0);
+    }
+
+private:
+    struct queue_t
+    {
+        std::mutex mutex;
+        std::deque<tile_t> tiles;
+    };
+    std::vector<queue_t> queues;
+
+    bool next(int thread,tile_t &tile,bool &is_stolen)
+    {
+        {
+            auto &own=queues[thread];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if(own.tiles.empty()==false)
+            {
+                tile=own.tiles.front();
+                own.tiles.pop_front();
+                is_stolen=false;
+                return true;
+            }
+        }
+        for(size_t i=1;i<queues.size();i++)
+        {
+            auto &victim=queues[(thread+i)%queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if(victim.tiles.empty()==false)
+            {
+                tile=victim.tiles.back();
+                victim.tiles.pop_back();
+                is_stolen=true;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif
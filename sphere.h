@@ -16,13 +16,31 @@ class sphere_t:public hittable_t
     }
 public:
     point3_t center;
-    double   radius;
+    real_t   radius;
     std::shared_ptr<material_t> mat_ptr;
 
     sphere_t()=default;
-    sphere_t(point3_t center,double radius,std::shared_ptr<material_t> m=std::make_shared<lambertian_t>()):center(center),radius(radius),mat_ptr(m){}
+    sphere_t(point3_t center,real_t radius,std::shared_ptr<material_t> m=std::make_shared<lambertian_t>()):center(center),radius(radius),mat_ptr(m){}
 
-    virtual std::pair<bool,hit_record_t> hit(const ray_t &r, double t_min, double t_max) const override
+    virtual std::pair<bool,hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t root;
+        if (intersect(r, t_min, t_max, root) == false)
+            return {false, {}};
+        return {true, record(r, root)};
+    }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        real_t root;
+        return intersect(r, t_min, t_max, root);
+    }
+
+    bool intersect(const ray_t &r, real_t t_min, real_t t_max, real_t &root) const
+    {
+        return intersect(center, radius, r, t_min, t_max, root);
+    }
+    // the tests without an object, for copies of the fields kept elsewhere
+    static bool intersect(const point3_t &center, real_t radius, const ray_t &r, real_t t_min, real_t t_max, real_t &root)
     {
         auto CA = r.origin() - center;
         // auto a = dot(r.direction(), r.direction());
@@ -38,33 +56,115 @@ public:
         auto discriminant = bh*bh-bb*(hh-radius*radius);
 
         if (discriminant < 0)
-            return {false, {}};
+            return false;
 
         // Find the nearest root that lies in the acceptable range.
         auto sqrtd = sqrt(discriminant);
 
         //auto root = (-b - sqrtd) / (2 * a);
-        auto root = (-bh - sqrtd) / bb;
+        root = (-bh - sqrtd) / bb;
         if (root < t_min || t_max < root)
         {
             //root = (-b + sqrtd) / (2 * a);
             root = (-bh + sqrtd) / bb;
             if (root < t_min || t_max < root)
-                return {false, {}};
+                return false;
         }
+        return true;
+    }
+
+    // same test as hit() over all lanes at once, records only for lanes that hit
+    virtual void hit_packet(ray_packet_t &packet,uint32_t mask,real_t t_min)const override
+    {
+        constexpr int n=ray_packet_t::max_size;
+        real_t roots[n];
+        bool   is_hit[n];
+        for(int i=0;i<n;i++)
+        {
+            auto cx=packet.ox[i]-center.x;
+            auto cy=packet.oy[i]-center.y;
+            auto cz=packet.oz[i]-center.z;
+            auto bh=packet.dx[i]*cx+packet.dy[i]*cy+packet.dz[i]*cz;
+            auto bb=packet.dx[i]*packet.dx[i]+packet.dy[i]*packet.dy[i]+packet.dz[i]*packet.dz[i];
+            auto hh=cx*cx+cy*cy+cz*cz;
+            auto discriminant=bh*bh-bb*(hh-radius*radius);
+            auto sqrtd=std::sqrt(discriminant<0?0:discriminant);
+            auto near=(-bh-sqrtd)/bb;
+            auto far=(-bh+sqrtd)/bb;
+            auto root=near>=t_min && near<=packet.t_max[i]?near:far;
+            roots[i]=root;
+            is_hit[i]=discriminant>=0 && root>=t_min && root<=packet.t_max[i];
+        }
+        for(int i=0;i<packet.size;i++)
+            if((mask>>i&1) && is_hit[i])
+                packet.update(i,record(packet.ray(i),roots[i]));
+    }
+    virtual std::pair<bool,aabb_t> bounding_box(double time0, double time1) const override
+    {
+        // a negative radius (hollow glass) must not invert the box
+        auto r = std::fabs(radius);
+        auto vec = vec3_t(r, r, r);
+        return {true, aabb_t(center - vec, center + vec)};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        out.push_back(mat_ptr);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        if(mat_ptr->is_emissive())
+            out.push_back(this);
+    }
+    // uniform over the cone the sphere subtends from o, nothing from inside
+    virtual double pdf_value(const point3_t &o,const vec3_t &v)const override
+    {
+        real_t root;
+        if(intersect(ray_t(o,v,0),ray_t_min,infinity,root)==false)
+            return 0;
+        auto distance_squared=(center-o).len_squared();
+        if(distance_squared<=radius*radius)
+            return 0;
+        auto cos_theta_max=sqrt(1-radius*radius/distance_squared);
+        return 1/(2*pi*(1-cos_theta_max));
+    }
+    virtual vec3_t random(const point3_t &o)const override
+    {
+        auto direction=center-o;
+        auto distance_squared=direction.len_squared();
+        if(distance_squared<=radius*radius)
+            return random_in_unit_sphere();
+        auto cos_theta_max=sqrt(1-radius*radius/distance_squared);
+        auto z=1+rand_uniform()*(cos_theta_max-1);
+        auto phi=2*pi*rand_uniform();
+        auto r=sqrt(1-z*z);
+        // orthonormal basis around the axis to the centre
+        auto w=direction.unit();
+        auto a=fabs(w.x)>0.9?vec3_t(0,1,0):vec3_t(1,0,0);
+        auto v=cross(w,a).unit();
+        auto u=cross(w,v);
+        return r*cos(phi)*u+r*sin(phi)*v+z*w;
+    }
+
+    // the hit record for a root found by intersect()
+    hit_record_t record(const ray_t &r,real_t root)const
+    {
+        return record(center,radius,mat_ptr.get(),r,root);
+    }
+    static hit_record_t record(const point3_t &center,real_t radius,const material_t *mat,const ray_t &r,real_t root)
+    {
         hit_record_t rec;
         rec.t = root;
-        rec.p = r.at(rec.t);
+        // back onto the surface, r.at() is off by the rounding error of t.
+        // By the size of the radius: a negative one (hollow glass) only
+        // turns the normal inwards
+        auto v = r.at(rec.t) - center;
+        rec.p = center + v * (std::fabs(radius) / v.len());
+        rec.p_error = reprojection_error(center, radius);
         auto outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
-        rec.mat_ptr = mat_ptr;
+        rec.mat_ptr = mat;
         std::tie(rec.u,rec.v)=get_uv(outward_normal);
-        return {true, rec};
-    }
-    virtual std::pair<bool,aabb_t> bounding_box(double time0, double time1) const override
-    {
-        auto vec = vec3_t(radius, radius, radius);
-        return {true, aabb_t(center - vec, center + vec)};
+        return rec;
     }
 };
 
@@ -0,0 +1,291 @@
+#ifndef SPHERE_BATCH_H
+#define SPHERE_BATCH_H
+
+#include<sphere.h>
+#include<bvh.h>
+#include<cstdint>
+#include<cmath>
+#include<cstdio>
+#include<algorithm>
+#if defined(__SSE2__) || defined(_M_X64)
+#include<immintrin.h>
+#define SPHERE_BATCH_SSE
+#endif
+
+// One register of real_t lanes and the few operations the sphere test needs.
+// AVX holds 8 floats or 4 doubles, SSE 4 floats or 2 doubles, the fallback
+// loops over 4 lanes.
+template<class T>
+struct sphere_lanes_t
+{
+    static constexpr int width=4;
+    struct reg_t{T v[width];};
+    template<class F>
+    static reg_t map(F f){reg_t r;for(int i=0;i<width;i++)r.v[i]=f(i);return r;}
+
+    static reg_t set1(T x){return map([&](int){return x;});}
+    static reg_t load(const T *p){return map([&](int i){return p[i];});}
+    static void  store(T *p,reg_t a){for(int i=0;i<width;i++)p[i]=a.v[i];}
+    static reg_t add(reg_t a,reg_t b){return map([&](int i){return a.v[i]+b.v[i];});}
+    static reg_t sub(reg_t a,reg_t b){return map([&](int i){return a.v[i]-b.v[i];});}
+    static reg_t mul(reg_t a,reg_t b){return map([&](int i){return a.v[i]*b.v[i];});}
+    static reg_t sqrt(reg_t a){return map([&](int i){return std::sqrt(a.v[i]);});}
+    // masks are all ones or all zeros per lane, as in SIMD
+    static reg_t ge(reg_t a,reg_t b){return map([&](int i){return a.v[i]>=b.v[i]?T(1):T(0);});}
+    static reg_t le(reg_t a,reg_t b){return map([&](int i){return a.v[i]<=b.v[i]?T(1):T(0);});}
+    static reg_t both(reg_t a,reg_t b){return map([&](int i){return a.v[i]!=0 && b.v[i]!=0?T(1):T(0);});}
+    static reg_t select(reg_t m,reg_t a,reg_t b){return map([&](int i){return m.v[i]!=0?a.v[i]:b.v[i];});}
+    static int   bits(reg_t m){int r=0;for(int i=0;i<width;i++)r|=(m.v[i]!=0)<<i;return r;}
+};
+
+#if defined(__AVX__)
+template<>
+struct sphere_lanes_t<float>
+{
+    static constexpr int width=8;
+    using reg_t=__m256;
+    static reg_t set1(float x){return _mm256_set1_ps(x);}
+    static reg_t load(const float *p){return _mm256_load_ps(p);}
+    static void  store(float *p,reg_t a){_mm256_store_ps(p,a);}
+    static reg_t add(reg_t a,reg_t b){return _mm256_add_ps(a,b);}
+    static reg_t sub(reg_t a,reg_t b){return _mm256_sub_ps(a,b);}
+    static reg_t mul(reg_t a,reg_t b){return _mm256_mul_ps(a,b);}
+    static reg_t sqrt(reg_t a){return _mm256_sqrt_ps(a);}
+    static reg_t ge(reg_t a,reg_t b){return _mm256_cmp_ps(a,b,_CMP_GE_OQ);}
+    static reg_t le(reg_t a,reg_t b){return _mm256_cmp_ps(a,b,_CMP_LE_OQ);}
+    static reg_t both(reg_t a,reg_t b){return _mm256_and_ps(a,b);}
+    static reg_t select(reg_t m,reg_t a,reg_t b){return _mm256_blendv_ps(b,a,m);}
+    static int   bits(reg_t m){return _mm256_movemask_ps(m);}
+};
+
+template<>
+struct sphere_lanes_t<double>
+{
+    static constexpr int width=4;
+    using reg_t=__m256d;
+    static reg_t set1(double x){return _mm256_set1_pd(x);}
+    static reg_t load(const double *p){return _mm256_load_pd(p);}
+    static void  store(double *p,reg_t a){_mm256_store_pd(p,a);}
+    static reg_t add(reg_t a,reg_t b){return _mm256_add_pd(a,b);}
+    static reg_t sub(reg_t a,reg_t b){return _mm256_sub_pd(a,b);}
+    static reg_t mul(reg_t a,reg_t b){return _mm256_mul_pd(a,b);}
+    static reg_t sqrt(reg_t a){return _mm256_sqrt_pd(a);}
+    static reg_t ge(reg_t a,reg_t b){return _mm256_cmp_pd(a,b,_CMP_GE_OQ);}
+    static reg_t le(reg_t a,reg_t b){return _mm256_cmp_pd(a,b,_CMP_LE_OQ);}
+    static reg_t both(reg_t a,reg_t b){return _mm256_and_pd(a,b);}
+    static reg_t select(reg_t m,reg_t a,reg_t b){return _mm256_blendv_pd(b,a,m);}
+    static int   bits(reg_t m){return _mm256_movemask_pd(m);}
+};
+#elif defined(SPHERE_BATCH_SSE)
+template<>
+struct sphere_lanes_t<float>
+{
+    static constexpr int width=4;
+    using reg_t=__m128;
+    static reg_t set1(float x){return _mm_set1_ps(x);}
+    static reg_t load(const float *p){return _mm_load_ps(p);}
+    static void  store(float *p,reg_t a){_mm_store_ps(p,a);}
+    static reg_t add(reg_t a,reg_t b){return _mm_add_ps(a,b);}
+    static reg_t sub(reg_t a,reg_t b){return _mm_sub_ps(a,b);}
+    static reg_t mul(reg_t a,reg_t b){return _mm_mul_ps(a,b);}
+    static reg_t sqrt(reg_t a){return _mm_sqrt_ps(a);}
+    static reg_t ge(reg_t a,reg_t b){return _mm_cmpge_ps(a,b);}
+    static reg_t le(reg_t a,reg_t b){return _mm_cmple_ps(a,b);}
+    static reg_t both(reg_t a,reg_t b){return _mm_and_ps(a,b);}
+    static reg_t select(reg_t m,reg_t a,reg_t b){return _mm_or_ps(_mm_and_ps(m,a),_mm_andnot_ps(m,b));}
+    static int   bits(reg_t m){return _mm_movemask_ps(m);}
+};
+
+template<>
+struct sphere_lanes_t<double>
+{
+    static constexpr int width=2;
+    using reg_t=__m128d;
+    static reg_t set1(double x){return _mm_set1_pd(x);}
+    static reg_t load(const double *p){return _mm_load_pd(p);}
+    static void  store(double *p,reg_t a){_mm_store_pd(p,a);}
+    static reg_t add(reg_t a,reg_t b){return _mm_add_pd(a,b);}
+    static reg_t sub(reg_t a,reg_t b){return _mm_sub_pd(a,b);}
+    static reg_t mul(reg_t a,reg_t b){return _mm_mul_pd(a,b);}
+    static reg_t sqrt(reg_t a){return _mm_sqrt_pd(a);}
+    static reg_t ge(reg_t a,reg_t b){return _mm_cmpge_pd(a,b);}
+    static reg_t le(reg_t a,reg_t b){return _mm_cmple_pd(a,b);}
+    static reg_t both(reg_t a,reg_t b){return _mm_and_pd(a,b);}
+    static reg_t select(reg_t m,reg_t a,reg_t b){return _mm_or_pd(_mm_and_pd(m,a),_mm_andnot_pd(m,b));}
+    static int   bits(reg_t m){return _mm_movemask_pd(m);}
+};
+#endif
+
+// Up to `width` neighbouring static spheres stored by value in SoA layout, one
+// register per component.  The outer BVH holds the batch as one primitive, so
+// a leaf tests the ray against all its spheres in a single pass of SIMD
+// instructions; only the sphere that ends up nearest builds a hit record.
+class sphere_batch_t:public hittable_t
+{
+public:
+    using lanes=sphere_lanes_t<real_t>;
+    static constexpr int width=2*lanes::width;
+
+    alignas(32) real_t cx[width];
+    alignas(32) real_t cy[width];
+    alignas(32) real_t cz[width];
+    alignas(32) real_t radius[width];
+    int count=0;
+    const sphere_t *prims[width];
+    std::vector<std::shared_ptr<sphere_t>> objects;    // keeps prims alive
+    aabb_t box;
+
+    sphere_batch_t()=default;
+    sphere_batch_t(const std::vector<std::shared_ptr<sphere_t>> &spheres):count(int(std::min(spheres.size(),size_t(width)))),objects(begin(spheres),begin(spheres)+count)
+    {
+        if(spheres.size()>size_t(width))
+            std::fprintf(stderr,"error! sphere batch holds %d spheres, %zu given\n",width,spheres.size());
+        for(int i=0;i<width;i++)
+        {
+            // unused lanes are masked off after the test
+            const sphere_t *sphere=i<count?objects[i].get():nullptr;
+            cx[i]=sphere?sphere->center.x:0;
+            cy[i]=sphere?sphere->center.y:0;
+            cz[i]=sphere?sphere->center.z:0;
+            radius[i]=sphere?sphere->radius:0;
+            prims[i]=sphere;
+            if(sphere)
+            {
+                auto b=sphere_box(*sphere);
+                box=i?surrounding_box(box,b):b;
+            }
+        }
+    }
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        alignas(32) real_t roots[width];
+        auto mask=intersect(r,t_min,t_max,roots);
+        if(mask==0)
+            return {false,{}};
+        int nearest=-1;
+        for(int i=0;i<count;i++)
+        {
+            if((mask>>i&1) && roots[i]<=t_max)
+            {
+                t_max=roots[i];
+                nearest=i;
+            }
+        }
+        return {true,prims[nearest]->record(r,t_max)};
+    }
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        alignas(32) real_t roots[width];
+        return intersect(r,t_min,t_max,roots)!=0;
+    }
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1) const override
+    {
+        return {count>0,box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_lights(out);
+    }
+
+    // sphere_t::intersect over every lane: returns a bit per sphere with a
+    // root in [t_min,t_max] and stores the roots
+    int intersect(const ray_t &r,real_t t_min,real_t t_max,real_t *roots)const
+    {
+        auto ox=lanes::set1(r.origin().x);
+        auto oy=lanes::set1(r.origin().y);
+        auto oz=lanes::set1(r.origin().z);
+        auto dx=lanes::set1(r.direction().x);
+        auto dy=lanes::set1(r.direction().y);
+        auto dz=lanes::set1(r.direction().z);
+        auto bb=dot(r.direction(),r.direction());
+        auto v_bb=lanes::set1(bb);
+        auto inv_bb=lanes::set1(1/bb);
+        auto zero=lanes::set1(0);
+        auto lo=lanes::set1(t_min);
+        auto hi=lanes::set1(t_max);
+        int mask=0;
+        for(int k=0;k<width;k+=lanes::width)
+        {
+            auto ocx=lanes::sub(ox,lanes::load(cx+k));
+            auto ocy=lanes::sub(oy,lanes::load(cy+k));
+            auto ocz=lanes::sub(oz,lanes::load(cz+k));
+            auto bh=lanes::add(lanes::add(lanes::mul(dx,ocx),lanes::mul(dy,ocy)),lanes::mul(dz,ocz));
+            auto hh=lanes::add(lanes::add(lanes::mul(ocx,ocx),lanes::mul(ocy,ocy)),lanes::mul(ocz,ocz));
+            auto r2=lanes::mul(lanes::load(radius+k),lanes::load(radius+k));
+            auto discriminant=lanes::sub(lanes::mul(bh,bh),lanes::mul(v_bb,lanes::sub(hh,r2)));
+            // most spheres the ray reaches it misses, skip the sqrt for them
+            if(lanes::bits(lanes::ge(discriminant,zero))==0)
+                continue;
+            // a negative discriminant gives NaN roots, which fail every compare
+            auto sqrtd=lanes::sqrt(discriminant);
+            auto near=lanes::mul(lanes::sub(lanes::sub(zero,bh),sqrtd),inv_bb);
+            auto far=lanes::mul(lanes::sub(sqrtd,bh),inv_bb);
+            auto root=lanes::select(lanes::both(lanes::ge(near,lo),lanes::le(near,hi)),near,far);
+            lanes::store(roots+k,root);
+            mask|=lanes::bits(lanes::both(lanes::ge(root,lo),lanes::le(root,hi)))<<k;
+        }
+        return mask&((1<<count)-1);
+    }
+
+    // a negative radius (hollow glass) must not invert the box
+    static aabb_t sphere_box(const sphere_t &sphere)
+    {
+        auto r=std::fabs(sphere.radius);
+        return aabb_t(sphere.center-vec3_t(r,r,r),sphere.center+vec3_t(r,r,r));
+    }
+};
+
+// Replaces the sphere_t objects of world with sphere_batch_t objects of
+// neighbouring spheres, grouped by an SAH build with leaves of at most one
+// batch.  Everything else is kept as is, as are worlds with fewer than
+// min_count spheres.
+inline hittable_list_t batch_spheres(const hittable_list_t &world,size_t min_count=8,bvh_build_options_t options=bvh_build_options_t())
+{
+    hittable_list_t out;
+    std::vector<std::shared_ptr<sphere_t>> spheres;
+    for(auto &object:world.objects)
+    {
+        if(auto sphere=std::dynamic_pointer_cast<sphere_t>(object))
+            spheres.push_back(sphere);
+        else
+            out.add(object);
+    }
+    if(spheres.size()<min_count)
+        return world;
+    std::vector<aabb_t> boxes;
+    boxes.reserve(spheres.size());
+    for(auto &sphere:spheres)
+        boxes.push_back(sphere_batch_t::sphere_box(*sphere));
+    // a batch tests all its lanes at once, a split that saves less than that
+    // does not pay
+    options.max_leaf_size=sphere_batch_t::width;
+    options.traversal_cost=sphere_batch_t::width;
+    bvh_builder_t builder(boxes,options);
+    auto root=builder.build();
+    std::vector<const bvh_build_node_t*> stack{root.get()};
+    while(stack.empty()==false)
+    {
+        auto node=stack.back();
+        stack.pop_back();
+        if(node->is_leaf()==false)
+        {
+            stack.push_back(node->left.get());
+            stack.push_back(node->right.get());
+            continue;
+        }
+        std::vector<std::shared_ptr<sphere_t>> batch;
+        for(auto i=node->first;i<node->first+node->count;i++)
+            batch.push_back(spheres[builder.indices[i]]);
+        out.add(std::make_shared<sphere_batch_t>(batch));
+    }
+    return out;
+}
+
+#endif
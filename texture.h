@@ -34,13 +34,17 @@ public:
     checker_texture_t(colour_t c1,colour_t c2):checker_texture_t(std::make_shared<solid_colour_t>(c1),std::make_shared<solid_colour_t>(c2)){}
     virtual colour_t value(double u,double v,const point3_t &p)const override
     {
-        //auto sines = sin(10 * p.x) * sin(10 * p.y) * sin(10 * p.z);
-        auto sines = sin(10*u) * sin(10*v);
-        if (sines < 0)
+        if (is_odd(u, v))
             return odd->value(u, v, p);
         else
             return even->value(u, v, p);
     }
+    static bool is_odd(double u,double v)
+    {
+        //auto sines = sin(10 * p.x) * sin(10 * p.y) * sin(10 * p.z);
+        auto sines = sin(10*u) * sin(10*v);
+        return sines < 0;
+    }
 };
 
 class noise_texture_t : public texture_t
@@ -48,15 +52,27 @@ class noise_texture_t : public texture_t
 public:
     perlin_t noise;
     double   scale=1;
+    std::shared_ptr<const turb_volume_t> volume;
 
     noise_texture_t() {}
     noise_texture_t(double scale):scale(scale){}
 
     virtual colour_t value(double u, double v, const point3_t &p) const override
     {
-        return colour_t(1, 1, 1) * noise.turb(scale*p);
+        auto q=scale*p;
+        if(volume && volume->contains(q))
+            return colour_t(1, 1, 1) * volume->turb(q);
+        return colour_t(1, 1, 1) * noise.turb(q);
+    }
+    // serves the points in box, in world space, from a turb_volume_t of
+    // cells cell wide; false when the volume would be too large to make
+    bool cache(const aabb_t &box,double cell,int thread_num=1)
+    {
+        volume=std::make_shared<turb_volume_t>(noise,aabb_t(scale*box.min(),scale*box.max()),scale*cell,7,thread_num);
+        if(volume->samples.empty())
+            volume=nullptr;
+        return volume!=nullptr;
     }
-
 };
 
 class tex_test_t:public texture_t
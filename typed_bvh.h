@@ -0,0 +1,435 @@
+#ifndef TYPED_BVH_H
+#define TYPED_BVH_H
+
+#include<hittable.h>
+#include<sphere.h>
+#include<moving_sphere.h>
+#include<aarect.h>
+#include<box.h>
+#include<constant_medium.h>
+#include<wide_bvh.h>
+#include<cstdint>
+#include<typeinfo>
+
+// The fields of each primitive kind copied by value, no vtable and no
+// shared_ptr.  intersect() only finds t, record() builds the hit record for
+// a t it found, both with the static tests of the class the data came from.
+struct sphere_prim_t
+{
+    point3_t center;
+    real_t   radius;
+    const material_t *mat;
+
+    bool intersect(const ray_t &r,real_t t_min,real_t t_max,real_t &t)const
+    {
+        return sphere_t::intersect(center,radius,r,t_min,t_max,t);
+    }
+    hit_record_t record(const ray_t &r,real_t t)const
+    {
+        return sphere_t::record(center,radius,mat,r,t);
+    }
+};
+
+struct moving_sphere_prim_t
+{
+    point3_t center0,center1;
+    double   time0,time1;
+    real_t   radius;
+    const material_t *mat;
+
+    bool intersect(const ray_t &r,real_t t_min,real_t t_max,real_t &t)const
+    {
+        return moving_sphere_t::intersect(moving_sphere_t::center(center0,center1,time0,time1,r.time()),radius,r,t_min,t_max,t);
+    }
+    hit_record_t record(const ray_t &r,real_t t)const
+    {
+        return moving_sphere_t::record(moving_sphere_t::center(center0,center1,time0,time1,r.time()),radius,mat,r,t);
+    }
+};
+
+struct rect_prim_t
+{
+    vec3_t   n;
+    point3_t min,max;
+    real_t   d;
+    const material_t *mat;
+
+    bool intersect(const ray_t &r,real_t t_min,real_t t_max,real_t &t)const
+    {
+        point3_t p;
+        return rect_t::intersect(n,d,min,max,r,t_min,t_max,t,p);
+    }
+    // rect_t::intersect() found p as r.at(t)
+    hit_record_t record(const ray_t &r,real_t t)const
+    {
+        return rect_t::record(n,d,mat,r,r.at(t),t);
+    }
+};
+
+struct xrect_prim_t
+{
+    point3_t center;
+    vec3_t   width,height,n;
+    real_t   d;
+    const material_t *mat;
+
+    // xrect_t tests the point of the plane's hit record
+    bool intersect(const ray_t &r,real_t t_min,real_t t_max,real_t &t)const
+    {
+        return plane_t::intersect(n,d,r,t_min,t_max,t) && xrect_t::is_in_rect(center,width,height,record(r,t).p);
+    }
+    hit_record_t record(const ray_t &r,real_t t)const
+    {
+        return plane_t::record(center,width,height,n,d,mat,r,t);
+    }
+};
+
+// the six sides of a box_t in its order, nearest wins as in hittable_list_t
+struct box_prim_t
+{
+    rect_prim_t sides[6];
+
+    bool intersect(const ray_t &r,real_t t_min,real_t t_max,real_t &t,uint32_t &side)const
+    {
+        bool hit_anything=false;
+        for(uint32_t i=0;i<6;i++)
+        {
+            if(sides[i].intersect(r,t_min,t_max,t))
+            {
+                hit_anything=true;
+                t_max=t;
+                side=i;
+            }
+        }
+        t=t_max;
+        return hit_anything;
+    }
+};
+
+// The boundary stays a virtual call, it may be of any kind.
+struct medium_prim_t
+{
+    const hittable_t *boundary;
+    double neg_inv_density;
+    const material_t *phase_function;
+
+    bool intersect(const ray_t &r,real_t t_min,real_t t_max,real_t &t)const
+    {
+        return constant_medium_t::intersect(*boundary,neg_inv_density,r,t_min,t_max,t);
+    }
+    hit_record_t record(const ray_t &r,real_t t)const
+    {
+        hit_record_t rec{};
+        rec.t=t;
+        rec.p=r.at(rec.t);
+        rec.mat_ptr=phase_function;
+        return rec;
+    }
+};
+
+// A primitive as its kind and its index in that kind's array, 3 and 29 bits.
+struct prim_ref_t
+{
+    enum type_t:uint32_t{sphere,moving_sphere,rect,xrect,box,medium,other};
+
+    uint32_t bits;
+
+    prim_ref_t()=default;
+    prim_ref_t(type_t type,uint32_t index):bits(uint32_t(type)<<29|index){}
+    type_t   type()const{return type_t(bits>>29);}
+    uint32_t index()const{return bits&((1u<<29)-1);}
+};
+
+// Every primitive of a scene sorted into one dense array per kind.  Kinds
+// are matched exactly, a subclass may test differently; anything else, like
+// instances, meshes and nested BVHs, goes into others and is called
+// virtually.  The objects stay the authoring API and own the materials.
+class prim_arrays_t
+{
+public:
+    std::vector<sphere_prim_t> spheres;
+    std::vector<moving_sphere_prim_t> moving_spheres;
+    std::vector<rect_prim_t> rects;
+    std::vector<xrect_prim_t> xrects;
+    std::vector<box_prim_t> boxes;
+    std::vector<medium_prim_t> media;
+    std::vector<const hittable_t*> others;
+
+    prim_ref_t add(const hittable_t &object)
+    {
+        auto &type=typeid(object);
+        if(type==typeid(sphere_t))
+        {
+            auto &s=static_cast<const sphere_t&>(object);
+            spheres.push_back({s.center,s.radius,s.mat_ptr.get()});
+            return {prim_ref_t::sphere,uint32_t(spheres.size()-1)};
+        }
+        if(type==typeid(moving_sphere_t))
+        {
+            auto &s=static_cast<const moving_sphere_t&>(object);
+            moving_spheres.push_back({s.center0,s.center1,s.time0,s.time1,s.radius,s.mat_ptr.get()});
+            return {prim_ref_t::moving_sphere,uint32_t(moving_spheres.size()-1)};
+        }
+        if(type==typeid(rect_t))
+        {
+            rects.push_back(rect(static_cast<const rect_t&>(object)));
+            return {prim_ref_t::rect,uint32_t(rects.size()-1)};
+        }
+        if(type==typeid(xrect_t))
+        {
+            auto &plane=static_cast<const xrect_t&>(object).rect;
+            xrects.push_back({plane.center,plane.width,plane.height,plane.n,plane.d,plane.mat_ptr.get()});
+            return {prim_ref_t::xrect,uint32_t(xrects.size()-1)};
+        }
+        if(type==typeid(box_t) && is_six_rects(static_cast<const box_t&>(object)))
+        {
+            auto &sides=static_cast<const box_t&>(object).sides.objects;
+            box_prim_t b;
+            for(int i=0;i<6;i++)
+                b.sides[i]=rect(static_cast<const rect_t&>(*sides[i]));
+            boxes.push_back(b);
+            return {prim_ref_t::box,uint32_t(boxes.size()-1)};
+        }
+        if(type==typeid(constant_medium_t))
+        {
+            auto &m=static_cast<const constant_medium_t&>(object);
+            media.push_back({m.boundary.get(),m.neg_inv_density,m.phase_function.get()});
+            return {prim_ref_t::medium,uint32_t(media.size()-1)};
+        }
+        others.push_back(&object);
+        return {prim_ref_t::other,uint32_t(others.size()-1)};
+    }
+
+    // t of ref's hit in [t_min,t_max].  part is the side of a box, rec the
+    // record of an other, which cannot be rebuilt from t.
+    bool intersect(prim_ref_t ref,const ray_t &r,real_t t_min,real_t t_max,real_t &t,uint32_t &part,hit_record_t &rec)const
+    {
+        auto i=ref.index();
+        switch(ref.type())
+        {
+        case prim_ref_t::sphere:
+            return spheres[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::moving_sphere:
+            return moving_spheres[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::rect:
+            return rects[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::xrect:
+            return xrects[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::box:
+            return boxes[i].intersect(r,t_min,t_max,t,part);
+        case prim_ref_t::medium:
+            return media[i].intersect(r,t_min,t_max,t);
+        default:
+        {
+            auto [is_hit,other_rec]=others[i]->hit(r,t_min,t_max);
+            if(is_hit)
+            {
+                t=other_rec.t;
+                rec=other_rec;
+            }
+            return is_hit;
+        }
+        }
+    }
+    bool occluded(prim_ref_t ref,const ray_t &r,real_t t_min,real_t t_max)const
+    {
+        real_t t;
+        uint32_t part;
+        auto i=ref.index();
+        switch(ref.type())
+        {
+        case prim_ref_t::sphere:
+            return spheres[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::moving_sphere:
+            return moving_spheres[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::rect:
+            return rects[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::xrect:
+            return xrects[i].intersect(r,t_min,t_max,t);
+        case prim_ref_t::box:
+            return boxes[i].intersect(r,t_min,t_max,t,part);
+        case prim_ref_t::medium:
+            return media[i].intersect(r,t_min,t_max,t);
+        default:
+            return others[i]->occluded(r,t_min,t_max);
+        }
+    }
+    // the record of a hit intersect() found, others keep theirs
+    void record(prim_ref_t ref,uint32_t part,const ray_t &r,real_t t,hit_record_t &rec)const
+    {
+        auto i=ref.index();
+        switch(ref.type())
+        {
+        case prim_ref_t::sphere:        rec=spheres[i].record(r,t); break;
+        case prim_ref_t::moving_sphere: rec=moving_spheres[i].record(r,t); break;
+        case prim_ref_t::rect:          rec=rects[i].record(r,t); break;
+        case prim_ref_t::xrect:         rec=xrects[i].record(r,t); break;
+        case prim_ref_t::box:           rec=boxes[i].sides[part].record(r,t); break;
+        case prim_ref_t::medium:        rec=media[i].record(r,t); break;
+        default: break;
+        }
+    }
+
+    size_t bytes()const
+    {
+        return spheres.size()*sizeof(sphere_prim_t)+moving_spheres.size()*sizeof(moving_sphere_prim_t)+rects.size()*sizeof(rect_prim_t)
+              +xrects.size()*sizeof(xrect_prim_t)+boxes.size()*sizeof(box_prim_t)+media.size()*sizeof(medium_prim_t)+others.size()*sizeof(const hittable_t*);
+    }
+
+private:
+    static rect_prim_t rect(const rect_t &r)
+    {
+        return {r.n,r.min,r.max,r.d,r.mat_ptr.get()};
+    }
+    static bool is_six_rects(const box_t &b)
+    {
+        if(b.sides.objects.size()!=6)
+            return false;
+        for(auto &side:b.sides.objects)
+            if(typeid(*side)!=typeid(rect_t))
+                return false;
+        return true;
+    }
+};
+
+// wide_bvh_t's tree over prim_arrays_t: leaves hold prim_ref_t and a hit is
+// a switch over dense arrays rather than a virtual call per primitive.  Only
+// the nearest hit builds a record.  The tree is built once, it has no refit.
+template<int N>
+class typed_bvh_t:public hittable_t
+{
+public:
+    std::vector<wide_bvh_node_t<N>> nodes;
+    std::vector<prim_ref_t> refs;                       // in leaf order
+    prim_arrays_t arrays;
+    std::vector<std::shared_ptr<hittable_t>> objects;   // own the materials and boundaries
+    aabb_t box;
+
+    static constexpr int stack_size=64*N;
+    static_assert(N*(bvh_builder_t::max_depth+1)<=stack_size,"traversal stack shallower than the deepest tree");
+
+    typed_bvh_t()=default;
+    typed_bvh_t(const hittable_list_t &list,double time0,double time1,const bvh_build_options_t &options=bvh_build_options_t())
+    {
+        wide_bvh_t<N> tree(list,time0,time1,options);
+        nodes=std::move(tree.nodes);
+        objects=std::move(tree.objects);
+        box=tree.box;
+        // arrays fill in leaf order, so neighbouring leaves read neighbouring data
+        refs.reserve(objects.size());
+        for(auto &object:objects)
+            refs.push_back(arrays.add(*object));
+    }
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        hit_record_t rec{};
+        if(nodes.empty())
+            return {false,rec};
+        prim_ref_t nearest;
+        uint32_t nearest_part=0;
+        bool hit_anything=false;
+        wide_ray_t ray(r);
+        entry_t stack[stack_size];
+        int top=0;
+        stack[top++]={0,0,-std::numeric_limits<float>::infinity()};
+        alignas(32) float dist[N];
+        while(top)
+        {
+            auto entry=stack[--top];
+            if(entry.dist>t_max)
+                continue;
+            if(entry.count)
+            {
+                for(int i=entry.child;i<entry.child+entry.count;i++)
+                {
+                    real_t t;
+                    uint32_t part=0;
+                    if(arrays.intersect(refs[i],r,t_min,t_max,t,part,rec))
+                    {
+                        hit_anything=true;
+                        t_max=t;
+                        nearest=refs[i];
+                        nearest_part=part;
+                    }
+                }
+                continue;
+            }
+            auto &node=nodes[entry.child];
+            int mask=wide_box_hit<N>(node,ray,float(t_min),float(t_max),dist);
+            int order[N];
+            int n=wide_sort_children<N>(mask,dist,order);
+            for(int k=0;k<n;k++)
+            {
+                auto c=order[k];
+                stack[top++]={node.child[c],node.count[c],dist[c]};
+            }
+        }
+        if(hit_anything)
+            arrays.record(nearest,nearest_part,r,t_max,rec);
+        return {hit_anything,rec};
+    }
+    // no near-first ordering, any primitive in range ends the walk
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        if(nodes.empty())
+            return false;
+        wide_ray_t ray(r);
+        entry_t stack[stack_size];
+        int top=0;
+        stack[top++]={0,0,0};
+        alignas(32) float dist[N];
+        while(top)
+        {
+            auto entry=stack[--top];
+            if(entry.count)
+            {
+                for(int i=entry.child;i<entry.child+entry.count;i++)
+                    if(arrays.occluded(refs[i],r,t_min,t_max))
+                        return true;
+                continue;
+            }
+            auto &node=nodes[entry.child];
+            int mask=wide_box_hit<N>(node,ray,float(t_min),float(t_max),dist);
+            for(int c=0;c<N;c++)
+                if(mask>>c&1)
+                    stack[top++]={node.child[c],node.count[c],dist[c]};
+        }
+        return false;
+    }
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1) const override
+    {
+        return {nodes.empty()==false,box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_materials(out);
+    }
+    // lights are sampled through their objects
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_lights(out);
+    }
+    virtual bool has_media()const override
+    {
+        for(auto &object:objects)
+            if(object->has_media())
+                return true;
+        return false;
+    }
+
+private:
+    struct entry_t
+    {
+        int32_t  child;
+        uint16_t count;
+        float    dist;
+    };
+};
+
+using typed_bvh4_t=typed_bvh_t<4>;
+using typed_bvh8_t=typed_bvh_t<8>;
+
+#endif
@@ -4,13 +4,14 @@
 #include<cstdio>
 #include <limits>
 #include<cstdlib>
+#include<sampler.h>
 
 constexpr double pi=3.1415926535897932385;
 constexpr double infinity = std::numeric_limits<double>::infinity();
 
 inline double rand_uniform()
 {
-    return rand()/(RAND_MAX + 1.0);
+    return thread_rng().next_double();
 }
 
 inline double rand_double(double min, double max)
@@ -42,118 +43,150 @@ inline double dtor(double degrees)
     return degrees_to_radians(degrees);
 }
 
-class vec3_t 
+// Scalar of the geometry: points, directions, rays, boxes and primitives.
+// -DRT_FLOAT traces in float, which halves BVH nodes and primitives and
+// doubles the lanes per SIMD register.  Colours and the shading arithmetic
+// stay double unless -DRT_FLOAT_SHADING is also given.
+#ifdef RT_FLOAT
+using real_t=float;
+#else
+using real_t=double;
+#endif
+#ifdef RT_FLOAT_SHADING
+using shade_t=float;
+#else
+using shade_t=double;
+#endif
+
+template<class T>
+class basic_vec3_t 
 {
 public:
-    double x,y,z;
+    using scalar_t=T;
+    T x,y,z;
 
-    vec3_t()=default;
-    vec3_t(double x,double y,double z):x(x),y(y),z(z){}
+    basic_vec3_t()=default;
+    basic_vec3_t(T x,T y,T z):x(x),y(y),z(z){}
+    template<class U>
+    basic_vec3_t(const basic_vec3_t<U> &v):x(T(v.x)),y(T(v.y)),z(T(v.z)){}
 
-    vec3_t operator-()const{return vec3_t(-x,-y,-z);}
-    vec3_t& operator+=(const vec3_t &v)
+    basic_vec3_t operator-()const{return basic_vec3_t(-x,-y,-z);}
+    basic_vec3_t& operator+=(const basic_vec3_t &v)
     {
         x+=v.x;
         y+=v.y;
         z+=v.z;
         return *this;
     }
-    vec3_t& operator-=(const vec3_t &v)
+    basic_vec3_t& operator-=(const basic_vec3_t &v)
     {
         x-=v.x;
         y-=v.y;
         z-=v.z;
         return *this;
     }
-    vec3_t& operator*=(const double t)
+    basic_vec3_t& operator*=(const T t)
     {
         x*=t;
         y*=t;
         z*=t;
         return *this;
     }
-    vec3_t& operator/=(const double t)
+    basic_vec3_t& operator/=(const T t)
     {
         x/=t;
         y/=t;
         z/=t;
         return *this;
     }
-    double len() const
+    T len() const
     {
         return std::sqrt(len_squared());
     }
-    double len_squared() const
+    T len_squared() const
     {
         return x*x+y*y+z*z;
     }
-    vec3_t unit() const
+    basic_vec3_t unit() const
     {
-        vec3_t v=*this;
+        basic_vec3_t v=*this;
         v/=len();
         return v;
     }
 
     bool near_zero()const
     {
-        constexpr double e=1e-8;
-        return fabs(x)<e && fabs(y)<e && fabs(z)<e;
+        constexpr T e=T(1e-8);
+        return std::fabs(x)<e && std::fabs(y)<e && std::fabs(z)<e;
     }
 
-    static inline vec3_t random() {
-        return vec3_t(rand_uniform(), rand_uniform(), rand_uniform());
+    static inline basic_vec3_t random() {
+        return basic_vec3_t(T(rand_uniform()), T(rand_uniform()), T(rand_uniform()));
     }
 
-    static inline vec3_t random(double min, double max) {
-        return vec3_t(rand_double(min,max), rand_double(min,max), rand_double(min,max));
+    static inline basic_vec3_t random(double min, double max) {
+        return basic_vec3_t(T(rand_double(min,max)), T(rand_double(min,max)), T(rand_double(min,max)));
     }
 
 };
 
-inline vec3_t operator+(const vec3_t &u,const vec3_t &v)
+template<class T>
+inline basic_vec3_t<T> operator+(const basic_vec3_t<T> &u,const basic_vec3_t<T> &v)
 {
-    return vec3_t(u.x+v.x,u.y+v.y,u.z+v.z);
+    return basic_vec3_t<T>(u.x+v.x,u.y+v.y,u.z+v.z);
 }
 
-inline vec3_t operator-(const vec3_t &u,const vec3_t &v)
+template<class T>
+inline basic_vec3_t<T> operator-(const basic_vec3_t<T> &u,const basic_vec3_t<T> &v)
 {
-    return vec3_t(u.x-v.x,u.y-v.y,u.z-v.z);
+    return basic_vec3_t<T>(u.x-v.x,u.y-v.y,u.z-v.z);
 }
 
-inline vec3_t operator*(const vec3_t &u,const vec3_t &v)
+template<class T>
+inline basic_vec3_t<T> operator*(const basic_vec3_t<T> &u,const basic_vec3_t<T> &v)
 {
-    return vec3_t(u.x*v.x,u.y*v.y,u.z*v.z);
+    return basic_vec3_t<T>(u.x*v.x,u.y*v.y,u.z*v.z);
 }
 
-inline vec3_t operator*(const vec3_t &u,double t)
+// the scalar is converted to the vector's type, so vec*0.5 stays a float vector in float mode
+template<class T>
+inline basic_vec3_t<T> operator*(const basic_vec3_t<T> &u,typename basic_vec3_t<T>::scalar_t t)
 {
-    return vec3_t(u.x*t,u.y*t,u.z*t);
+    return basic_vec3_t<T>(u.x*t,u.y*t,u.z*t);
 }
 
-inline vec3_t operator*(double t,const vec3_t &u)
+template<class T>
+inline basic_vec3_t<T> operator*(typename basic_vec3_t<T>::scalar_t t,const basic_vec3_t<T> &u)
 {
-    return vec3_t(u.x*t,u.y*t,u.z*t);
+    return basic_vec3_t<T>(u.x*t,u.y*t,u.z*t);
 }
 
-inline vec3_t operator/(vec3_t v,double t)
+template<class T>
+inline basic_vec3_t<T> operator/(basic_vec3_t<T> v,typename basic_vec3_t<T>::scalar_t t)
 {
     v/=t;
     return v;
 }
 
-inline double dot(const vec3_t &u,const vec3_t &v)
+template<class T>
+inline T dot(const basic_vec3_t<T> &u,const basic_vec3_t<T> &v)
 {
     return u.x*v.x+u.y*v.y+u.z*v.z;
 }
 
-inline vec3_t cross(const vec3_t &u,const vec3_t &v)
+template<class T>
+inline basic_vec3_t<T> cross(const basic_vec3_t<T> &u,const basic_vec3_t<T> &v)
 {
-    return vec3_t(
+    return basic_vec3_t<T>(
         u.y*v.z-u.z*v.y,
         u.z*v.x-u.x*v.z,
         u.x*v.y-u.y*v.x);
 }
 
+using vec3_t=basic_vec3_t<real_t>;
+using point3_t=vec3_t;
+using colour_t=basic_vec3_t<shade_t>;
+
 inline vec3_t random_in_unit_sphere()
 {
     while (true)
@@ -167,25 +200,23 @@ inline vec3_t random_in_unit_sphere()
 
 inline vec3_t random_in_hemisphere(const vec3_t& normal) {
     vec3_t in_unit_sphere = random_in_unit_sphere();
-    if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
+    if (dot(in_unit_sphere, normal) > 0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
         return -in_unit_sphere;
 }
 
-vec3_t random_in_unit_disk()
+inline vec3_t random_in_unit_disk()
 {
     while (true)
     {
-        auto p = vec3_t(rand_double(-1, 1), rand_double(-1, 1), 0);
+        auto p = vec3_t(real_t(rand_double(-1, 1)), real_t(rand_double(-1, 1)), 0);
         if (p.len_squared() >= 1)
             continue;
         return p;
     }
 }
 
-using colour_t=vec3_t;
-using point3_t=vec3_t;
 
 inline void write_clour(const colour_t &pixel_colour)
 {
@@ -195,7 +226,8 @@ inline void write_clour(const colour_t &pixel_colour)
     std::printf("%d %d %d\n",r,g,b);
 }
 #include<iostream>
-std::ostream& operator<<(std::ostream& out,const vec3_t &v)
+template<class T>
+std::ostream& operator<<(std::ostream& out,const basic_vec3_t<T> &v)
 {
     out<<v.x<<","<<v.y<<","<<v.z;
     return out;
@@ -0,0 +1,310 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include<hittable.h>
+#include<material.h>
+#include<compiled_material.h>
+#include<camera.h>
+#include<scheduler.h>
+#include<vector>
+#include<numeric>
+#include<algorithm>
+
+// Path states of one batch, one array per field.  Stages walk the arrays in
+// order so each stage runs one tight loop over the whole queue.
+struct path_queue_t
+{
+    std::vector<double> ox,oy,oz;
+    std::vector<double> dx,dy,dz;
+    std::vector<double> tm;
+    std::vector<double> thr_r,thr_g,thr_b;     // throughput
+    std::vector<double> rad_r,rad_g,rad_b;     // radiance gathered so far
+    std::vector<int>    pixel;
+    std::vector<int>    depth;                 // bounces left
+    std::vector<pcg32_t> rng;                  // each path keeps its own random stream
+
+    size_t size()const{return pixel.size();}
+
+    void clear()
+    {
+        for(auto v:{&ox,&oy,&oz,&dx,&dy,&dz,&tm,&thr_r,&thr_g,&thr_b,&rad_r,&rad_g,&rad_b})
+            v->clear();
+        pixel.clear();
+        depth.clear();
+        rng.clear();
+    }
+    void reserve(size_t n)
+    {
+        for(auto v:{&ox,&oy,&oz,&dx,&dy,&dz,&tm,&thr_r,&thr_g,&thr_b,&rad_r,&rad_g,&rad_b})
+            v->reserve(n);
+        pixel.reserve(n);
+        depth.reserve(n);
+        rng.reserve(n);
+    }
+    void push(const ray_t &r,int pixel_index,int max_depth)
+    {
+        ox.push_back(r.orig.x);
+        oy.push_back(r.orig.y);
+        oz.push_back(r.orig.z);
+        dx.push_back(r.dir.x);
+        dy.push_back(r.dir.y);
+        dz.push_back(r.dir.z);
+        tm.push_back(r.tm);
+        thr_r.push_back(1);
+        thr_g.push_back(1);
+        thr_b.push_back(1);
+        rad_r.push_back(0);
+        rad_g.push_back(0);
+        rad_b.push_back(0);
+        pixel.push_back(pixel_index);
+        depth.push_back(max_depth);
+        rng.push_back(thread_rng());
+    }
+    ray_t ray(size_t i)const
+    {
+        return ray_t(point3_t(ox[i],oy[i],oz[i]),vec3_t(dx[i],dy[i],dz[i]),tm[i]);
+    }
+    void set_ray(size_t i,const ray_t &r)
+    {
+        ox[i]=r.orig.x;
+        oy[i]=r.orig.y;
+        oz[i]=r.orig.z;
+        dx[i]=r.dir.x;
+        dy[i]=r.dir.y;
+        dz[i]=r.dir.z;
+        tm[i]=r.tm;
+    }
+    // moves path src into slot dst, used to compact the queue
+    void move(size_t dst,size_t src)
+    {
+        for(auto v:{&ox,&oy,&oz,&dx,&dy,&dz,&tm,&thr_r,&thr_g,&thr_b,&rad_r,&rad_g,&rad_b})
+            (*v)[dst]=(*v)[src];
+        pixel[dst]=pixel[src];
+        depth[dst]=depth[src];
+        rng[dst]=rng[src];
+    }
+    void resize(size_t n)
+    {
+        for(auto v:{&ox,&oy,&oz,&dx,&dy,&dz,&tm,&thr_r,&thr_g,&thr_b,&rad_r,&rad_g,&rad_b})
+            v->resize(n);
+        pixel.resize(n);
+        depth.resize(n);
+        rng.resize(n);
+    }
+    // fills the queue with the paths of from in the given order, one field
+    // at a time so every loop writes one array straight through
+    void gather(const path_queue_t &from,const std::vector<uint32_t> &order)
+    {
+        resize(order.size());
+        for(auto f:{&path_queue_t::ox,&path_queue_t::oy,&path_queue_t::oz,&path_queue_t::dx,&path_queue_t::dy,&path_queue_t::dz,&path_queue_t::tm,
+                    &path_queue_t::thr_r,&path_queue_t::thr_g,&path_queue_t::thr_b,&path_queue_t::rad_r,&path_queue_t::rad_g,&path_queue_t::rad_b})
+            for(size_t i=0;i<order.size();i++)
+                (this->*f)[i]=(from.*f)[order[i]];
+        for(size_t i=0;i<order.size();i++)
+            pixel[i]=from.pixel[order[i]];
+        for(size_t i=0;i<order.size();i++)
+            depth[i]=from.depth[order[i]];
+        for(size_t i=0;i<order.size();i++)
+            rng[i]=from.rng[order[i]];
+    }
+};
+
+// Stream path tracer computing the same estimator as ray_colour():
+// generate -> intersect -> sort by material -> shade -> extend/terminate,
+// repeated on a batch until every path in it has terminated.  Rays are
+// intersected in packets of neighbouring queue slots, one by one when the
+// world has media, and the sort moves
+// the paths and their hits so shade() walks every array in order.
+class wavefront_integrator_t
+{
+public:
+    const hittable_list_t &world;
+    const compiled_materials_t &materials;
+    const camera_t &camera;
+    colour_t background;
+    int max_depth;
+    size_t batch_size;
+
+    wavefront_integrator_t(const hittable_list_t &world,const compiled_materials_t &materials,const camera_t &camera,const colour_t &background={0,0,0},int max_depth=50,size_t batch_size=1<<16)
+        :world(world),materials(materials),camera(camera),background(background),max_depth(max_depth),batch_size(batch_size),has_media(world.has_media())
+    {
+    }
+
+    // Renders samples [first_sample,first_sample+samples) of one tile into
+    // framebuffer, whose rows count from the top.
+    void render(int image_height,int image_width,const tile_t &tile,int first_sample,int samples,std::vector<colour_t> &framebuffer)
+    {
+        int tile_width=tile.x1-tile.x0;
+        int rows_per_batch=std::max(1,int(batch_size/(size_t(tile_width)*samples)));
+        for(int y=tile.y0;y<tile.y1;y+=rows_per_batch)
+        {
+            tile_t batch{tile.x0,y,tile.x1,std::min(y+rows_per_batch,tile.y1)};
+            std::vector<colour_t> film(size_t(batch.y1-batch.y0)*tile_width,colour_t(0,0,0));
+            generate(image_height,image_width,batch,first_sample,samples);
+            while(queue.size())
+            {
+                intersect();
+                sort_by_material();
+                shade();
+                extend(film);
+            }
+            for(int yy=batch.y0;yy<batch.y1;yy++)
+                for(int x=batch.x0;x<batch.x1;x++)
+                    framebuffer[size_t(yy)*image_width+x]=film[size_t(yy-batch.y0)*tile_width+x-batch.x0]*(1.0/samples);
+        }
+    }
+
+private:
+    bool has_media;
+    path_queue_t queue;
+    std::vector<char> is_hit;
+    std::vector<hit_record_t> recs;
+    path_queue_t sorted;                // the sort's destination, swapped in
+    std::vector<char> sorted_hit;
+    std::vector<hit_record_t> sorted_recs;
+    std::vector<uint32_t> order;
+    std::vector<size_t> first;          // first slot of each material
+
+    void generate(int image_height,int image_width,const tile_t &batch,int first_sample,int samples)
+    {
+        queue.clear();
+        queue.reserve(size_t(batch.y1-batch.y0)*(batch.x1-batch.x0)*samples);
+        int pixel_index=0;
+        for(int y=batch.y0;y<batch.y1;y++)
+        {
+            int i=image_height-1-y;
+            for(int j=batch.x0;j<batch.x1;j++,pixel_index++)
+            {
+                for(int k=first_sample;k<first_sample+samples;k++)
+                {
+                    seed_sample(size_t(y)*image_width+j,k);
+                    auto v = (i+rand_double(-1,1)) / image_height;
+                    auto u = (j+rand_double(-1,1)) / image_width;
+                    queue.push(camera.get_ray(u,v),pixel_index,max_depth);
+                }
+            }
+        }
+    }
+
+    void intersect()
+    {
+        auto n=queue.size();
+        is_hit.resize(n);
+        recs.resize(n);
+        if(has_media)
+        {
+            // Media draw random numbers while intersecting, from the path's
+            // own stream and in a lone ray's traversal order, which a packet
+            // does not keep.
+            for(size_t i=0;i<n;i++)
+            {
+                thread_rng()=queue.rng[i];
+                auto [hit,rec]=world.hit(queue.ray(i),ray_t_min,infinity);
+                queue.rng[i]=thread_rng();
+                is_hit[i]=hit;
+                recs[i]=rec;
+            }
+            return;
+        }
+        ray_packet_t packet;
+        for(size_t i=0;i<n;i+=ray_packet_t::max_size)
+        {
+            packet.size=int(std::min<size_t>(ray_packet_t::max_size,n-i));
+            for(int l=0;l<packet.size;l++)
+                packet.set(l,queue.ray(i+l),infinity);
+            world.hit_packet(packet,(uint32_t(1)<<packet.size)-1,ray_t_min);
+            for(int l=0;l<packet.size;l++)
+            {
+                is_hit[i+l]=packet.is_hit[l];
+                recs[i+l]=packet.rec[l];
+            }
+        }
+    }
+
+    // Groups paths by material so shade() runs one scatter kind at a time:
+    // a stable counting sort on the material's slot in the table, hits on
+    // materials outside it next and misses last, then the queue and the
+    // hits are gathered into that order.
+    void sort_by_material()
+    {
+        auto n=queue.size();
+        auto table=materials.materials.size();
+        auto key=[&](size_t i){
+            if(is_hit[i]==false)
+                return table+1;
+            auto id=recs[i].mat_ptr->id;
+            return id<table?size_t(id):table;
+        };
+        first.assign(table+3,0);
+        for(size_t i=0;i<n;i++)
+            first[key(i)+1]++;
+        std::partial_sum(begin(first),end(first),begin(first));
+        order.resize(n);
+        for(size_t i=0;i<n;i++)
+            order[first[key(i)]++]=uint32_t(i);
+
+        sorted.gather(queue,order);
+        std::swap(queue,sorted);
+        sorted_hit.resize(n);
+        sorted_recs.resize(n);
+        for(size_t i=0;i<n;i++)
+            sorted_hit[i]=is_hit[order[i]];
+        for(size_t i=0;i<n;i++)
+            sorted_recs[i]=recs[order[i]];
+        std::swap(is_hit,sorted_hit);
+        std::swap(recs,sorted_recs);
+    }
+
+    void shade()
+    {
+        for(size_t i=0;i<queue.size();i++)
+        {
+            if(is_hit[i]==false)
+            {
+                queue.rad_r[i]+=queue.thr_r[i]*background.x;
+                queue.rad_g[i]+=queue.thr_g[i]*background.y;
+                queue.rad_b[i]+=queue.thr_b[i]*background.z;
+                queue.depth[i]=0;
+                continue;
+            }
+            auto &rec=recs[i];
+            thread_rng()=queue.rng[i];
+            auto [is_reflect, attenuation, scattered] = materials.scatter(queue.ray(i), rec);
+            queue.rng[i]=thread_rng();
+            auto emitted=materials.emitted(rec);
+            queue.rad_r[i]+=queue.thr_r[i]*emitted.x;
+            queue.rad_g[i]+=queue.thr_g[i]*emitted.y;
+            queue.rad_b[i]+=queue.thr_b[i]*emitted.z;
+            if(is_reflect==false)
+            {
+                queue.depth[i]=0;
+                continue;
+            }
+            queue.thr_r[i]*=attenuation.x;
+            queue.thr_g[i]*=attenuation.y;
+            queue.thr_b[i]*=attenuation.z;
+            queue.set_ray(i,scattered);
+            queue.depth[i]--;
+        }
+    }
+
+    // splats terminated paths into the film and compacts the survivors
+    void extend(std::vector<colour_t> &film)
+    {
+        size_t alive=0;
+        for(size_t i=0;i<queue.size();i++)
+        {
+            if(queue.depth[i]<=0)
+            {
+                film[queue.pixel[i]]+=colour_t(queue.rad_r[i],queue.rad_g[i],queue.rad_b[i]);
+                continue;
+            }
+            if(alive!=i)
+                queue.move(alive,i);
+            alive++;
+        }
+        queue.resize(alive);
+    }
+};
+
+#endif
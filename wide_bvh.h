@@ -0,0 +1,736 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include<hittable.h>
+#include<aabb.h>
+#include<bvh.h>
+#include<cstdint>
+#include<cmath>
+#if defined(__SSE2__) || defined(_M_X64)
+#include<immintrin.h>
+#define WIDE_BVH_SSE
+#endif
+
+// N children per node with their bounds in SoA layout so one slab test per
+// axis checks all of them.  Bounds are floats rounded outwards, which halves
+// the node size and doubles the lanes per instruction.  A slot is either an
+// inner node (count==0, child = node index), a leaf (count prims starting at
+// child) or empty (child==-1, inverted bounds that never hit).  Nodes are in
+// depth first order, so a subtree is a contiguous run of nodes and of
+// primitives.
+template<int N>
+struct alignas(32) wide_bvh_node_t
+{
+    float    bounds[6][N];   // min x,y,z then max x,y,z
+    int32_t  child[N];
+    uint16_t count[N];
+};
+
+// Ray in the float form the wide box test wants, built once per ray.
+struct wide_ray_t
+{
+    float org[3];
+    float inv[3];
+    int   near[3];
+    int   far[3];
+
+    wide_ray_t()=default;
+    wide_ray_t(const ray_t &r)
+    {
+        double o[3]={r.origin().x,r.origin().y,r.origin().z};
+        double d[3]={r.direction().x,r.direction().y,r.direction().z};
+        for(int a=0;a<3;a++)
+        {
+            org[a]=float(o[a]);
+            inv[a]=float(1.0/d[a]);
+            near[a]=inv[a]<0?a+3:a;
+            far[a]=inv[a]<0?a:a+3;
+        }
+    }
+};
+
+// widens the exit distance by the worst rounding of the float slab test
+constexpr float wide_bvh_t_far_scale=1+2*3*std::numeric_limits<float>::epsilon();
+
+inline float round_down(double x)
+{
+    auto f=float(x);
+    if(double(f)>x)
+        f=std::nextafter(f,-std::numeric_limits<float>::infinity());
+    return f;
+}
+
+inline float round_up(double x)
+{
+    auto f=float(x);
+    if(double(f)<x)
+        f=std::nextafter(f,std::numeric_limits<float>::infinity());
+    return f;
+}
+
+// Returns a bit per child whose box the ray enters within [t_min,t_max] and
+// stores the entry distances in dist.
+template<int N>
+inline int wide_box_hit(const wide_bvh_node_t<N> &node,const wide_ray_t &r,float t_min,float t_max,float *dist)
+{
+    int mask=0;
+#if defined(WIDE_BVH_SSE)
+    static_assert(N%4==0,"SSE path handles 4 children at a time");
+    for(int c=0;c<N;c+=4)
+    {
+        __m128 tn=_mm_set1_ps(t_min);
+        __m128 tf=_mm_set1_ps(t_max);
+        for(int a=0;a<3;a++)
+        {
+            __m128 o=_mm_set1_ps(r.org[a]);
+            __m128 inv=_mm_set1_ps(r.inv[a]);
+            __m128 t0=_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.near[a]]+c),o),inv);
+            __m128 t1=_mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.far[a]]+c),o),inv);
+            // a NaN from 0*inf picks the second operand, i.e. is ignored
+            tn=_mm_max_ps(t0,tn);
+            tf=_mm_min_ps(t1,tf);
+        }
+        tf=_mm_mul_ps(tf,_mm_set1_ps(wide_bvh_t_far_scale));
+        mask|=_mm_movemask_ps(_mm_cmple_ps(tn,tf))<<c;
+        _mm_storeu_ps(dist+c,tn);
+    }
+#else
+    for(int c=0;c<N;c++)
+    {
+        float tn=t_min;
+        float tf=t_max;
+        for(int a=0;a<3;a++)
+        {
+            float t0=(node.bounds[r.near[a]][c]-r.org[a])*r.inv[a];
+            float t1=(node.bounds[r.far[a]][c]-r.org[a])*r.inv[a];
+            tn=t0>tn?t0:tn;
+            tf=t1<tf?t1:tf;
+        }
+        if(tn<=tf*wide_bvh_t_far_scale)
+            mask|=1<<c;
+        dist[c]=tn;
+    }
+#endif
+    return mask;
+}
+
+#if defined(__AVX__)
+template<>
+inline int wide_box_hit<8>(const wide_bvh_node_t<8> &node,const wide_ray_t &r,float t_min,float t_max,float *dist)
+{
+    __m256 tn=_mm256_set1_ps(t_min);
+    __m256 tf=_mm256_set1_ps(t_max);
+    for(int a=0;a<3;a++)
+    {
+        __m256 o=_mm256_set1_ps(r.org[a]);
+        __m256 inv=_mm256_set1_ps(r.inv[a]);
+        __m256 t0=_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.near[a]]),o),inv);
+        __m256 t1=_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[r.far[a]]),o),inv);
+        tn=_mm256_max_ps(t0,tn);
+        tf=_mm256_min_ps(t1,tf);
+    }
+    tf=_mm256_mul_ps(tf,_mm256_set1_ps(wide_bvh_t_far_scale));
+    _mm256_storeu_ps(dist,tn);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tn,tf,_CMP_LE_OQ));
+}
+#endif
+
+// writes the children set in mask far to near, so the nearest is pushed last
+template<int N>
+inline int wide_sort_children(int mask,const float *dist,int *order)
+{
+    int n=0;
+    for(int c=0;c<N;c++)
+    {
+        if((mask>>c&1)==0)
+            continue;
+        int k=n++;
+        while(k>0 && dist[order[k-1]]<dist[c])
+        {
+            order[k]=order[k-1];
+            k--;
+        }
+        order[k]=c;
+    }
+    return n;
+}
+
+template<int N>
+class wide_bvh_t:public hittable_t
+{
+public:
+    std::vector<wide_bvh_node_t<N>> nodes;
+    std::vector<const hittable_t*> prims;
+    std::vector<std::shared_ptr<hittable_t>> objects;   // keeps prims alive
+    aabb_t box;
+    bvh_build_options_t options;
+    std::vector<double> built_quality;                  // per node, SAH cost per area when built
+
+    static constexpr int stack_size=64*N;
+    // at most N entries per level
+    static_assert(N*(bvh_builder_t::max_depth+1)<=stack_size,"traversal stack shallower than the deepest tree");
+
+    wide_bvh_t()=default;
+    // builds a binary SAH tree and collapses it into N-wide nodes
+    wide_bvh_t(const hittable_list_t &list,double time0,double time1,const bvh_build_options_t &options=bvh_build_options_t())
+        :options(options)
+    {
+        std::vector<aabb_t> boxes;
+        boxes.reserve(list.objects.size());
+        for(auto &object:list.objects)
+        {
+            auto [exist_box,box]=object->bounding_box(time0,time1);
+            if(exist_box==false)
+                std::fprintf(stderr,"error! wide bvh constructor\n");
+            boxes.push_back(box);
+        }
+        bvh_builder_t builder(boxes,options);
+        auto root=builder.build();
+        if(!root)
+            return;
+        box=root->box;
+        for(auto i:builder.indices)
+            objects.push_back(list.objects[i]);
+        for(auto &object:objects)
+            prims.push_back(object.get());
+        collapse(*root,nodes,0);
+        subtree_costs(nodes,cost);
+        built_quality.resize(nodes.size());
+        for(size_t k=0;k<nodes.size();k++)
+            built_quality[k]=cost_per_area(k);
+    }
+
+    virtual std::pair<bool, hit_record_t> hit(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        hit_record_t rec{};
+        if(nodes.empty())
+            return {false,rec};
+        bool is_hit=traverse(r,t_min,t_max,root_entry(),rec);
+        return {is_hit,rec};
+    }
+
+    // no near-first ordering, any primitive in range ends the walk
+    virtual bool occluded(const ray_t &r, real_t t_min, real_t t_max) const override
+    {
+        if(nodes.empty())
+            return false;
+        wide_ray_t ray(r);
+        entry_t stack[stack_size];
+        int top=0;
+        stack[top++]=root_entry();
+        alignas(32) float dist[N];
+        while(top)
+        {
+            auto entry=stack[--top];
+            if(entry.count)
+            {
+                for(int i=entry.child;i<entry.child+entry.count;i++)
+                    if(prims[i]->occluded(r,t_min,t_max))
+                        return true;
+                continue;
+            }
+            auto &node=nodes[entry.child];
+            int mask=wide_box_hit<N>(node,ray,float(t_min),float(t_max),dist);
+            for(int c=0;c<N;c++)
+                if(mask>>c&1)
+                    stack[top++]={node.child[c],node.count[c],dist[c]};
+        }
+        return false;
+    }
+
+    // Traverses the tree once for the whole packet.  A node is visited when
+    // any active lane enters it and only those lanes go on to its children.
+    // Lanes pointing into different octants, or a subtree that only a few
+    // lanes still reach, continue as single rays.
+    virtual void hit_packet(ray_packet_t &packet,uint32_t mask,real_t t_min)const override
+    {
+        if(nodes.empty() || mask==0)
+            return;
+        wide_ray_t rays[ray_packet_t::max_size];
+        int first=-1;
+        bool is_coherent=true;
+        for(int i=0;i<packet.size;i++)
+        {
+            if((mask>>i&1)==0)
+                continue;
+            rays[i]=wide_ray_t(packet.ray(i));
+            if(first<0)
+                first=i;
+            for(int a=0;a<3;a++)
+                is_coherent=is_coherent && rays[i].near[a]==rays[first].near[a];
+        }
+        if(is_coherent==false)
+        {
+            hittable_t::hit_packet(packet,mask,t_min);
+            return;
+        }
+
+        struct packet_entry_t
+        {
+            entry_t  entry;
+            uint32_t lanes;
+        };
+        const int min_lanes=std::max(packet.size/4,1);
+        packet_entry_t stack[stack_size];
+        int top=0;
+        stack[top++]={root_entry(),mask};
+        alignas(32) float dist[N];
+        while(top)
+        {
+            auto [entry,lanes]=stack[--top];
+            if(popcount(lanes)<=min_lanes)
+            {
+                for(int i=0;i<packet.size;i++)
+                {
+                    if((lanes>>i&1)==0)
+                        continue;
+                    hit_record_t rec{};
+                    if(traverse(packet.ray(i),t_min,packet.t_max[i],entry,rec))
+                        packet.update(i,rec);
+                }
+                continue;
+            }
+            if(entry.count)
+            {
+                for(int i=entry.child;i<entry.child+entry.count;i++)
+                    prims[i]->hit_packet(packet,lanes,t_min);
+                continue;
+            }
+            auto &node=nodes[entry.child];
+            uint32_t child_lanes[N]={};
+            float nearest[N];
+            std::fill(nearest,nearest+N,std::numeric_limits<float>::infinity());
+            int mask=0;
+            for(int i=0;i<packet.size;i++)
+            {
+                if((lanes>>i&1)==0)
+                    continue;
+                int lane_mask=wide_box_hit<N>(node,rays[i],float(t_min),float(packet.t_max[i]),dist);
+                mask|=lane_mask;
+                for(int c=0;c<N;c++)
+                {
+                    if((lane_mask>>c&1)==0)
+                        continue;
+                    child_lanes[c]|=1u<<i;
+                    nearest[c]=std::min(nearest[c],dist[c]);
+                }
+            }
+            int order[N];
+            int n=wide_sort_children<N>(mask,nearest,order);
+            for(int k=0;k<n;k++)
+            {
+                auto c=order[k];
+                stack[top++]={{node.child[c],node.count[c],nearest[c]},child_lanes[c]};
+            }
+        }
+    }
+    virtual std::pair<bool, aabb_t> bounding_box(double time0,double time1) const override
+    {
+        return {nodes.empty()==false,box};
+    }
+    virtual void collect_materials(std::vector<std::shared_ptr<material_t>> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_materials(out);
+    }
+    virtual void collect_lights(std::vector<const hittable_t*> &out)const override
+    {
+        for(auto &object:objects)
+            object->collect_lights(out);
+    }
+    virtual bool has_media()const override
+    {
+        for(auto &object:objects)
+            if(object->has_media())
+                return true;
+        return false;
+    }
+
+    // Recomputes every slot's bounds bottom-up from the primitives' boxes
+    // over [time0,time1], the topology stays.  Children follow their parent,
+    // so one backward pass over the nodes does it.
+    void refit(double time0,double time1)
+    {
+        for(size_t k=nodes.size();k-->0;)
+        {
+            auto &node=nodes[k];
+            for(int c=0;c<N;c++)
+            {
+                if(node.child[c]<0)
+                    continue;
+                if(node.count[c])
+                {
+                    auto first=node.child[c];
+                    auto slot=prims[first]->bounding_box(time0,time1).second;
+                    for(int i=first+1;i<first+node.count[c];i++)
+                        slot=surrounding_box(slot,prims[i]->bounding_box(time0,time1).second);
+                    set_slot(node,c,slot);
+                }
+                else
+                    set_slot(node,c,node_box(nodes[node.child[c]]));
+            }
+        }
+        if(nodes.size())
+            box=node_box(nodes[0]);
+        subtree_costs(nodes,cost);
+    }
+    // the root's quality after the last refit, 1 right after a build
+    double quality()const
+    {
+        return nodes.empty()?1:quality(0);
+    }
+    // Refits, then rebuilds what degraded: the largest subtrees past
+    // partial_ratio, or the whole tree past full_ratio or when those hold
+    // full_fraction of the primitives.
+    bvh_update_t update(double time0,double time1,const bvh_refit_options_t &refit_options={})
+    {
+        if(nodes.empty())
+            return bvh_update_t::refit;
+        refit(time0,time1);
+        if(quality(0)>=refit_options.full_ratio)
+            return rebuild_all(time0,time1);
+        std::vector<int32_t> degraded;
+        std::vector<int32_t> stack;
+        for(int c=0;c<N;c++)
+            if(nodes[0].child[c]>=0 && nodes[0].count[c]==0)
+                stack.push_back(nodes[0].child[c]);
+        while(stack.size())
+        {
+            auto k=stack.back();
+            stack.pop_back();
+            if(quality(k)>=refit_options.partial_ratio)
+            {
+                degraded.push_back(k);
+                continue;
+            }
+            for(int c=0;c<N;c++)
+                if(nodes[k].child[c]>=0 && nodes[k].count[c]==0)
+                    stack.push_back(nodes[k].child[c]);
+        }
+        if(degraded.empty())
+            return bvh_update_t::refit;
+        size_t degraded_prims=0;
+        for(auto k:degraded)
+        {
+            int32_t node_end,prim_first,prim_end;
+            subtree_range(k,node_end,prim_first,prim_end);
+            degraded_prims+=prim_end-prim_first;
+        }
+        if(degraded_prims>=refit_options.full_fraction*prims.size())
+            return rebuild_all(time0,time1);
+        std::sort(degraded.begin(),degraded.end());
+        rebuild(degraded,time0,time1);
+        subtree_costs(nodes,cost);
+        return bvh_update_t::partial;
+    }
+
+private:
+    std::vector<double> cost;     // SAH cost of each subtree, from the last refit
+
+    struct entry_t
+    {
+        int32_t  child;
+        uint16_t count;
+        float    dist;
+    };
+
+    static entry_t root_entry()
+    {
+        return {0,0,-std::numeric_limits<float>::infinity()};
+    }
+
+    static int popcount(uint32_t x)
+    {
+        int n=0;
+        for(;x;x&=x-1)
+            n++;
+        return n;
+    }
+
+    bool traverse(const ray_t &r,real_t t_min, real_t t_max,entry_t start,hit_record_t &temp_rec)const
+    {
+        bool hit_anything=false;
+        wide_ray_t ray(r);
+        entry_t stack[stack_size];
+        int top=0;
+        stack[top++]=start;
+        alignas(32) float dist[N];
+        while(top)
+        {
+            auto entry=stack[--top];
+            if(entry.dist>t_max)
+                continue;
+            if(entry.count)
+            {
+                for(int i=entry.child;i<entry.child+entry.count;i++)
+                {
+                    auto [is_hit,rec]=prims[i]->hit(r,t_min,t_max);
+                    if(is_hit)
+                    {
+                        hit_anything=true;
+                        t_max=rec.t;
+                        temp_rec=rec;
+                    }
+                }
+                continue;
+            }
+            auto &node=nodes[entry.child];
+            int mask=wide_box_hit<N>(node,ray,float(t_min),float(t_max),dist);
+            int order[N];
+            int n=wide_sort_children<N>(mask,dist,order);
+            for(int k=0;k<n;k++)
+            {
+                auto c=order[k];
+                stack[top++]={node.child[c],node.count[c],dist[c]};
+            }
+        }
+        return hit_anything;
+    }
+
+    static aabb_t slot_box(const wide_bvh_node_t<N> &node,int c)
+    {
+        return aabb_t(point3_t(node.bounds[0][c],node.bounds[1][c],node.bounds[2][c]),
+                      point3_t(node.bounds[3][c],node.bounds[4][c],node.bounds[5][c]));
+    }
+    static void set_slot(wide_bvh_node_t<N> &node,int c,const aabb_t &box)
+    {
+        auto lo=box.min();
+        auto hi=box.max();
+        node.bounds[0][c]=round_down(lo.x);
+        node.bounds[1][c]=round_down(lo.y);
+        node.bounds[2][c]=round_down(lo.z);
+        node.bounds[3][c]=round_up(hi.x);
+        node.bounds[4][c]=round_up(hi.y);
+        node.bounds[5][c]=round_up(hi.z);
+    }
+    // the union of the used slots, a node has at least one
+    static aabb_t node_box(const wide_bvh_node_t<N> &node)
+    {
+        auto box=slot_box(node,0);
+        for(int c=1;c<N;c++)
+            if(node.child[c]>=0)
+                box=surrounding_box(box,slot_box(node,c));
+        return box;
+    }
+    double cost_per_area(size_t k)const
+    {
+        auto area=surface_area(node_box(nodes[k]));
+        return area>0?cost[k]/area:1;
+    }
+    double quality(size_t k)const
+    {
+        return cost_per_area(k)/built_quality[k];
+    }
+    // a leaf slot costs its area times its count, a node adds the traversal
+    // cost times its area to its slots'
+    void subtree_costs(const std::vector<wide_bvh_node_t<N>> &tree,std::vector<double> &out)const
+    {
+        out.resize(tree.size());
+        for(size_t k=tree.size();k-->0;)
+        {
+            auto &node=tree[k];
+            out[k]=options.traversal_cost*surface_area(node_box(node));
+            for(int c=0;c<N;c++)
+            {
+                if(node.child[c]<0)
+                    continue;
+                out[k]+=node.count[c]?surface_area(slot_box(node,c))*node.count[c]:out[node.child[c]];
+            }
+        }
+    }
+    // the depth of every node, children always come after their parent; a
+    // wide tree is no deeper than the binary one it was collapsed from
+    std::vector<int> node_depths()const
+    {
+        std::vector<int> depth(nodes.size(),0);
+        for(size_t k=0;k<nodes.size();k++)
+            for(int c=0;c<N;c++)
+                if(nodes[k].child[c]>=0 && nodes[k].count[c]==0)
+                    depth[nodes[k].child[c]]=depth[k]+1;
+        return depth;
+    }
+    // the nodes [k,node_end) and primitives [prim_first,prim_end) of the
+    // subtree at node k, its nodes run up to the last node of its last inner slot
+    void subtree_range(int32_t k,int32_t &node_end,int32_t &prim_first,int32_t &prim_end)const
+    {
+        auto last=k;
+        while(true)
+        {
+            int32_t next=-1;
+            for(int c=0;c<N;c++)
+                if(nodes[last].child[c]>=0 && nodes[last].count[c]==0)
+                    next=nodes[last].child[c];
+            if(next<0)
+                break;
+            last=next;
+        }
+        node_end=last+1;
+        prim_first=int32_t(prims.size());
+        prim_end=0;
+        for(auto j=k;j<node_end;j++)
+        {
+            for(int c=0;c<N;c++)
+            {
+                if(nodes[j].child[c]<0 || nodes[j].count[c]==0)
+                    continue;
+                prim_first=std::min(prim_first,nodes[j].child[c]);
+                prim_end=std::max(prim_end,nodes[j].child[c]+int32_t(nodes[j].count[c]));
+            }
+        }
+    }
+    bvh_update_t rebuild_all(double time0,double time1)
+    {
+        hittable_list_t list;
+        list.objects=std::move(objects);
+        *this=wide_bvh_t(list,time0,time1,options);
+        return bvh_update_t::full;
+    }
+    // Builds the subtrees at the sorted, disjoint nodes in roots anew over
+    // the same primitives and splices them in with one pass over the nodes.
+    void rebuild(const std::vector<int32_t> &roots,double time0,double time1)
+    {
+        struct splice_t
+        {
+            int32_t begin,end;
+            std::vector<wide_bvh_node_t<N>> nodes;
+            int32_t shift;        // how far the nodes behind end move
+        };
+        std::vector<splice_t> splices;
+        int32_t shift=0;
+        auto depth=node_depths();
+        for(auto k:roots)
+        {
+            int32_t end,prim_first,prim_end;
+            subtree_range(k,end,prim_first,prim_end);
+            std::vector<aabb_t> boxes;
+            for(auto i=prim_first;i<prim_end;i++)
+                boxes.push_back(prims[i]->bounding_box(time0,time1).second);
+            bvh_builder_t builder(boxes,options);
+            auto root=builder.build(depth[k]);
+            std::vector<std::shared_ptr<hittable_t>> reordered;
+            for(auto i:builder.indices)
+                reordered.push_back(objects[prim_first+i]);
+            for(size_t i=0;i<reordered.size();i++)
+            {
+                objects[prim_first+i]=reordered[i];
+                prims[prim_first+i]=reordered[i].get();
+            }
+            splice_t splice{k,end,{},0};
+            collapse(*root,splice.nodes,prim_first);
+            shift+=int32_t(splice.nodes.size())-(end-k);
+            splice.shift=shift;
+            splices.push_back(std::move(splice));
+        }
+        // an old index moves by the shift of the last splice ending at or before it
+        auto new_index=[&](int32_t x){
+            auto it=std::upper_bound(splices.begin(),splices.end(),x,[](int32_t x,const splice_t &s){return x<s.end;});
+            return x+(it==splices.begin()?0:(it-1)->shift);
+        };
+        std::vector<wide_bvh_node_t<N>> out;
+        std::vector<double> out_quality;
+        out.reserve(nodes.size()+shift);
+        out_quality.reserve(out.capacity());
+        size_t next=0;
+        for(int32_t j=0;j<int32_t(nodes.size());)
+        {
+            if(next<splices.size() && j==splices[next].begin)
+            {
+                auto &splice=splices[next++];
+                std::vector<double> splice_cost;
+                subtree_costs(splice.nodes,splice_cost);
+                auto base=int32_t(out.size());
+                for(size_t i=0;i<splice.nodes.size();i++)
+                {
+                    auto node=splice.nodes[i];
+                    for(int c=0;c<N;c++)
+                        if(node.child[c]>=0 && node.count[c]==0)
+                            node.child[c]+=base;
+                    auto area=surface_area(node_box(node));
+                    out.push_back(node);
+                    out_quality.push_back(area>0?splice_cost[i]/area:1);
+                }
+                j=splice.end;
+                continue;
+            }
+            auto node=nodes[j];
+            for(int c=0;c<N;c++)
+                if(node.child[c]>=0 && node.count[c]==0)
+                    node.child[c]=new_index(node.child[c]);
+            out.push_back(node);
+            out_quality.push_back(built_quality[j]);
+            j++;
+        }
+        nodes=std::move(out);
+        built_quality=std::move(out_quality);
+    }
+
+    // Opens the inner slot with the largest surface area until N slots are
+    // used, appending the nodes to out.  Primitive offsets count from
+    // prim_base.
+    static int32_t collapse(const bvh_build_node_t &build_node,std::vector<wide_bvh_node_t<N>> &out,int32_t prim_base)
+    {
+        std::vector<const bvh_build_node_t*> slots;
+        if(build_node.is_leaf())
+            slots.push_back(&build_node);
+        else
+            slots={build_node.left.get(),build_node.right.get()};
+        while(slots.size()<size_t(N))
+        {
+            int best=-1;
+            double best_area=-1;
+            for(size_t i=0;i<slots.size();i++)
+            {
+                if(slots[i]->is_leaf())
+                    continue;
+                auto area=surface_area(slots[i]->box);
+                if(area>best_area)
+                {
+                    best_area=area;
+                    best=int(i);
+                }
+            }
+            if(best<0)
+                break;
+            auto opened=slots[best];
+            slots[best]=opened->left.get();
+            slots.push_back(opened->right.get());
+        }
+
+        auto index=int32_t(out.size());
+        out.emplace_back();
+        for(int c=0;c<N;c++)
+        {
+            auto &node=out[index];
+            if(size_t(c)>=slots.size())
+            {
+                for(int a=0;a<3;a++)
+                {
+                    node.bounds[a][c]=std::numeric_limits<float>::infinity();
+                    node.bounds[a+3][c]=-std::numeric_limits<float>::infinity();
+                }
+                node.child[c]=-1;
+                node.count[c]=0;
+                continue;
+            }
+            auto slot=slots[c];
+            set_slot(node,c,slot->box);
+            if(slot->is_leaf())
+            {
+                node.child[c]=prim_base+int32_t(slot->first);
+                node.count[c]=uint16_t(slot->count);
+            }
+            else
+            {
+                node.count[c]=0;
+                auto child=collapse(*slot,out,prim_base);
+                out[index].child[c]=child;   // out may have grown
+            }
+        }
+        return index;
+    }
+};
+
+using bvh4_t=wide_bvh_t<4>;
+using bvh8_t=wide_bvh_t<8>;
+
+#endif